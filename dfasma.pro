@@ -39,6 +39,15 @@ CONFIG += file_audio_libsndfile
 #CONFIG += file_sdif
 #CONFIG += file_sdif_static
 
+# Store the signals and the spectrograms in single precision (float32)
+# instead of double, which halves the memory needed by long files.
+# (the DFTs and the cepstral liftering still compute in double)
+#CONFIG += sigproc_float
+
+# Use AVX2 for the STFT's inner loops (x86_64 only, the binary won't run on
+# older CPUs). NEON is used anyway on ARM64.
+#CONFIG += sigproc_avx2
+
 # Activate this line for logging some information into a txt file
 #CONFIG += debug_logfile
 
@@ -84,6 +93,19 @@ message(Compiler: $$COMPILERMSG)
 message(Qt: Version: $$QT_VERSION)
 
 
+CONFIG(sigproc_float) {
+    message(Signal storage: single precision)
+    DEFINES += SIGPROC_FLOAT
+} else {
+    message(Signal storage: double precision)
+}
+
+CONFIG(sigproc_avx2) {
+    message(Signal processing: AVX2)
+    msvc: QMAKE_CXXFLAGS += /arch:AVX2
+    else: QMAKE_CXXFLAGS += -mavx2
+}
+
 CONFIG(debug_logfile) {
     message(Information will be dropped in a log file)
     DEFINES += DEBUG_LOGFILE
@@ -280,17 +302,24 @@ SOURCES   += src/main.cpp\
              src/wdialogfilecreate.cpp \
              src/filetype.cpp \
              src/ftsound.cpp \
+             src/playbackfilter.cpp \
              src/wdialogselectchannel.cpp \
              src/ftfzero.cpp \
              src/ftlabels.cpp \
              src/gvwaveform.cpp \
              src/gvspectrumamplitude.cpp \
              src/fftresizethread.cpp \
+             src/dftcomputethread.cpp \
+             src/filtercomputethread.cpp \
+             src/fftplanpool.cpp \
              src/gvspectrumamplitudewdialogsettings.cpp \
              src/gvspectrumphase.cpp \
              src/gvspectrumgroupdelay.cpp \
              src/gvspectrogram.cpp \
              src/stftcomputethread.cpp \
+             src/stftimagetiles.cpp \
+             src/stftcache.cpp \
+             src/windowcache.cpp \
              src/gvspectrogramwdialogsettings.cpp \
              src/ftgenerictimevalue.cpp \
              src/gvgenerictimevalue.cpp \
@@ -317,17 +346,25 @@ HEADERS   += src/wmainwindow.h \
              src/wdialogfilecreate.h \
              src/filetype.h \
              src/ftsound.h \
+             src/playbackfilter.h \
              src/wdialogselectchannel.h \
              src/ftfzero.h \
              src/ftlabels.h \
              src/gvwaveform.h \
              src/gvspectrumamplitude.h \
              src/fftresizethread.h \
+             src/dftcomputethread.h \
+             src/filtercomputethread.h \
+             src/fftplanpool.h \
              src/gvspectrumamplitudewdialogsettings.h \
              src/gvspectrumphase.h \
              src/gvspectrumgroupdelay.h \
              src/gvspectrogram.h \
              src/stftcomputethread.h \
+             src/stftimagetiles.h \
+             src/stftkernels.h \
+             src/stftcache.h \
+             src/windowcache.h \
              src/gvspectrogramwdialogsettings.h \
              src/ftgenerictimevalue.h \
              src/gvgenerictimevalue.h \
@@ -34,7 +34,14 @@ extern "C" {
 #include    <sndfile.h>
 }
 
+#include <cstring>
+#include <algorithm>
+
 #include <QFileInfo>
+#include <QFile>
+#include <QtEndian>
+#include <QRunnable>
+#include <QThreadPool>
 
 QString FTSound::getAudioFileReadingDescription(){
 
@@ -107,21 +114,295 @@ int FTSound::getNumberOfChannels(const QString& filePath){
 /* This will be the length of the buffer used to hold samples while
 ** we process them.
 */
-#define BUFFER_LEN      1024
+#define BUFFER_LEN      65536
+
+// Size of the blocks of an uncompressed file which are mapped at once
+#define MAPPED_BLOCK_SIZE   (1<<24)
+
+// Size of the samples from which a file is loaded in background
+#define LOADING_BACKGROUND_SIZE   (qint64(50)*1024*1024)
+
+// For uncompressed WAV and AIFF files, the samples are read directly
+// from the memory-mapped file, by blocks, and converted on the fly.
+// This avoids libsndfile's intermediate buffers and copies.
+
+// Find the offset of the samples in an uncompressed WAV or AIFF file.
+// Return -1 if it is not found (then libsndfile is used).
+static qint64 mapped_data_offset(QFile& file, int major, bool& bigendian){
+    uchar header[12];
+    if(file.read((char*)header, 12)!=12)
+        return -1;
+
+    bool wav = (major==SF_FORMAT_WAV || major==SF_FORMAT_WAVEX)
+            && std::memcmp(header, "RIFF", 4)==0 && std::memcmp(header+8, "WAVE", 4)==0;
+    bool aiff = major==SF_FORMAT_AIFF
+            && std::memcmp(header, "FORM", 4)==0 && std::memcmp(header+8, "AIFF", 4)==0; // AIFC can be compressed
+    if(!wav && !aiff)
+        return -1;
+    bigendian = aiff;
+
+    // Go through the chunks until the samples'one
+    qint64 pos = 12;
+    uchar chunk[8];
+    while(pos+8<=file.size()){
+        if(!file.seek(pos) || file.read((char*)chunk, 8)!=8)
+            return -1;
+        qint64 size = wav?qFromLittleEndian<quint32>(chunk+4):qFromBigEndian<quint32>(chunk+4);
+
+        if(wav && std::memcmp(chunk, "data", 4)==0)
+            return pos+8;
+
+        if(aiff && std::memcmp(chunk, "SSND", 4)==0){
+            uchar ssnd[4];
+            if(file.read((char*)ssnd, 4)!=4)
+                return -1;
+            return pos+16+qFromBigEndian<quint32>(ssnd);
+        }
 
-///* libsndfile can handle more than 6 channels but we'll restrict it to 6. */
-//#define    MAX_CHANNELS    6
+        pos += 8+size+(size&1); // Chunks are padded to even sizes
+    }
 
-void FTSound::load(int channelid){
+    return -1;
+}
+
+// Same normalisation as libsndfile's sf_read_double
+static inline double mapped_sample(const uchar* p, int subtype, bool bigendian){
+    switch(subtype){
+    case SF_FORMAT_PCM_S8:
+        return double(qint8(p[0]))/0x80;
+    case SF_FORMAT_PCM_U8:
+        return (double(p[0])-0x80)/0x80;
+    case SF_FORMAT_PCM_16:
+        return double(bigendian?qFromBigEndian<qint16>(p):qFromLittleEndian<qint16>(p))/0x8000;
+    case SF_FORMAT_PCM_24: {
+        quint32 v;
+        if(bigendian) v = (quint32(p[0])<<24) | (quint32(p[1])<<16) | (quint32(p[2])<<8);
+        else          v = (quint32(p[2])<<24) | (quint32(p[1])<<16) | (quint32(p[0])<<8);
+        return double(qint32(v))/0x80000000u;
+    }
+    case SF_FORMAT_PCM_32:
+        return double(bigendian?qFromBigEndian<qint32>(p):qFromLittleEndian<qint32>(p))/0x80000000u;
+    case SF_FORMAT_FLOAT: {
+        quint32 v = bigendian?qFromBigEndian<quint32>(p):qFromLittleEndian<quint32>(p);
+        float f;
+        std::memcpy(&f, &v, 4);
+        return f;
+    }
+    case SF_FORMAT_DOUBLE: {
+        quint64 v = bigendian?qFromBigEndian<quint64>(p):qFromLittleEndian<quint64>(p);
+        double d;
+        std::memcpy(&d, &v, 8);
+        return d;
+    }
+    }
+    return 0.0;
+}
+
+// Reads the samples of a file by blocks, directly in the calling thread,
+// or in background for big files (see FTSound::isLoading()).
+// The file is read only once for all the sounds loaded from it
+// (e.g. when importing each channel of a multi-channel file),
+// each block being de-interleaved into the sounds' samples.
+class FTSoundLoader : public QRunnable
+{
+public:
+    std::vector<FTSound*> m_snds;   // NULL once a sound has canceled its loading
+    std::vector<int> m_channelids;  // [0,N-1] for each sound, -1 to merge all the channels
+    bool m_background;
+    SNDFILE* m_infile;
+    SF_INFO m_sfinfo;
+
+    // For uncompressed files (NULL otherwise)
+    QFile* m_file;
+    qint64 m_offset;
+    int m_subtype;
+    int m_samplesize;
+    bool m_bigendian;
+
+    std::vector<double> m_buffer;   // Interleaved samples of a block
+
+    FTSoundLoader(const std::vector<FTSound*>& snds, const std::vector<int>& channelids, SNDFILE* infile, const SF_INFO& sfinfo)
+        : m_snds(snds)
+        , m_channelids(channelids)
+        , m_background(false)
+        , m_infile(infile)
+        , m_sfinfo(sfinfo)
+        , m_file(NULL)
+        , m_offset(-1)
+        , m_subtype(sfinfo.format&SF_FORMAT_SUBMASK)
+        , m_samplesize(0)
+        , m_bigendian(false)
+    {
+        setAutoDelete(true);
+    }
+    ~FTSoundLoader(){
+        delete m_file;
+        sf_close(m_infile);
+    }
+
+    void prepareMapping(const QString& filePath);
+    void deinterleave(qint64 f0, qint64 nf);
+    qint64 readMapped(qint64 f0, qint64 nf);
+    qint64 readSndfile(qint64 f0, qint64 nf);
+
+    void run();
+};
+
+// Keep m_file only if the samples can be read from the memory-mapped file
+void FTSoundLoader::prepareMapping(const QString& filePath){
+
+    if(m_subtype==SF_FORMAT_PCM_S8 || m_subtype==SF_FORMAT_PCM_U8) m_samplesize = 1;
+    else if(m_subtype==SF_FORMAT_PCM_16)  m_samplesize = 2;
+    else if(m_subtype==SF_FORMAT_PCM_24)  m_samplesize = 3;
+    else if(m_subtype==SF_FORMAT_PCM_32)  m_samplesize = 4;
+    else if(m_subtype==SF_FORMAT_FLOAT)   m_samplesize = 4;
+    else if(m_subtype==SF_FORMAT_DOUBLE)  m_samplesize = 8;
+    else
+        return;
+
+    m_file = new QFile(filePath);
+    if(m_file->open(QIODevice::ReadOnly)){
+        m_offset = mapped_data_offset(*m_file, m_sfinfo.format&SF_FORMAT_TYPEMASK, m_bigendian);
+        qint64 framesize = qint64(m_sfinfo.channels)*m_samplesize;
+        if(m_offset>=0 && m_offset+m_sfinfo.frames*framesize<=m_file->size())
+            return;
+    }
+
+    delete m_file;
+    m_file = NULL;
+}
 
-    m_fileaudioformat = QAudioFormat(); // Clear the format
+// Dispatch the nf frames of m_buffer to the sounds' samples, from frame f0
+void FTSoundLoader::deinterleave(qint64 f0, qint64 nf){
+    int nbchan = m_sfinfo.channels;
+    const double* data = &(m_buffer[0]);
+
+    for(size_t si=0; si<m_snds.size(); ++si){
+        if(m_snds[si]==NULL)
+            continue;
+        WAVTYPE* pwav = &(m_snds[si]->wav[size_t(f0)]);
+
+        if(m_channelids[si]<0){
+            for(qint64 f=0; f<nf; ++f){
+                const double* frame = data+f*nbchan;
+                double sum = 0.0;
+                for(int c=0; c<nbchan; ++c)
+                    sum += frame[c];
+                pwav[f] = sum/nbchan;
+            }
+        }
+        else{
+            // The block is small enough to stay in the cache between the channels
+            const double* p = data+m_channelids[si];
+            for(qint64 f=0; f<nf; ++f, p+=nbchan)
+                pwav[f] = *p;
+        }
+    }
+}
+
+// Return the number of frames read, or -1 if the block cannot be mapped
+qint64 FTSoundLoader::readMapped(qint64 f0, qint64 nf){
+    int nbchan = m_sfinfo.channels;
+    qint64 framesize = qint64(nbchan)*m_samplesize;
+
+    // Map one block at a time, so that the address space is not exhausted on 32bits systems
+    const uchar* block = m_file->map(m_offset+f0*framesize, nf*framesize);
+    if(block==NULL)
+        return -1;
+
+    // Decode and dispatch it by sub-blocks which fit in the cache
+    qint64 subnf = std::max(qint64(1), qint64(BUFFER_LEN)/nbchan);
+    for(qint64 sf0=0; sf0<nf; sf0+=subnf){
+        qint64 snf = std::min(subnf, nf-sf0);
+        m_buffer.resize(size_t(snf*nbchan));
+        const uchar* p = block+sf0*framesize;
+        for(qint64 n=0; n<snf*nbchan; ++n, p+=m_samplesize)
+            m_buffer[n] = mapped_sample(p, m_subtype, m_bigendian);
+        deinterleave(f0+sf0, snf);
+    }
+
+    m_file->unmap((uchar*)block);
+
+    return nf;
+}
+
+qint64 FTSoundLoader::readSndfile(qint64 f0, qint64 nf){
+    m_buffer.resize(size_t(nf*m_sfinfo.channels));
+
+    qint64 readcount = sf_readf_double(m_infile, &(m_buffer[0]), nf);
+    if(readcount>0)
+        deinterleave(f0, readcount);
+
+    return readcount;
+}
+
+void FTSoundLoader::run(){
+    qint64 nbframes = m_sfinfo.frames;
+
+    qint64 nbread = 0;
+    int progress = 0;
+    int nbsnds = int(m_snds.size());
+    while(nbread<nbframes && nbsnds>0){
+        // Forget the sounds which don't need their samples anymore
+        for(size_t si=0; si<m_snds.size(); ++si){
+            if(m_snds[si] && m_snds[si]->m_loading_canceled.loadAcquire()){
+                m_snds[si]->m_loading_running.storeRelease(0); // The sound cannot be used anymore after this
+                m_snds[si] = NULL;
+                nbsnds--;
+            }
+        }
+        if(nbsnds==0)
+            break;
+
+        qint64 nf;
+        if(m_file){
+            nf = std::min(std::max(qint64(1), MAPPED_BLOCK_SIZE/(qint64(m_sfinfo.channels)*m_samplesize)), nbframes-nbread);
+            if(readMapped(nbread, nf)<0){
+                // Continue with libsndfile
+                delete m_file;
+                m_file = NULL;
+                sf_seek(m_infile, nbread, SEEK_SET);
+                continue;
+            }
+        }
+        else{
+            nf = std::min(std::max(qint64(1), qint64(BUFFER_LEN)/m_sfinfo.channels), nbframes-nbread);
+            nf = readSndfile(nbread, nf);
+            if(nf<=0)
+                break; // The file is shorter than announced
+        }
+        nbread += nf;
+
+        if(m_background && int((100*nbread)/nbframes)>progress){
+            progress = int((100*nbread)/nbframes);
+            for(size_t si=0; si<m_snds.size(); ++si){
+                if(m_snds[si]){
+                    m_snds[si]->m_loading_progress.storeRelease(progress);
+                    emit m_snds[si]->loadingProgressed();
+                }
+            }
+        }
+    }
+
+    for(size_t si=0; si<m_snds.size(); ++si){
+        if(m_snds[si]==NULL)
+            continue;
+        if(m_background){
+            m_snds[si]->m_loading_nbread = nbread;
+            emit m_snds[si]->loadingFinished();
+            m_snds[si]->m_loading_running.storeRelease(0); // The sound cannot be used anymore after this
+        }
+        else if(nbread<nbframes)
+            m_snds[si]->wav.resize(size_t(nbread));
+    }
+}
+
+void FTSound::load(int channelid){
     m_channelid = channelid;
-    bool sumchannels = m_channelid==-2;
+    load(std::vector<FTSound*>(1, this));
+}
 
-    /* This is a buffer of double precision floating point values
-    ** which will hold our data while we process it.
-    */
-    static double data [BUFFER_LEN] ;
+void FTSound::load(const std::vector<FTSound*>& snds){
 
     /* A SNDFILE is very much like a FILE in the Standard C library. The
     ** sf_open_read and sf_open_write functions return an SNDFILE* pointer
@@ -141,17 +422,14 @@ void FTSound::load(int channelid){
     ** for all subsequent operations on that file.
     ** If an error occurs during sf_open_read, the function returns a NULL pointer.
     */
-    if( !(infile = sf_open(fileFullPath.toLocal8Bit().constData(), SFM_READ, &sfinfo)) ) {
+    if( !(infile = sf_open(snds[0]->fileFullPath.toLocal8Bit().constData(), SFM_READ, &sfinfo)) ) {
         /* Open failed so print an error message. */
         throw QString("libsndfile: Cannot open input file");
     }
 
-    if(!sumchannels && m_channelid>int(sfinfo.channels))
-        throw QString("libsndfile: The requested channel ID is higher than the number of channels in the file.");
-
-    m_fileaudioformat.setChannelCount(sfinfo.channels);
-    m_fileaudioformat.setSampleRate(sfinfo.samplerate);
-    setSamplingRate(sfinfo.samplerate);
+    QAudioFormat fileaudioformat;
+    fileaudioformat.setChannelCount(sfinfo.channels);
+    fileaudioformat.setSampleRate(sfinfo.samplerate);
 
     // TODO Fill the codec name based on:
     //      http://www.mega-nerd.com/libsndfile/api.html
@@ -159,58 +437,112 @@ void FTSound::load(int channelid){
 //    std::cout << sfinfo.format << endl;
 
     if((sfinfo.format&0x00FF)==SF_FORMAT_PCM_S8) {
-        m_fileaudioformat.setSampleType(QAudioFormat::SignedInt);
-        m_fileaudioformat.setSampleSize(8);
+        fileaudioformat.setSampleType(QAudioFormat::SignedInt);
+        fileaudioformat.setSampleSize(8);
     }
     else if((sfinfo.format&0x00FF)==SF_FORMAT_PCM_16) {
-        m_fileaudioformat.setSampleType(QAudioFormat::SignedInt);
-        m_fileaudioformat.setSampleSize(16);
+        fileaudioformat.setSampleType(QAudioFormat::SignedInt);
+        fileaudioformat.setSampleSize(16);
     }
     else if((sfinfo.format&0x00FF)==SF_FORMAT_PCM_24) {
-        m_fileaudioformat.setSampleType(QAudioFormat::SignedInt);
-        m_fileaudioformat.setSampleSize(24);
+        fileaudioformat.setSampleType(QAudioFormat::SignedInt);
+        fileaudioformat.setSampleSize(24);
     }
     else if((sfinfo.format&0x00FF)==SF_FORMAT_PCM_32) {
-        m_fileaudioformat.setSampleType(QAudioFormat::SignedInt);
-        m_fileaudioformat.setSampleSize(32);
+        fileaudioformat.setSampleType(QAudioFormat::SignedInt);
+        fileaudioformat.setSampleSize(32);
     }
     else if((sfinfo.format&0x00FF)==SF_FORMAT_PCM_U8) {
-        m_fileaudioformat.setSampleType(QAudioFormat::UnSignedInt);
-        m_fileaudioformat.setSampleSize(8);
+        fileaudioformat.setSampleType(QAudioFormat::UnSignedInt);
+        fileaudioformat.setSampleSize(8);
     }
     else if((sfinfo.format&0x00FF)==SF_FORMAT_FLOAT) {
-        m_fileaudioformat.setSampleType(QAudioFormat::Float);
-        m_fileaudioformat.setSampleSize(32);
+        fileaudioformat.setSampleType(QAudioFormat::Float);
+        fileaudioformat.setSampleSize(32);
     }
     else if((sfinfo.format&0x00FF)==SF_FORMAT_DOUBLE) {
-        m_fileaudioformat.setSampleType(QAudioFormat::Float);
-        m_fileaudioformat.setSampleSize(64);
+        fileaudioformat.setSampleType(QAudioFormat::Float);
+        fileaudioformat.setSampleSize(64);
     }
 
     if((sfinfo.format&0xF0000000)==SF_ENDIAN_LITTLE)
-        m_fileaudioformat.setByteOrder(QAudioFormat::LittleEndian);
+        fileaudioformat.setByteOrder(QAudioFormat::LittleEndian);
     else if((sfinfo.format&0xF0000000)==SF_ENDIAN_BIG)
-        m_fileaudioformat.setByteOrder(QAudioFormat::BigEndian);
+        fileaudioformat.setByteOrder(QAudioFormat::BigEndian);
+
+    std::vector<int> channelids; // Move indices [1,N] to [0,N-1] to avoid computing -1 to often
+    for(size_t si=0; si<snds.size(); ++si){
+        if(snds[si]->m_channelid!=-2 && snds[si]->m_channelid>int(sfinfo.channels)){
+            sf_close(infile);
+            throw QString("libsndfile: The requested channel ID is higher than the number of channels in the file.");
+        }
+        channelids.push_back(snds[si]->m_channelid==-2?-1:snds[si]->m_channelid-1);
+
+        snds[si]->m_fileaudioformat = fileaudioformat;
+        snds[si]->setSamplingRate(sfinfo.samplerate);
+    }
+
+    if(sfinfo.frames>0 && sfinfo.frames<SF_COUNT_MAX){
+        // The size is known, so the samples can be read by blocks into their final place
+        FTSoundLoader* loader = new FTSoundLoader(snds, channelids, infile, sfinfo);
+        try{
+            for(size_t si=0; si<snds.size(); ++si)
+                snds[si]->wav.resize(size_t(sfinfo.frames));
+        }
+        catch(std::bad_alloc err){
+            delete loader; // Closes the file
+            for(size_t si=0; si<snds.size(); ++si)
+                std::vector<WAVTYPE>().swap(snds[si]->wav);
+            throw;
+        }
+        loader->prepareMapping(snds[0]->fileFullPath);
+
+        if(qint64(sfinfo.frames)*sizeof(WAVTYPE)*snds.size()>LOADING_BACKGROUND_SIZE){
+            // Big file: Read it in background, the views show it as it comes
+            loader->m_background = true;
+            for(size_t si=0; si<snds.size(); ++si){
+                snds[si]->m_loading = true;
+                snds[si]->m_loading_canceled.storeRelease(0);
+                snds[si]->m_loading_progress.storeRelease(0);
+                snds[si]->m_loading_running.storeRelease(1);
+            }
+            QThreadPool::globalInstance()->start(loader);
+        }
+        else{
+            loader->run();
+            delete loader;
+        }
+        return;
+    }
+
+    /* This is a buffer of double precision floating point values
+    ** which will hold our data while we process it.
+    */
+    std::vector<double> buffer(BUFFER_LEN);
+    double* data = &(buffer[0]);
 
     /* While there are samples in the input file, read them, process
     ** them and write them to the output file.
     */
-    double sum = 0.0;
-    channelid--; // Move indices [1,N] to [0,N-1] to avoid computing -1 to often
     int nbchan = sfinfo.channels;
+    std::vector<double> frame(nbchan);
     int curchannelid = 0;
     while((readcount = sf_read_double (infile, data, BUFFER_LEN))) {
         for(int n=0; n<readcount; n++){
-
-            if(sumchannels){
-                sum += data[n];
-                if(curchannelid==nbchan-1){
-                    wav.push_back(sum/nbchan);
-                    sum = 0.0;
+            frame[curchannelid] = data[n];
+
+            if(curchannelid==nbchan-1){
+                for(size_t si=0; si<snds.size(); ++si){
+                    if(channelids[si]<0){
+                        double sum = 0.0;
+                        for(int c=0; c<nbchan; ++c)
+                            sum += frame[c];
+                        snds[si]->wav.push_back(sum/nbchan);
+                    }
+                    else
+                        snds[si]->wav.push_back(frame[channelids[si]]);
                 }
             }
-            else if(curchannelid==channelid)
-                wav.push_back(data[n]);
 
             curchannelid = (curchannelid+1)%nbchan;
         }
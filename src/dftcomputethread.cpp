@@ -0,0 +1,221 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "dftcomputethread.h"
+
+#include <limits>
+
+#include <QtGlobal>
+#include <QRunnable>
+#include <qnumeric.h>
+
+#include "qaesigproc.h"
+#include "qaehelpers.h"
+#include "fftplanpool.h"
+
+void DFTComputeThread::Request::swap(Request& req) {
+    std::swap(params.nl, req.params.nl);
+    std::swap(params.nr, req.params.nr);
+    std::swap(params.winlen, req.params.winlen);
+    std::swap(params.wintype, req.params.wintype);
+    std::swap(params.normtype, req.params.normtype);
+    params.win.swap(req.params.win);
+    std::swap(params.dftlen, req.params.dftlen);
+    std::swap(params.wav, req.params.wav);
+    std::swap(params.ampscale, req.params.ampscale);
+    std::swap(params.delay, req.params.delay);
+    std::swap(dftlen, req.dftlen);
+    std::swap(computegd, req.computegd);
+    std::swap(fs, req.fs);
+    results.swap(req.results);
+}
+
+// Computes the DFTs of the results wi, wi+nbworkers, wi+2*nbworkers, ...
+class DFTComputeThread::DFTWorker : public QRunnable {
+    qae::FFTwrapper* m_fft; // The FFT of this worker only
+    Request* m_req;
+    int m_wi;
+    int m_nbworkers;
+
+public:
+    DFTWorker(qae::FFTwrapper* fft, Request* req, int wi, int nbworkers)
+        : m_fft(fft)
+        , m_req(req)
+        , m_wi(wi)
+        , m_nbworkers(nbworkers)
+    {
+        setAutoDelete(true);
+    }
+
+    void run();
+};
+
+void DFTComputeThread::DFTWorker::run() {
+    int dftlen = m_req->dftlen;
+    int winlen = m_req->params.winlen;
+    std::vector<std::complex<FFTTYPE> > dft(dftlen/2+1);
+
+    for(size_t ri=m_wi; ri<m_req->results.size(); ri+=m_nbworkers){
+        Result& result = m_req->results[ri];
+
+        int n = 0;
+        for(; n<winlen; n++)
+            m_fft->in[n] = result.frame[n];
+        for(; n<dftlen; n++)
+            m_fft->in[n] = 0.0;
+
+        m_fft->execute(); // Compute the DFT
+
+        // Store first the complex values of the DFT
+        // (so that it can be used to compute the group delay)
+        for(n=0; n<dftlen/2+1; n++)
+            dft[n] = m_fft->out[n];
+
+        result.amp.resize(dftlen/2+1);
+        for(n=0; n<dftlen/2+1; n++)
+            result.amp[n] = 20*std::log10(std::abs(m_fft->out[n]));
+
+        result.phase.resize(dftlen/2+1);
+        double delay = (2.0*M_PI*(winlen-1)/2.0)/dftlen;
+        for(n=0; n<dftlen/2+1; n++){
+            if(qIsInf(result.amp[n]))
+                result.phase[n] = std::numeric_limits<FFTTYPE>::infinity();
+            else
+                result.phase[n] = qae::wrap(std::arg(m_fft->out[n])+delay*n);
+        }
+
+        // If the group delay is requested, update its data
+        if(m_req->computegd){
+            // y = nx[n]
+            for(int n=0; n<winlen; n++)
+                m_fft->in[n] *= n;
+
+            m_fft->execute(); // Compute the DFT of y
+
+            // (Xr*Yr+Xi*Yi) / |X|^2
+            result.gd.resize(dftlen/2+1);
+            FFTTYPE fs = m_req->fs;
+            FFTTYPE delay = ((winlen-1)/2)/fs;
+            for(int n=0; n<dftlen/2+1; n++) {
+                if(qIsInf(result.amp[n]))
+                    result.gd[n] = std::numeric_limits<FFTTYPE>::infinity();
+                else {
+                    FFTTYPE xp2 = std::real(dft[n])*std::real(dft[n]) + std::imag(dft[n])*std::imag(dft[n]);
+                    result.gd[n] = (std::real(dft[n])*std::real(m_fft->out[n]) + std::imag(dft[n])*std::imag(m_fft->out[n]))/xp2;
+
+                    result.gd[n] /= fs; // measure it in [second]
+
+                    result.gd[n] -= delay; // Remove the window's delay
+                }
+            }
+        }
+
+        result.frame.clear();
+    }
+}
+
+DFTComputeThread::DFTComputeThread(QObject* parent)
+    : QThread(parent)
+{
+    m_workers = new QThreadPool(this);
+    m_workers->setMaxThreadCount(std::max(1, QThread::idealThreadCount()));
+    for(int wi=0; wi<m_workers->maxThreadCount(); ++wi)
+        m_ffts.push_back(new qae::FFTwrapper());
+}
+
+void DFTComputeThread::compute(Request& req) {
+    if(req.isEmpty())
+        return;
+
+    m_mutex_changingparams.lock();
+
+    if(m_mutex_computing.tryLock()) {
+        // Currently not computing, so start it!
+        m_req_current.swap(req);
+        m_req_todo.clear();
+        while(isRunning()) // The previous run might not be totally finished,
+            msleep(1);     // otherwise start() does nothing.
+        start();
+    }
+    else {
+        // Currently computing something,
+        // so replace any waiting request, only the last one matters.
+        m_req_todo.swap(req);
+    }
+    req.clear();
+
+    m_mutex_changingparams.unlock();
+}
+
+bool DFTComputeThread::takeResults(Request& req) {
+    m_mutex_changingparams.lock();
+    req.swap(m_req_done);
+    m_req_done.clear();
+    m_mutex_changingparams.unlock();
+
+    return !req.isEmpty();
+}
+
+void DFTComputeThread::run() {
+//    DCOUT << "DFTComputeThread::run" << std::endl;
+
+    bool again = false;
+    do{
+        // m_req_current is only modified by this thread while it is running
+        Request& req = m_req_current;
+
+        // Get the FFT plans of this size (prepared only if not used recently)
+        int nbworkers = int(std::min(req.results.size(), m_ffts.size()));
+        for(int wi=0; wi<nbworkers; ++wi)
+            FFTPlanPool::exchange(m_ffts[wi], req.dftlen);
+
+        for(int wi=0; wi<nbworkers; ++wi)
+            m_workers->start(new DFTWorker(m_ffts[wi], &req, wi, nbworkers));
+        m_workers->waitForDone();
+
+        // Publish the results and check if it has to compute another
+        m_mutex_changingparams.lock();
+        m_req_done.swap(m_req_current); // Replace any result which has not been taken
+        m_req_current.clear();
+        again = !m_req_todo.isEmpty();
+        if(again)
+            m_req_current.swap(m_req_todo);
+        else
+            m_mutex_computing.unlock(); // Let compute() start a new run
+        m_mutex_changingparams.unlock();
+
+        emit dftsComputed();
+    }
+    while(again);
+
+//    DCOUT << "DFTComputeThread::~run" << std::endl;
+}
+
+DFTComputeThread::~DFTComputeThread() {
+    m_mutex_changingparams.lock();
+    m_req_todo.clear();
+    m_mutex_changingparams.unlock();
+    m_mutex_computing.lock();
+    m_mutex_computing.unlock();
+    wait();
+
+    for(size_t wi=0; wi<m_ffts.size(); ++wi)
+        delete m_ffts[wi];
+}
@@ -0,0 +1,108 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DFTCOMPUTETHREAD_H
+#define DFTCOMPUTETHREAD_H
+
+#include <vector>
+
+#include <QThread>
+#include <QMutex>
+#include <QThreadPool>
+
+#include "qaesigproc.h"
+#include "ftsound.h"
+
+// Computes the DFTs of the sounds in the background, for the spectrum views.
+// Only the last request is kept while computing (e.g. while dragging a selection),
+// the intermediate ones are dropped.
+class DFTComputeThread : public QThread
+{
+    Q_OBJECT
+
+    QThreadPool* m_workers;                 // The workers computing the sounds' DFTs
+    std::vector<qae::FFTwrapper*> m_ffts;   // One FFT transformer per worker
+
+    class DFTWorker;
+
+    void run(); //Q_DECL_OVERRIDE
+
+public:
+    DFTComputeThread(QObject* parent);
+
+    // The DFT of one sound
+    class Result {
+    public:
+        FTSound* snd;
+        std::vector<WAVTYPE>* wav; // The samples it has been computed from
+        WAVTYPE ampscale;
+        qint64 delay;
+        std::vector<FFTTYPE> frame; // The windowed samples (copied, so that the sound can change meanwhile)
+
+        std::vector<FFTTYPE> amp;   // [dB]
+        std::vector<FFTTYPE> phase; // [rad]
+        std::vector<FFTTYPE> gd;    // [s]
+    };
+
+    class Request {
+    public:
+        FTSound::DFTParameters params;
+        int dftlen;
+        bool computegd;
+        double fs;
+        std::vector<Result> results;
+
+        void clear(){
+            params.clear();
+            dftlen = 0;
+            computegd = false;
+            fs = 0.0;
+            results.clear();
+        }
+
+        Request(){
+            clear();
+        }
+
+        void swap(Request& req);
+
+        inline bool isEmpty() const {return results.empty();}
+    };
+
+    void compute(Request& req); // Entry point (req is emptied)
+
+    // Get the last computed request. Return false if there is none.
+    bool takeResults(Request& req);
+
+signals:
+    void dftsComputed();
+
+public:
+    mutable QMutex m_mutex_computing;       // To protect the access to the FFTs
+    mutable QMutex m_mutex_changingparams;  // To protect the access to the requests below
+
+    Request m_req_todo;     // The request which has to be done by the thread
+    Request m_req_current;  // The request which is in preparation by the thread
+    Request m_req_done;     // The last computed request, not taken yet
+
+    ~DFTComputeThread();
+};
+
+#endif // DFTCOMPUTETHREAD_H
@@ -0,0 +1,116 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "fftplanpool.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+
+#ifdef FFT_FFTW3
+#include <fftw3.h>
+#endif
+
+QMutex FFTPlanPool::s_mutex;
+QMutex FFTPlanPool::s_mutex_planning;
+std::list<qae::FFTwrapper*> FFTPlanPool::s_ffts;
+qint64 FFTPlanPool::s_sizelimit = 1<<21;
+
+qae::FFTwrapper* FFTPlanPool::tryAcquire(int size) {
+    QMutexLocker locker(&s_mutex);
+    for(std::list<qae::FFTwrapper*>::iterator it=s_ffts.begin(); it!=s_ffts.end(); ++it){
+        if((*it)->size()==size){
+            qae::FFTwrapper* fft = *it;
+            s_ffts.erase(it);
+            return fft;
+        }
+    }
+    return NULL;
+}
+
+qae::FFTwrapper* FFTPlanPool::acquire(int size) {
+    qae::FFTwrapper* fft = tryAcquire(size);
+    if(fft!=NULL)
+        return fft;
+
+    // None is ready, prepare a new one
+    QMutexLocker locker(&s_mutex_planning);
+    fft = new qae::FFTwrapper();
+    fft->resize(size);
+    return fft;
+}
+
+void FFTPlanPool::release(qae::FFTwrapper* fft) {
+    if(fft==NULL)
+        return;
+
+    std::list<qae::FFTwrapper*> dropped;
+
+    s_mutex.lock();
+    s_ffts.push_front(fft);
+    // Drop the least recently given back if the pool is too big
+    qint64 size = 0;
+    for(std::list<qae::FFTwrapper*>::iterator it=s_ffts.begin(); it!=s_ffts.end(); ){
+        size += (*it)->size();
+        if(size>s_sizelimit && it!=s_ffts.begin()){
+            dropped.push_back(*it);
+            it = s_ffts.erase(it);
+        }
+        else
+            ++it;
+    }
+    s_mutex.unlock();
+
+    if(!dropped.empty()){
+        QMutexLocker locker(&s_mutex_planning);
+        for(std::list<qae::FFTwrapper*>::iterator it=dropped.begin(); it!=dropped.end(); ++it)
+            delete *it;
+    }
+}
+
+void FFTPlanPool::exchange(qae::FFTwrapper*& fft, int size) {
+    if(fft!=NULL && fft->size()==size)
+        return;
+
+    qae::FFTwrapper* newfft = acquire(size);
+    release(fft);
+    fft = newfft;
+}
+
+void FFTPlanPool::loadWisdom(const QString& filepath) {
+    #ifdef FFT_FFTW3
+    if(!QFile::exists(filepath))
+        return;
+    QMutexLocker locker(&s_mutex_planning);
+    fftw_import_wisdom_from_filename(QFile::encodeName(filepath).constData());
+    #else
+    Q_UNUSED(filepath)
+    #endif
+}
+
+void FFTPlanPool::saveWisdom(const QString& filepath) {
+    #ifdef FFT_FFTW3
+    QDir().mkpath(QFileInfo(filepath).absolutePath());
+    QMutexLocker locker(&s_mutex_planning);
+    fftw_export_wisdom_to_filename(QFile::encodeName(filepath).constData());
+    #else
+    Q_UNUSED(filepath)
+    #endif
+}
@@ -0,0 +1,57 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FFTPLANPOOL_H
+#define FFTPLANPOOL_H
+
+#include <list>
+
+#include <QMutex>
+#include <QString>
+
+#include "qaesigproc.h"
+
+// The FFT transformers which are not used, kept ready for their size.
+// Anyone needing a given size exchanges its transformer for one of the pool,
+// so that the plans of the recently used sizes are not prepared again.
+// A transformer belongs to a single thread until it is given back.
+// With FFTW3, the plans' wisdom can also be kept across runs.
+class FFTPlanPool
+{
+    static QMutex s_mutex;          // To protect the access to the pool
+    static QMutex s_mutex_planning; // The plans' preparation is not thread-safe (e.g. FFTW3)
+    static std::list<qae::FFTwrapper*> s_ffts; // Most recently given back first
+    static qint64 s_sizelimit;      // [samples] Sum of the sizes of the kept transformers
+
+public:
+    // Get a transformer of this size if one is ready, NULL otherwise (never prepares one)
+    static qae::FFTwrapper* tryAcquire(int size);
+    // Get a transformer of this size (prepared, if none is ready)
+    static qae::FFTwrapper* acquire(int size);
+    // Give a transformer back
+    static void release(qae::FFTwrapper* fft);
+    // Replace fft by one of the given size, if necessary
+    static void exchange(qae::FFTwrapper*& fft, int size);
+
+    static void loadWisdom(const QString& filepath);
+    static void saveWisdom(const QString& filepath);
+};
+
+#endif // FFTPLANPOOL_H
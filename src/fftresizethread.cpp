@@ -21,13 +21,14 @@ file provided in the source code of DFasma. Another copy can be found at
 #include "fftresizethread.h"
 
 #include "qaesigproc.h"
+#include "fftplanpool.h"
 
 #include "qaehelpers.h"
 #include <QTextStream>
 
-FFTResizeThread::FFTResizeThread(qae::FFTwrapper* fft, QObject* parent)
+FFTResizeThread::FFTResizeThread(QObject* parent)
     : QThread(parent)
-    , m_fft(fft)
+    , m_fft(new qae::FFTwrapper())
     , m_size_resizing(-1)
     , m_size_todo(-1)
 {
@@ -51,10 +52,18 @@ void FFTResizeThread::resize(int newsize) {
     if(m_mutex_resizing.tryLock()){
         // The thread is not resizing
 
+        qae::FFTwrapper* readyfft = NULL;
         if(newsize==m_fft->size()){
             m_mutex_resizing.unlock(); // If the size is already the good one, just give up.
         }
+        else if((readyfft=FFTPlanPool::tryAcquire(newsize))!=NULL){
+            // This size has been used recently, no need to prepare it again
+            FFTPlanPool::release(m_fft);
+            m_fft = readyfft;
+            m_mutex_resizing.unlock();
+        }
         else{
+            // Otherwise, prepare it in the thread
             m_size_resizing = newsize;
 //            COUTD << "Start resizing " << m_fft->size() << "=>" << m_size_resizing << std::endl;
             emit fftResizing(m_fft->size(), m_size_resizing);
@@ -89,7 +98,7 @@ void FFTResizeThread::run() {
 
 //        COUTD << "FFTResizeThread::run " << prevSize << "=>" << m_size_resizing << std::endl;
 //        COUTD << "FFTResizeThread::run ask resize" << std::endl;
-        m_fft->resize(m_size_resizing);
+        FFTPlanPool::exchange(m_fft, m_size_resizing);
 //        COUTD << "FFTResizeThread::run resize finished" << std::endl;
 
         // Check if it has to be resized again
@@ -121,3 +130,7 @@ void FFTResizeThread::run() {
 //    COUTD << "FFTResizeThread::run: m_mutex_changingsizes.unlocking()" << std::endl;
     m_mutex_changingsizes.unlock();
 }
+
+FFTResizeThread::~FFTResizeThread() {
+    delete m_fft;
+}
@@ -30,7 +30,7 @@ class FFTResizeThread : public QThread
 {
     Q_OBJECT
 
-    qae::FFTwrapper* m_fft;   // The FFT transformer
+    qae::FFTwrapper* m_fft;   // The FFT transformer (taken from FFTPlanPool)
 
     int m_size_resizing;// The size which is in preparation by FFTResizeThread
     int m_size_todo;    // The next size which has to be done by FFTResizeThread asap
@@ -42,14 +42,19 @@ signals:
     void fftResized(int prevSize, int newSize);
 
 public:
-    FFTResizeThread(qae::FFTwrapper* fft, QObject* parent);
+    FFTResizeThread(QObject* parent);
 
     void resize(int newsize); // Entry point
 
+    // The FFT transformer, to use only while holding m_mutex_resizing
+    inline qae::FFTwrapper* fft() const {return m_fft;}
+
     void cancelCurrentComputation(bool waittoend=false);
 
     mutable QMutex m_mutex_resizing;      // To protect the access to the FFT transformer
     mutable QMutex m_mutex_changingsizes; // To protect the access to the size variables above
+
+    ~FFTResizeThread();
 };
 
 #endif // FFTRESIZETHREAD_H
@@ -0,0 +1,218 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "filtercomputethread.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <QRunnable>
+
+#define FILTERCHUNKLEN 32768 // [samples] Filtered at once by a worker (fits in the cache with its margins)
+
+void FilterComputeThread::Result::set(FTSound* _snd, int _generation, const PlaybackFilter& _filter, const std::vector<WAVTYPE>& sndwav, qint64 _begin, qint64 _end) {
+    snd = _snd;
+    generation = _generation;
+    filter = _filter;
+    begin = _begin;
+    end = _end;
+    maxamp = 0.0;
+    filtered.clear();
+    wav = &sndwav;
+}
+
+// The chunks of all the segments of a request
+class FilterComputeThread::Job {
+public:
+    Request* req;
+    std::vector<int> ris;           // The result each chunk belongs to
+    std::vector<qint64> begins;     // [sample index] The chunks [begin,end[
+    std::vector<qint64> ends;
+    QAtomicInt next;        // The next chunk to filter
+    QAtomicInt nbdone;      // The number of filtered chunks
+    QAtomicInt* canceled;
+};
+
+// Filters the chunks of a job, one after the other, until there is none left
+class FilterComputeThread::ChunksWorker : public QRunnable {
+    Job* m_job;
+
+public:
+    ChunksWorker(Job* job)
+        : m_job(job)
+    {
+        setAutoDelete(true);
+    }
+
+    void run() {
+        int ci;
+        while((ci=m_job->next.fetchAndAddOrdered(1))<int(m_job->ris.size())
+              && !m_job->canceled->load()){
+            Result& result = m_job->req->results[m_job->ris[ci]];
+            result.filter.filter(*(result.wav), m_job->begins[ci], m_job->ends[ci], &(result.filtered[m_job->begins[ci]-result.begin]));
+            m_job->nbdone.fetchAndAddOrdered(1);
+        }
+    }
+};
+
+FilterComputeThread::FilterComputeThread(QObject* parent)
+    : QThread(parent)
+    , m_canceled(0)
+{
+    m_workers = new QThreadPool(this);
+    m_workers->setMaxThreadCount(std::max(1, QThread::idealThreadCount()));
+}
+
+void FilterComputeThread::compute(Request& req) {
+    if(req.isEmpty())
+        return;
+
+    m_mutex_changingparams.lock();
+
+    if(m_mutex_computing.tryLock()) {
+        // Currently not computing, so start it!
+        m_req_current.swap(req);
+        m_req_todo.clear();
+        m_canceled.store(0);
+        while(isRunning()) // The previous run might not be totally finished,
+            msleep(1);     // otherwise start() does nothing.
+        start();
+    }
+    else {
+        // Currently computing something, which is now useless.
+        // So replace any waiting request and stop the current one.
+        m_req_todo.swap(req);
+        m_canceled.store(1);
+    }
+    req.clear();
+
+    m_mutex_changingparams.unlock();
+}
+
+bool FilterComputeThread::takeResults(Request& req) {
+    m_mutex_changingparams.lock();
+    req.swap(m_req_done);
+    m_req_done.clear();
+    m_mutex_changingparams.unlock();
+
+    return !req.isEmpty();
+}
+
+// Remove the results of a sound from a request
+static void removeSound(FilterComputeThread::Request& req, FTSound* snd) {
+    std::vector<FilterComputeThread::Result> results;
+    for(size_t ri=0; ri<req.results.size(); ++ri)
+        if(req.results[ri].snd!=snd)
+            results.push_back(req.results[ri]);
+    req.results.swap(results);
+}
+
+void FilterComputeThread::cancelComputation(FTSound* snd) {
+    m_mutex_changingparams.lock();
+    removeSound(m_req_todo, snd);
+    removeSound(m_req_done, snd);
+    bool running = false;
+    for(size_t ri=0; ri<m_req_current.results.size(); ++ri)
+        if(m_req_current.results[ri].snd==snd)
+            running = true;
+    if(running)
+        m_canceled.store(1);
+    m_mutex_changingparams.unlock();
+
+    // The workers read the sound's samples, wait for them to stop
+    // (if they didn't start yet, they won't read anything since it is canceled)
+    if(running){
+        m_mutex_filtering.lock();
+        m_mutex_filtering.unlock();
+    }
+}
+
+void FilterComputeThread::run() {
+//    DCOUT << "FilterComputeThread::run" << std::endl;
+
+    bool again = false;
+    do{
+        // m_req_current is only modified by this thread while it is running
+        Request& req = m_req_current;
+
+        Job job;
+        job.req = &req;
+        job.next = 0;
+        job.nbdone = 0;
+        job.canceled = &m_canceled;
+        for(size_t ri=0; ri<req.results.size(); ++ri){
+            Result& result = req.results[ri];
+            result.filtered.resize(result.end-result.begin);
+            // Long enough for the margins to be negligible
+            qint64 chunklen = std::max(qint64(FILTERCHUNKLEN), 4*qint64(result.filter.margin()));
+            for(qint64 cb=result.begin; cb<result.end; cb+=chunklen){
+                job.ris.push_back(int(ri));
+                job.begins.push_back(cb);
+                job.ends.push_back(std::min(cb+chunklen, result.end));
+            }
+        }
+
+        m_mutex_filtering.lock();
+        int nbworkers = int(std::min(job.ris.size(), size_t(m_workers->maxThreadCount())));
+        for(int wi=0; wi<nbworkers; ++wi)
+            m_workers->start(new ChunksWorker(&job));
+        while(!m_workers->waitForDone(100))
+            emit filteringProgressing(int(100.0*job.nbdone.load()/job.ris.size()));
+        m_mutex_filtering.unlock();
+
+        if(!m_canceled.load()){
+            for(size_t ri=0; ri<req.results.size(); ++ri){
+                Result& result = req.results[ri];
+                for(size_t n=0; n<result.filtered.size(); ++n)
+                    result.maxamp = std::max(result.maxamp, WAVTYPE(std::abs(result.filtered[n])));
+            }
+        }
+
+        // Publish the results (if still useful) and check if it has to compute another
+        m_mutex_changingparams.lock();
+        bool published = !m_canceled.load();
+        if(published)
+            m_req_done.swap(m_req_current); // Replace any result which has not been taken
+        m_req_current.clear();
+        m_canceled.store(0);
+        again = !m_req_todo.isEmpty();
+        if(again)
+            m_req_current.swap(m_req_todo);
+        else
+            m_mutex_computing.unlock(); // Let compute() start a new run
+        m_mutex_changingparams.unlock();
+
+        if(published || !again)
+            emit filteringDone(!again);
+    }
+    while(again);
+
+//    DCOUT << "FilterComputeThread::~run" << std::endl;
+}
+
+FilterComputeThread::~FilterComputeThread() {
+    m_mutex_changingparams.lock();
+    m_req_todo.clear();
+    m_canceled.store(1);
+    m_mutex_changingparams.unlock();
+    m_mutex_computing.lock();
+    m_mutex_computing.unlock();
+    wait();
+}
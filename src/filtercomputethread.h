@@ -0,0 +1,111 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILTERCOMPUTETHREAD_H
+#define FILTERCOMPUTETHREAD_H
+
+#include <vector>
+
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QThreadPool>
+
+#include "playbackfilter.h"
+
+class FTSound;
+
+// Filters the visible parts of the selections of the sounds in the background, for the views.
+// The segments are split in chunks which are filtered independently by the workers
+// (the filter's margins make the chunks independent, see PlaybackFilter).
+// A new request cancels the one in progress, only the last one matters.
+class FilterComputeThread : public QThread
+{
+    Q_OBJECT
+
+    QThreadPool* m_workers; // The workers filtering the chunks
+    QAtomicInt m_canceled;  // The current request has to be dropped
+
+    class Job;
+    class ChunksWorker;
+
+    void run(); //Q_DECL_OVERRIDE
+
+public:
+    FilterComputeThread(QObject* parent);
+
+    // The filtering of one segment of a sound
+    class Result {
+    public:
+        FTSound* snd;
+        int generation;         // The sound's filtering it corresponds to
+        PlaybackFilter filter;
+        qint64 begin;           // [sample index] The filtered segment [begin,end[
+        qint64 end;
+        const std::vector<WAVTYPE>* wav; // The sound's samples, read by the workers (see cancelComputation)
+
+        std::vector<WAVTYPE> filtered;  // The filtered samples of [begin,end[
+        WAVTYPE maxamp;
+
+        // Prepare the filtering of sndwav[begin,end[
+        void set(FTSound* _snd, int _generation, const PlaybackFilter& _filter, const std::vector<WAVTYPE>& sndwav, qint64 _begin, qint64 _end);
+    };
+
+    class Request {
+    public:
+        std::vector<Result> results;
+
+        void clear(){
+            results.clear();
+        }
+
+        void swap(Request& req){
+            results.swap(req.results);
+        }
+
+        inline bool isEmpty() const {return results.empty();}
+    };
+
+    void compute(Request& req); // Entry point (req is emptied)
+
+    // Get the last filtered request. Return false if there is none.
+    bool takeResults(Request& req);
+
+    // Drop anything concerning this sound (e.g. when it is reloaded or closed)
+    // and wait for the workers to stop reading its samples.
+    void cancelComputation(FTSound* snd);
+
+signals:
+    void filteringProgressing(int progress); // [%]
+    void filteringDone(bool last); // last: Nothing else is waiting
+
+public:
+    mutable QMutex m_mutex_computing;       // Locked while running
+    mutable QMutex m_mutex_filtering;       // Locked while the workers read the samples
+    mutable QMutex m_mutex_changingparams;  // To protect the access to the requests below
+
+    Request m_req_todo;     // The request which has to be done by the thread
+    Request m_req_current;  // The request which is in preparation by the thread
+    Request m_req_done;     // The last filtered request, not taken yet
+
+    ~FilterComputeThread();
+};
+
+#endif // FILTERCOMPUTETHREAD_H
@@ -23,6 +23,7 @@ file provided in the source code of DFasma. Another copy can be found at
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <limits>
 using namespace std;
 
 #ifdef SUPPORT_SDIF
@@ -36,6 +37,9 @@ using namespace Easdif;
 #include <QDir>
 #include <QFileDialog>
 #include <QStatusBar>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QProgressDialog>
 #include <qmath.h>
 #include <qendian.h>
 
@@ -805,159 +809,386 @@ FTFZero::FTFZero(QObject *parent, FTSound *ftsnd, double f0min, double f0max, do
 {
     FTFZero::constructor_internal();
 
-    if(gMW->m_dlgSettings->ui->cbF0DefaultFormat->currentIndex()+FFAsciiTimeValue==FFSDIF)
-        m_fileformat = FFSDIF;
-    else if(gMW->m_dlgSettings->ui->cbF0DefaultFormat->currentIndex()+FFAsciiTimeValue==FFAsciiAutoDetect
-            || gMW->m_dlgSettings->ui->cbF0DefaultFormat->currentIndex()+FFAsciiTimeValue==FFAsciiTimeValue)
-        m_fileformat = FFAsciiTimeValue;
+    setDefaultFileFormat();
 
     estimate(ftsnd, f0min, f0max, tstart, tend, force);
 
     FTFZero::constructor_external();
 }
 
-void FTFZero::estimate(FTSound *ftsnd, double f0min, double f0max, double tstart, double tend, bool force) {
+FTFZero::FTFZero(QObject *parent, const Estimation& est)
+    : QObject(parent)
+    , FileType(FTFZERO, createFileNameFromSound(est.snd->fileFullPath), this, est.snd->getColor())
+{
+    FTFZero::constructor_internal();
 
-    if(ftsnd)
-        m_src_snd = ftsnd;
+    setDefaultFileFormat();
 
-    if(!gFL->hasFile(m_src_snd)){
-        QMessageBox::warning(gMW, "Missing Source file", "The source file used for updating the F0 is not listed in the application anymore.");
-        return;
-    }
+    apply(est);
+
+    FTFZero::constructor_external();
+}
+
+void FTFZero::setDefaultFileFormat() {
+    if(gMW->m_dlgSettings->ui->cbF0DefaultFormat->currentIndex()+FFAsciiTimeValue==FFSDIF)
+        m_fileformat = FFSDIF;
+    else if(gMW->m_dlgSettings->ui->cbF0DefaultFormat->currentIndex()+FFAsciiTimeValue==FFAsciiAutoDetect
+            || gMW->m_dlgSettings->ui->cbF0DefaultFormat->currentIndex()+FFAsciiTimeValue==FFAsciiTimeValue)
+        m_fileformat = FFAsciiTimeValue;
+}
 
-    double fs = gFL->getFs();
+#define FTFZERO_CHUNKLEN 60.0     // [s] Length of the chunks
+#define FTFZERO_CHUNKMARGIN 2.0   // [s] Overlap on each side of the chunks
+#define FTFZERO_CHUNKSEARCH 5.0   // [s] Range around the fixed length where the chunks are cut
+
+FTFZero::Estimation::Estimation()
+    : snd(NULL)
+    , fs(0.0)
+    , f0min(0.0)
+    , f0max(0.0)
+    , tstart(-1.0)
+    , tend(-1.0)
+    , force(false)
+    , timestepsize(0.0)
+    , tiskipfirst(0.0)
+    , nbgathered(0)
+{
+}
 
-    f0min = std::max(f0min, gMW->m_dlgSettings->ui->dsbEstimationF0Min->minimum()); // Fix hard-coded minimum for f0
-    f0max = std::min(f0max, fs/2.0); // Fix hard-coded minimum for f0
+void FTFZero::Estimation::prepare(FTSound* _snd, double _f0min, double _f0max, double _tstart, double _tend, bool _force) {
+    snd = _snd;
+    fs = gFL->getFs();
+    f0min = std::max(_f0min, gMW->m_dlgSettings->ui->dsbEstimationF0Min->minimum()); // Fix hard-coded minimum for f0
+    f0max = std::min(_f0max, fs/2.0); // Fix hard-coded minimum for f0
+    tstart = _tstart;
     if(tstart!=-1)
         tstart = std::max(tstart, 0.0);
+    tend = _tend;
     if(tend!=-1)
-        tend = std::min(tend, m_src_snd->getLastSampleTime());
+        tend = std::min(tend, snd->getLastSampleTime());
+    force = _force;
+    timestepsize = gMW->m_dlgSettings->ui->sbEstimationStepSize->value();
 
-//    COUTD << "FTFZero::estimate src=" << m_src_snd->visibleName << " [" << f0min << "," << f0max << "]Hz [" << tstart << "," << tend << "]s " << force << endl;
-
-//    if(_fileName==""){
-////        if(gMW->m_dlgSettings->ui->cbLabelsDefaultFormat->currentIndex()+FFTEXTTimeText==FFSDIF)
-////            setFullPath(QDir::currentPath()+QDir::separator()+"unnamed.sdif");
-////        m_fileformat = FFSDIF;
-////        else
-//        setFullPath(QDir::currentPath()+QDir::separator()+"unnamed.txt");
-//        m_fileformat = FFAsciiTimeValue;
-//    }
-
-    // Compute the f0 from the given sound file
-    QString msg = "Estimating F0 of "+fileFullPath+" in ["+QString::number(f0min)+","+QString::number(f0max)+"]Hz ";
-    if(force)
-        msg += " without voiced/unvoiced decision ";
-    gMW->globalWaitingBarMessage(msg+"...", 8);
-
-    double timestepsize = gMW->m_dlgSettings->ui->sbEstimationStepSize->value();
-
-    EpochTracker et; // TODO to put in FTSound because other features can be extracted from it (ex. GCIs, voicing)
-    et.set_external_frame_interval(timestepsize);
-    et.set_unvoiced_pulse_interval(timestepsize);
-    if(force) et.set_unvoiced_cost(100); // Set arbitray huge cost for avoiding unvoiced segments
-
-    gMW->globalWaitingBarSetValue(1);
-
-    // Initialize with the given input
     // Start with a dirty copy in the necessary format
     // #388: Compute only the necessary values (and not all of the file)
     //       Doing so, the dynamic prog result is not the same.
-    int64_t iskipfirst = std::min(int64_t(m_src_snd->wav.size()),std::max(int64_t(0),int64_t(fs*(tstart-10*timestepsize))));
+    int64_t iskipfirst = std::min(int64_t(snd->wav.size()),std::max(int64_t(0),int64_t(fs*(tstart-10*timestepsize))));
     int64_t iskiplast;
     if(tend!=-1)
-        iskiplast = std::min(int64_t(m_src_snd->wav.size()),std::max(int64_t(0),int64_t(fs*(tend+10*timestepsize))));
+        iskiplast = std::min(int64_t(snd->wav.size()),std::max(int64_t(0),int64_t(fs*(tend+10*timestepsize))));
     else
-        iskiplast = m_src_snd->wav.size()-1;
-    double tiskipfirst = iskipfirst/fs; // First index of signal's segment which is analyzed.
-    vector<int16_t> data(iskiplast-iskipfirst+1);
+        iskiplast = snd->wav.size()-1;
+    tiskipfirst = iskipfirst/fs; // First index of signal's segment which is analyzed.
+    data.resize(iskiplast-iskipfirst+1);
     for(size_t i=0; i<data.size(); ++i){
-        int64_t idx = i+iskipfirst-m_src_snd->m_giWavForWaveform->delay();
-        if(idx>=0 && idx<int64_t(m_src_snd->wav.size()))
-            data[i] = 32768*m_src_snd->wav[idx];
+        int64_t idx = i+iskipfirst-snd->m_giWavForWaveform->delay();
+        if(idx>=0 && idx<int64_t(snd->wav.size()))
+            data[i] = 32768*snd->wav[idx];
         else{
             data[i] = 0.0;
         }
     }
 //    COUTD << iskipfirst << " " << data.size() << endl;
-    if(fs<6000.0)
-        QMessageBox::warning(gMW, "Problem during estimation of F0", "Sampling rate is smaller than 6kHz, which may create substantial estimation errors.");
 
-    gMW->globalWaitingBarSetValue(2);
+    // Split in chunks, cut at the quietest 10ms around every FTFZERO_CHUNKLEN
+    // (the chunks' first samples are on the time steps' grid)
+    double framelen = fs*timestepsize; // [sample]
+    int nbframes = int((data.size()-1)/framelen)+1;
+    qint64 chunklen = qint64(FTFZERO_CHUNKLEN*fs);
+    qint64 search = qint64(FTFZERO_CHUNKSEARCH*fs);
+    int marginframes = int(FTFZERO_CHUNKMARGIN/timestepsize);
+    qint64 winlen = std::max(qint64(1), qint64(0.010*fs));
+    chunkframes.assign(1, 0);
+    qint64 cut = 0;
+    while(qint64(data.size())-cut > chunklen+chunklen/2){
+        qint64 target = cut+chunklen;
+        qint64 best = target;
+        double bestenergy = -1.0;
+        for(qint64 wb=target-search; wb+winlen<=target+search; wb+=winlen){
+            double energy = 0.0;
+            for(qint64 n=wb; n<wb+winlen; ++n)
+                energy += double(data[n])*data[n];
+            if(bestenergy<0.0 || energy<bestenergy){
+                bestenergy = energy;
+                best = wb+winlen/2;
+            }
+        }
+        chunkframes.push_back(int(best/framelen+0.5));
+        cut = qint64(chunkframes.back()*framelen+0.5);
+    }
+    chunkframes.push_back(nbframes);
 
-    if (!et.Init(data.data(), data.size(), fs, f0min, f0max, true, true))
-        throw QString("EpochTracker initialisation failed");
+    chunkbegins.clear();
+    chunkends.clear();
+    for(size_t ci=0; ci+1<chunkframes.size(); ++ci){
+        chunkbegins.push_back(qint64(std::max(0, chunkframes[ci]-marginframes)*framelen+0.5));
+        chunkends.push_back(std::min(qint64(data.size()), qint64(std::min(nbframes, chunkframes[ci+1]+marginframes)*framelen+0.5)));
+    }
 
-    gMW->globalWaitingBarSetValue(3);
+    f0.assign(nbframes, 0.0f); // Unvoiced until computed
+    chunkf0s.assign(nbChunks(), std::vector<float>());
+    chunkerrors.assign(nbChunks(), QString());
+    chunkdone.assign(nbChunks(), QAtomicInt(0));
+    chunkgathered.assign(nbChunks(), false);
+    nbgathered = 0;
+}
 
-    // Compute f0 and pitchmarks.
-    if (!et.ComputeFeatures())
-        throw QString("Failed to compute features");
+void FTFZero::Estimation::computeChunk(int ci) {
+    try {
+        EpochTracker et; // TODO to put in FTSound because other features can be extracted from it (ex. GCIs, voicing)
+        et.set_external_frame_interval(timestepsize);
+        et.set_unvoiced_pulse_interval(timestepsize);
+        if(force) et.set_unvoiced_cost(100); // Set arbitray huge cost for avoiding unvoiced segments
+
+        // Initialize with the given input
+        if (!et.Init(data.data()+chunkbegins[ci], chunkends[ci]-chunkbegins[ci], fs, f0min, f0max, true, true))
+            throw QString("EpochTracker initialisation failed");
+
+        // Compute f0 and pitchmarks.
+        if (!et.ComputeFeatures())
+            throw QString("Failed to compute features");
+
+        // et.TrackEpochs()
+        et.CreatePeriodLattice();
+        et.DoDynamicProgramming();
+        if (!et.BacktrackAndSaveOutput())
+            throw QString("Failed to track epochs");
+
+        std::vector<float> corr; // Currently unused
+        if (!et.ResampleAndReturnResults(timestepsize, &(chunkf0s[ci]), &corr))
+            throw QString("Cannot resample the results");
+
+        // Force clip the f0 values
+        std::vector<float>& cf0 = chunkf0s[ci];
+        for (size_t i=0; i<cf0.size(); ++i)
+            if(cf0[i]>0.0)
+                cf0[i] = std::max(float(f0min),std::min(float(f0max),cf0[i]));
+    }
+    catch(QString err){
+        chunkerrors[ci] = err;
+    }
+    catch(std::bad_alloc err){
+        chunkerrors[ci] = "Not enough memory";
+    }
 
-    gMW->globalWaitingBarSetValue(4);
+    chunkdone[ci].storeRelease(1);
+}
 
-    // et.TrackEpochs()
-    et.CreatePeriodLattice();
-    gMW->globalWaitingBarSetValue(5);
-    et.DoDynamicProgramming();
-    gMW->globalWaitingBarSetValue(6);
-    if (!et.BacktrackAndSaveOutput())
-        throw QString("Failed to track epochs");
+// Computes one chunk of an estimation
+class F0ChunkWorker : public QRunnable {
+    FTFZero::Estimation* m_est;
+    int m_ci;
+    QAtomicInt* m_canceled;
+    QAtomicInt* m_nbdone;
+
+public:
+    F0ChunkWorker(FTFZero::Estimation* est, int ci, QAtomicInt* canceled, QAtomicInt* nbdone)
+        : m_est(est)
+        , m_ci(ci)
+        , m_canceled(canceled)
+        , m_nbdone(nbdone)
+    {
+        setAutoDelete(true);
+    }
+
+    void run() {
+        if(m_canceled==NULL || !m_canceled->load())
+            m_est->computeChunk(m_ci);
+        if(m_nbdone)
+            m_nbdone->fetchAndAddOrdered(1);
+    }
+};
+
+void FTFZero::Estimation::start(QThreadPool* workers, QAtomicInt* canceled, QAtomicInt* nbdone) {
+    for(int ci=0; ci<nbChunks(); ++ci)
+        workers->start(new F0ChunkWorker(this, ci, canceled, nbdone));
+}
+
+bool FTFZero::Estimation::gather() {
+    bool gathered = false;
+    for(int ci=0; ci<nbChunks(); ++ci){
+        if(chunkgathered[ci] || !chunkdone[ci].loadAcquire())
+            continue;
+        chunkgathered[ci] = true;
+        nbgathered++;
+        if(!chunkerrors[ci].isEmpty())
+            continue;
+
+        if(nbChunks()==1){
+            // Keep all the values, as without chunks
+            f0.swap(chunkf0s[ci]);
+        }
+        else{
+            // Keep the chunk's values outside of the overlaps
+            int firstframe = int(chunkbegins[ci]/(fs*timestepsize)+0.5);
+            int last = std::min(chunkframes[ci+1], firstframe+int(chunkf0s[ci].size()));
+            for(int n=chunkframes[ci]; n<last; ++n)
+                f0[n] = chunkf0s[ci][n-firstframe];
+        }
+        std::vector<float>().swap(chunkf0s[ci]);
+        gathered = true;
+    }
 
-    gMW->globalWaitingBarSetValue(7);
+    if(nbgathered==nbChunks())
+        std::vector<int16_t>().swap(data); // Not needed anymore
 
-    std::vector<float> f0; // TODO Drop this temporary variable
-    std::vector<float> corr; // Currently unused
-    if (!et.ResampleAndReturnResults(timestepsize, &f0, &corr))
-        throw QString("Cannot resample the results");
+    return gathered;
+}
 
-    // Force clip the f0 values
-    for (size_t i=0; i<f0.size(); ++i)
-        if(f0[i]>0.0)
-            f0[i] = std::max(float(f0min),std::min(float(f0max),f0[i]));
+int FTFZero::Estimation::nbDone() const {
+    int nbdone = 0;
+    for(int ci=0; ci<nbChunks(); ++ci)
+        if(chunkdone[ci].loadAcquire())
+            nbdone++;
+    return nbdone;
+}
+
+bool FTFZero::Estimation::isDone() const {
+    return nbDone()==nbChunks();
+}
 
-    // Estimation is done, let's fill/replace the f0 curve
-    if(tstart==-1 && tend==-1){
-        // If time segment is undefined, replace everything
-        ts.resize(f0.size());
-        for (size_t i=0; i<ts.size(); ++i)
-            ts[i] = timestepsize*i;
-        f0s.clear();
-        f0s.insert(f0s.end(), f0.begin(), f0.end());
+void FTFZero::Estimation::releaseData() {
+    std::vector<int16_t>().swap(data);
+}
+
+QString FTFZero::Estimation::error() const {
+    for(int ci=0; ci<nbChunks(); ++ci)
+        if(chunkgathered[ci] && !chunkerrors[ci].isEmpty())
+            return chunkerrors[ci];
+    return QString();
+}
+
+void FTFZero::estimate(FTSound *ftsnd, double f0min, double f0max, double tstart, double tend, bool force) {
+
+    if(ftsnd)
+        m_src_snd = ftsnd;
+
+    if(!gFL->hasFile(m_src_snd)){
+        QMessageBox::warning(gMW, "Missing Source file", "The source file used for updating the F0 is not listed in the application anymore.");
+        return;
+    }
+    if(m_src_snd->isLoading()){
+        QMessageBox::warning(gMW, "Source file not loaded", "The source file used for updating the F0 is still loading. Please wait for the end of the loading.");
+        return;
     }
-    else{
-        // Find where the former values are
-        // (using log2-time search)
-        std::vector<double>::iterator itlb = std::lower_bound(ts.begin(), ts.end(), tstart);
-        std::vector<double>::iterator ithb = std::upper_bound(ts.begin(), ts.end(), tend);
-        int erasefirst = itlb-ts.begin();
-        int eraselast = ithb-ts.begin()-1;
 
-        // Erase the former values
-        std::vector<double>::iterator tsl = ts.erase(ts.begin()+erasefirst, ts.begin()+eraselast+1);
-        std::vector<double>::iterator f0sl = f0s.erase(f0s.begin()+erasefirst, f0s.begin()+eraselast+1);
+//    COUTD << "FTFZero::estimate src=" << m_src_snd->visibleName << " [" << f0min << "," << f0max << "]Hz [" << tstart << "," << tend << "]s " << force << endl;
 
-        // And insert the new values
+//    if(_fileName==""){
+////        if(gMW->m_dlgSettings->ui->cbLabelsDefaultFormat->currentIndex()+FFTEXTTimeText==FFSDIF)
+////            setFullPath(QDir::currentPath()+QDir::separator()+"unnamed.sdif");
+////        m_fileformat = FFSDIF;
+////        else
+//        setFullPath(QDir::currentPath()+QDir::separator()+"unnamed.txt");
+//        m_fileformat = FFAsciiTimeValue;
+//    }
 
-        // Find the elements in the new values
-        int nitlb = std::ceil((tstart-tiskipfirst)/timestepsize);
-        int nithb = std::floor((tend-tiskipfirst)/timestepsize);
+    // Compute the f0 from the given sound file
+    Estimation est;
+    est.prepare(m_src_snd, f0min, f0max, tstart, tend, force);
 
-        // Add the new times ...
-        std::vector<double> nts(nithb-nitlb+1);
-        for(size_t i=0; i<nts.size(); ++i)
-            nts[i] = timestepsize*(nitlb+i) + tiskipfirst;
-        ts.insert(tsl, nts.begin(), nts.end());
-//        ts.clear(); ts.insert(ts.end(), nts.begin(), nts.end());
+    QString msg = "Estimating F0 of "+fileFullPath+" in ["+QString::number(est.f0min)+","+QString::number(est.f0max)+"]Hz ";
+    if(force)
+        msg += " without voiced/unvoiced decision ";
+    gMW->globalWaitingBarMessage(msg+"...", est.nbChunks());
 
-        // ... and the new f0 values.
-        f0s.insert(f0sl, f0.begin()+nitlb, f0.begin()+nithb+1);
-//        f0s.clear(); f0s.insert(f0s.end(), f0.begin()+nitlb, f0.begin()+nithb+1);
+    if(est.fs<6000.0)
+        QMessageBox::warning(gMW, "Problem during estimation of F0", "Sampling rate is smaller than 6kHz, which may create substantial estimation errors.");
+
+    // Track the chunks in parallel and show the curve as they come
+    QAtomicInt canceled(0);
+    QThreadPool workers;
+    workers.setMaxThreadCount(std::max(1, QThread::idealThreadCount()));
+
+    // These progress dialogs HAVE to be built on the stack otherwise ghost dialogs appear.
+    QProgressDialog prgdlg("Estimating F0...", "Abort", 0, est.nbChunks(), gMW);
+    prgdlg.setWindowModality(Qt::WindowModal); // The files must not change in the meantime
+    prgdlg.setMinimumDuration(500);
+
+    est.start(&workers, &canceled);
+    while(!workers.waitForDone(100)){
+        if(est.gather()){
+            apply(est);
+            gMW->m_gvSpectrogram->m_scene->update();
+        }
+        gMW->globalWaitingBarSetValue(est.nbgathered);
+        prgdlg.setValue(est.nbgathered);
+        QCoreApplication::processEvents(); // To show the progress
+        if(prgdlg.wasCanceled())
+            canceled.store(1); // The running chunks are finished, the others are skipped
     }
+    est.gather();
+    prgdlg.setValue(prgdlg.maximum());
+
+    apply(est);
+
+    QString err = est.error();
+    if(!err.isEmpty())
+        throw err;
 
     gMW->globalWaitingBarDone();
+}
+
+void FTFZero::apply(const Estimation& est) {
+
+    m_src_snd = est.snd;
+
+    // Replace the former values by the ones of the gathered chunks,
+    // in the time segment (everywhere if it is undefined).
+    // The chunks which are not gathered (e.g. skipped or failed) keep the former values.
+    const double inf = std::numeric_limits<double>::infinity();
+    std::vector<double> nts;
+    std::vector<double> nf0s;
+    nts.reserve(ts.size()+est.f0.size());
+    nf0s.reserve(ts.size()+est.f0.size());
+    size_t oi = 0; // The next former value
+    for(int ci=0; ci<est.nbChunks(); ++ci){
+        if(!est.chunkgathered[ci] || !est.chunkerrors[ci].isEmpty())
+            continue;
+
+        bool firstchunk = (ci==0);
+        bool lastchunk = (ci==est.nbChunks()-1);
+
+        // The chunk's time span, which is [tlow,thigh[ (or [tlow,thigh] at the end of the segment)
+        double tlow = firstchunk?-inf:est.tiskipfirst+est.timestepsize*(est.chunkframes[ci]-0.5);
+        double thigh = lastchunk?inf:est.tiskipfirst+est.timestepsize*(est.chunkframes[ci+1]-0.5);
+        bool highincluded = false;
+        if(est.tstart!=-1)
+            tlow = std::max(tlow, est.tstart);
+        if(est.tend!=-1 && est.tend<thigh){
+            thigh = est.tend;
+            highincluded = true;
+        }
+
+        // The chunk's new values in this span
+        int nfirst = firstchunk?0:est.chunkframes[ci];
+        int nlast = lastchunk?int(est.f0.size())-1:est.chunkframes[ci+1]-1;
+        if(est.tstart!=-1)
+            nfirst = std::max(nfirst, int(std::ceil((est.tstart-est.tiskipfirst)/est.timestepsize)));
+        if(est.tend!=-1)
+            nlast = std::min(nlast, int(std::floor((est.tend-est.tiskipfirst)/est.timestepsize)));
+        nlast = std::min(nlast, int(est.f0.size())-1);
+
+        // Keep the former values before the span ...
+        for(; oi<ts.size() && ts[oi]<tlow; ++oi){
+            nts.push_back(ts[oi]);
+            nf0s.push_back(f0s[oi]);
+        }
+        // ... drop the ones in the span ...
+        while(oi<ts.size() && (ts[oi]<thigh || (highincluded && ts[oi]==thigh)))
+            ++oi;
+        // ... and add the new ones.
+        for(int n=nfirst; n<=nlast; ++n){
+            nts.push_back(est.timestepsize*n + est.tiskipfirst);
+            nf0s.push_back(est.f0[n]);
+        }
+    }
+    for(; oi<ts.size(); ++oi){
+        nts.push_back(ts[oi]);
+        nf0s.push_back(f0s[oi]);
+    }
+    ts.swap(nts);
+    f0s.swap(nf0s);
 
     if(m_giF0ForSpectrogram)
         m_giF0ForSpectrogram->updateGeometry();
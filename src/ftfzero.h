@@ -23,10 +23,13 @@ file provided in the source code of DFasma. Another copy can be found at
 
 #include <deque>
 #include <vector>
+#include <stdint.h>
 
 #include <QString>
 #include <QColor>
 #include <QAction>
+#include <QAtomicInt>
+class QThreadPool;
 class QGraphicsSimpleTextItem;
 
 class QAEGISampledSignal;
@@ -47,6 +50,7 @@ private:
     void constructor_internal();
     void constructor_external();
     void load();
+    void setDefaultFileFormat();
 
     QAction* m_actionSave;
     QAction* m_actionSaveAs;
@@ -83,8 +87,49 @@ public:
     void draw_freq_amp(QPainter* painter, const QRectF& rect);
 
     // Estimation
+    // The analyzed segment is split in overlapping chunks, cut at silences,
+    // which are tracked independently and gathered in f0 once computed.
+    // computeChunk(.) can run in worker threads, whereas the other functions
+    // and FTFZero::apply() have to be called from the GUI thread.
+    class Estimation {
+    public:
+        FTSound* snd;
+        double fs;
+        double f0min;
+        double f0max;
+        double tstart;
+        double tend;
+        bool force;
+        double timestepsize;
+        double tiskipfirst;         // [s] Time of the first sample of data
+        std::vector<int16_t> data;  // Copy of the analyzed segment of the sound
+        std::vector<float> f0;      // The result, one value per time step
+
+        std::vector<qint64> chunkbegins;    // [sample] Analyzed segment of each chunk, including the overlaps
+        std::vector<qint64> chunkends;
+        std::vector<int> chunkframes;       // [frame] The f0 of chunk c is kept in [chunkframes[c],chunkframes[c+1][
+        std::vector<std::vector<float> > chunkf0s;
+        std::vector<QString> chunkerrors;
+        std::vector<QAtomicInt> chunkdone;
+        std::vector<bool> chunkgathered;
+        int nbgathered;
+
+        Estimation();
+        void prepare(FTSound* snd, double f0min, double f0max, double tstart=-1.0, double tend=-1.0, bool force=false);
+        inline int nbChunks() const {return int(chunkbegins.size());}
+        void computeChunk(int ci);
+        // Compute all the chunks in the given pool (the chunks are skipped once canceled is set, nbdone counts the chunks)
+        void start(QThreadPool* workers, QAtomicInt* canceled=NULL, QAtomicInt* nbdone=NULL);
+        bool gather();  // Return true if new chunks have been gathered in f0
+        int nbDone() const;
+        bool isDone() const;
+        void releaseData(); // Free the copy of the samples, once the chunks are computed
+        QString error() const;
+    };
     FTFZero(QObject* parent, FTSound *ftsnd, double f0min, double f0max, double tstart=-1.0, double tend=-1.0, bool force=false);
+    FTFZero(QObject* parent, const Estimation& est);
     void estimate(FTSound *ftsnd, double f0min, double f0max, double tstart=-1.0, double tend=-1.0, bool force=false);
+    void apply(const Estimation& est); // Replace the curve by the gathered chunks of an estimation
     static QString createFileNameFromSound(const QString& sndfilename);
     FTSound* m_src_snd;
 
@@ -24,6 +24,7 @@ file provided in the source code of DFasma. Another copy can be found at
 #include <numeric>
 #include <algorithm>
 #include <vector>
+#include <limits>
 using namespace std;
 
 #ifdef SUPPORT_SDIF
@@ -43,6 +44,9 @@ using namespace Easdif;
 #include <QGraphicsSimpleTextItem>
 #include <QGraphicsObject>
 #include <QGraphicsTextItem>
+#include <QGraphicsSceneHoverEvent>
+#include <QStyleOptionGraphicsItem>
+#include <QFontMetricsF>
 #include <QTextCursor>
 #include <QTextStream>
 #include <QTextCodec>
@@ -57,19 +61,16 @@ using namespace Easdif;
 #include "gvspectrogram.h"
 #include "ftfzero.h"
 
+#define FTLABELSTEXTMAXWIDTH 400 // [pixels] Of the texts which are surely drawn
+
 extern QString DFasmaVersion();
 
 bool FTGraphicsLabelItem::s_isEditing = false;
 
-FTGraphicsLabelItem::FTGraphicsLabelItem(FTLabels* ftl, const QString & text)
+FTGraphicsLabelItem::FTGraphicsLabelItem(FTLabels* ftl, int index, const QString & text)
     : QGraphicsTextItem(text)
     , m_ftl(ftl)
-{
-}
-
-FTGraphicsLabelItem::FTGraphicsLabelItem(FTGraphicsLabelItem* ftgi, FTLabels* ftl)
-    : QGraphicsTextItem(ftgi->toPlainText())
-    , m_ftl(ftl)
+    , m_index(index)
 {
 }
 
@@ -86,17 +87,12 @@ void FTGraphicsLabelItem::focusOutEvent(QFocusEvent * event){
 //    COUTD << "FTGraphicsLabelItem::focusOutEvent " << endl;
     s_isEditing = false;
 
-    // Replace the text in the spectrogram
-    std::deque<double>::iterator p = std::find(m_ftl->starts.begin(), m_ftl->starts.end(), pos().x());
-    if(p!=m_ftl->starts.end()){
-        int index = std::distance(m_ftl->starts.begin(), p);
-        m_ftl->spectrogram_labels[index]->setText(toPlainText());
-    }
-    else
-        qWarning("FTGraphicsLabelItem::focusOutEvent Cannot replace the text in the spectrogram");
-
     setTextCursor(QTextCursor());
     update();
+
+    // Replace the text of the label and drop this editor
+    if(m_ftl->m_giEditor==this)
+        m_ftl->finishEditingText();
 }
 void FTGraphicsLabelItem::keyPressEvent(QKeyEvent * event){
 //    COUTD << "FTGraphicsLabelItem::keyPressEvent " << event->key() << " enter=" << Qt::Key_Enter << endl;
@@ -120,6 +116,176 @@ void FTGraphicsLabelItem::paint(QPainter *painter,const QStyleOptionGraphicsItem
     QGraphicsTextItem::paint(painter, option, widget);
 }
 
+FTGraphicsLabelsItem::FTGraphicsLabelsItem(FTLabels* ftl, bool waveform)
+    : m_ftl(ftl)
+    , m_waveform(waveform)
+    , m_fm(QFont())
+{
+    setFlag(QGraphicsItem::ItemUsesExtendedStyleOption); // For the exposedRect
+    setAcceptedMouseButtons(Qt::NoButton);
+    setAcceptHoverEvents(true); // For the tooltips
+}
+
+QRectF FTGraphicsLabelsItem::boundingRect() const {
+    return m_rect;
+}
+
+void FTGraphicsLabelsItem::viewChanged(const QTransform& trans){
+    if(scene() && scene()->sceneRect()!=m_rect){
+        prepareGeometryChange();
+        m_rect = scene()->sceneRect();
+    }
+
+    // The texts are at the top of the view, thus they move when the view moves
+    if(trans!=m_trans){
+        m_trans = trans;
+        update();
+    }
+}
+
+void FTGraphicsLabelsItem::labelsChanged(){
+    m_widths.clear();
+    update();
+}
+
+QRectF FTGraphicsLabelsItem::textRect(int li, const QTransform& trans) const {
+    if(m_widths.size()!=m_ftl->labels.size())
+        m_widths.assign(m_ftl->labels.size(), -1.0);
+    if(m_widths[li]<0.0)
+        m_widths[li] = m_fm.width(m_ftl->labels[li]);
+
+    qreal width = m_widths[li];
+    qreal height = m_fm.height();
+    if(m_waveform){
+        // As a QGraphicsTextItem, with the margins of its document
+        width += 8;
+        height += 8;
+    }
+
+    qreal x = trans.map(QPointF(m_ftl->starts[li], 0.0)).x();
+    x += m_waveform?-2.0:2.0;
+    if(m_ftl->starts[li]>gFL->getMaxLastSampleTime()-24.0/trans.m11())
+        x -= width-4; // Keep it inside the view at the end of the file
+
+    return QRectF(x, 10.0, width, height);
+}
+
+void FTGraphicsLabelsItem::layoutTexts(const QTransform& trans, double left, double right, std::vector<int>& indices, std::vector<QRectF>& rects) const {
+    indices.clear();
+    rects.clear();
+
+    const std::vector<double>& starts = m_ftl->starts;
+    QTransform inv = trans.inverted();
+    // The texts can go over their neighbour labels
+    double margin = FTLABELSTEXTMAXWIDTH/trans.m11();
+    // Always start from the left of the view, so that the texts don't depend on the drawn region
+    double viewleft = inv.map(QPointF(0.0, 0.0)).x();
+    int li = int(std::lower_bound(starts.begin(), starts.end(), std::min(left, viewleft)-margin)-starts.begin());
+    int last = int(std::upper_bound(starts.begin(), starts.end(), right+margin)-starts.begin());
+
+    // Skip the texts which overlap the last drawn one
+    qreal drawnright = -std::numeric_limits<qreal>::infinity();
+    while(li<last){
+        QRectF rect = textRect(li, trans);
+        if(rect.left()<drawnright){
+            ++li;
+            continue;
+        }
+        indices.push_back(li);
+        rects.push_back(rect);
+        drawnright = rect.right();
+
+        // The texts start at most 2 pixels left of their label,
+        // thus jump over the labels whose texts would surely overlap this one
+        int next = int(std::lower_bound(starts.begin()+li+1, starts.begin()+last, inv.map(QPointF(drawnright-2.0, 0.0)).x())-starts.begin());
+        li = std::max(li+1, next);
+    }
+}
+
+int FTGraphicsLabelsItem::textAt(const QGraphicsView* view, const QPoint& pos) const {
+    if(!isVisible() || m_ftl->starts.empty())
+        return -1;
+
+    QTransform trans = view->viewportTransform();
+    double x = view->mapToScene(pos).x();
+    std::vector<int> indices;
+    std::vector<QRectF> rects;
+    layoutTexts(trans, x, x, indices, rects);
+    for(size_t ti=0; ti<indices.size(); ++ti)
+        if(rects[ti].contains(pos))
+            return indices[ti];
+
+    return -1;
+}
+
+void FTGraphicsLabelsItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget){
+    Q_UNUSED(widget)
+
+    const std::vector<double>& starts = m_ftl->starts;
+    if(starts.empty())
+        return;
+
+    QRectF rect = option->exposedRect;
+    QTransform trans = painter->worldTransform();
+
+    // The lines, at most one per column of pixels
+    QPen pen(m_ftl->getColor());
+    pen.setWidth(0);
+    painter->setPen(pen);
+    double top = m_waveform?-1.0:-0.5*gFL->getFs();
+    double bottom = m_waveform?1.0:0.0;
+    QTransform inv = trans.inverted();
+    int li = int(std::lower_bound(starts.begin(), starts.end(), rect.left())-starts.begin());
+    int last = int(std::upper_bound(starts.begin(), starts.end(), rect.right())-starts.begin());
+    int prevcol = std::numeric_limits<int>::min();
+    while(li<last){
+        int col = int(std::floor(trans.map(QPointF(starts[li], 0.0)).x()));
+        if(col==prevcol){
+            ++li; // Rounding at the column's border
+            continue;
+        }
+        painter->drawLine(QLineF(starts[li], top, starts[li], bottom));
+        prevcol = col;
+
+        // Jump to the next column
+        int next = int(std::lower_bound(starts.begin()+li+1, starts.begin()+last, inv.map(QPointF(col+1.0, 0.0)).x())-starts.begin());
+        li = std::max(li+1, next);
+    }
+
+    // The texts, in pixels
+    std::vector<int> indices;
+    std::vector<QRectF> rects;
+    layoutTexts(trans, rect.left(), rect.right(), indices, rects);
+    painter->save();
+    painter->resetTransform();
+    painter->setFont(QFont());
+    for(size_t ti=0; ti<indices.size(); ++ti){
+        if(m_ftl->m_giEditor && m_ftl->m_giEditor->index()==indices[ti])
+            continue; // The editor shows it
+
+        if(m_waveform){
+            // As FTGraphicsLabelItem
+            painter->drawRect(rects[ti].adjusted(+2, +2, -2, -2));
+            painter->drawText(rects[ti].adjusted(+4, +4, -4, -4), Qt::AlignLeft|Qt::AlignTop|Qt::TextDontClip, m_ftl->labels[indices[ti]]);
+        }
+        else
+            painter->drawText(rects[ti], Qt::AlignLeft|Qt::AlignTop|Qt::TextDontClip, m_ftl->labels[indices[ti]]);
+    }
+    painter->restore();
+}
+
+void FTGraphicsLabelsItem::hoverMoveEvent(QGraphicsSceneHoverEvent * event){
+    QGraphicsView* view = NULL;
+    if(event->widget())
+        view = qobject_cast<QGraphicsView*>(event->widget()->parentWidget());
+
+    int li = -1;
+    if(view)
+        li = textAt(view, view->mapFromScene(event->scenePos()));
+
+    setToolTip(li==-1?QString():m_ftl->texts[li]);
+}
+
 std::deque<QString> FTLabels::s_formatstrings;
 FTLabels::ClassConstructor::ClassConstructor(){
     // Attention ! It has to correspond to FType definition's order.
@@ -140,6 +306,12 @@ FTLabels::ClassConstructor FTLabels::s_class_constructor;
 void FTLabels::constructor_internal(){
     m_fileformat = FFNotSpecified;
     m_src_fzero = NULL;
+    m_giEditor = NULL;
+
+    m_giWaveformLabels = new FTGraphicsLabelsItem(this, true);
+    gMW->m_gvWaveform->m_scene->addItem(m_giWaveformLabels);
+    m_giSpectrogramLabels = new FTGraphicsLabelsItem(this, false);
+    gMW->m_gvSpectrogram->m_scene->addItem(m_giSpectrogramLabels);
 
     connect(m_actionShow, SIGNAL(toggled(bool)), this, SLOT(setVisible(bool)));
 
@@ -208,9 +380,11 @@ FTLabels::FTLabels(const FTLabels& ft)
 {
     FTLabels::constructor_internal();
 
-    int starti=0;
-    for(std::deque<FTGraphicsLabelItem*>::const_iterator it=ft.waveform_labels.begin(); it!=ft.waveform_labels.end(); ++it, ++starti)
-        addLabel(ft.starts[starti], (*it)->toolTip(), (*it)->toPlainText());
+    starts = ft.starts;
+    texts = ft.texts;
+    labels = ft.labels;
+    m_giWaveformLabels->labelsChanged();
+    m_giSpectrogramLabels->labelsChanged();
 
     m_lastreadtime = ft.m_lastreadtime;
     m_modifiedtime = ft.m_modifiedtime;
@@ -242,6 +416,10 @@ void FTLabels::load() {
 
     clear(); // First, ensure there is no leftover
 
+    // The labels are added all at once at the end
+    std::vector<double> positions;
+    QStringList texts, showntxts;
+
     if(m_fileformat==FFNotSpecified)
         m_fileformat = FFAutoDetect;
 
@@ -331,7 +509,9 @@ void FTLabels::load() {
         line = stream.readLine();
         do {
             QTextStream(&line) >> t >> text;
-            addLabel(t, text, extractCenterLabel(text));
+            positions.push_back(t);
+            texts.append(text);
+            showntxts.append(extractCenterLabel(text));
 
             line = stream.readLine();
         } while (!line.isNull());
@@ -348,13 +528,18 @@ void FTLabels::load() {
         line = stream.readLine();
         do {
             QTextStream(&line) >> startt >> endt >> text;
-            addLabel(startt, text, extractCenterLabel(text));
+            positions.push_back(startt);
+            texts.append(text);
+            showntxts.append(extractCenterLabel(text));
 
             line = stream.readLine();
         } while (!line.isNull());
 
-        if(text.size()>0 && (char)(text.toLatin1()[0])!=char(31))
-            addLabel(endt, "");
+        if(text.size()>0 && (char)(text.toLatin1()[0])!=char(31)){
+            positions.push_back(endt);
+            texts.append("");
+            showntxts.append("");
+        }
     }
     else if(m_fileformat==FFTEXTSegmentsSample){
         QFile data(fileFullPath);
@@ -373,7 +558,9 @@ void FTLabels::load() {
             startt /= fs;
             endt /= fs;
 //                COUTD << startt << " " << '"' << text << '"' << endl;
-            addLabel(startt, text, extractCenterLabel(text));
+            positions.push_back(startt);
+            texts.append(text);
+            showntxts.append(extractCenterLabel(text));
 
             line = stream.readLine();
         } while (!line.isNull());
@@ -382,8 +569,11 @@ void FTLabels::load() {
 //            for(size_t ci=0; ci<ba.size(); ++ci)
 //                std::cout << int((unsigned char)(ba[ci])) << std::endl;
 
-        if(text.size()>0 && (char)(text.toLatin1()[0])!=char(31))
-            addLabel(endt, "");
+        if(text.size()>0 && (char)(text.toLatin1()[0])!=char(31)){
+            positions.push_back(endt);
+            texts.append("");
+            showntxts.append("");
+        }
     }
     else if(m_fileformat==FFTEXTSegmentsHTK){
         QFile data(fileFullPath);
@@ -399,13 +589,18 @@ void FTLabels::load() {
             QTextStream(&line) >> startt >> endt >> text;
             startt *= 1e-7;
             endt *= 1e-7;
-            addLabel(startt, text, extractCenterLabel(text));
+            positions.push_back(startt);
+            texts.append(text);
+            showntxts.append(extractCenterLabel(text));
 
             line = stream.readLine();
         } while (!line.isNull());
 
-        if(text.size()>0 && (char)(text.toLatin1()[0])!=char(31))
-            addLabel(endt, "");
+        if(text.size()>0 && (char)(text.toLatin1()[0])!=char(31)){
+            positions.push_back(endt);
+            texts.append("");
+            showntxts.append("");
+        }
     }
     else if(m_fileformat==FFSDIF){
         #ifdef SUPPORT_SDIF
@@ -464,7 +659,9 @@ void FTLabels::load() {
                                 // ends.push_back(t);
                             }
                             else{
-                                addLabel(position, str, extractCenterLabel(str));
+                                positions.push_back(position);
+                                texts.append(str);
+                                showntxts.append(extractCenterLabel(str));
                             }
                         }
                     }
@@ -509,6 +706,8 @@ void FTLabels::load() {
         throw QString("File format not recognized for loading this label file.");
     }
 
+    addLabels(positions, texts, showntxts);
+
     updateTextsGeometryWaveform();
     updateTextsGeometrySpectrogram();
 
@@ -520,19 +719,13 @@ void FTLabels::load() {
 void FTLabels::clear() {
 //    COUTD << "FTLabels::clear" << endl;
     if(getNbLabels()>0) {
+        finishEditingText();
+
         starts.clear();
-        for(size_t li=0; li<waveform_labels.size(); li++)
-            delete waveform_labels[li];
-        waveform_labels.clear();
-        for(size_t li=0; li<spectrogram_labels.size(); li++)
-            delete spectrogram_labels[li];
-        spectrogram_labels.clear();
-        for(size_t li=0; li<waveform_lines.size(); li++)
-            delete waveform_lines[li];
-        waveform_lines.clear();
-        for(size_t li=0; li<spectrogram_lines.size(); li++)
-            delete spectrogram_lines[li];
-        spectrogram_lines.clear();
+        texts.clear();
+        labels.clear();
+        m_giWaveformLabels->labelsChanged();
+        m_giSpectrogramLabels->labelsChanged();
 
         m_is_edited = true;
         setStatus();
@@ -627,7 +820,7 @@ void FTLabels::save() {
         stream.setRealNumberNotation(QTextStream::ScientificNotation);
         stream.setCodec(gMW->m_dlgSettings->ui->cbLabelsDefaultTextEncoding->currentText().toLatin1().constData());
         for(size_t li=0; li<starts.size(); li++)
-            stream << starts[li] << " " << waveform_labels[li]->toPlainText() << endl;
+            stream << starts[li] << " " << labels[li] << endl;
     }
     else if(m_fileformat==FFTEXTSegmentsFloat){
         QFile data(fileFullPath);
@@ -641,7 +834,7 @@ void FTLabels::save() {
         for(size_t li=0; li<starts.size(); li++) {
             // If this is the last one AND its text is empty, skip it.
             // (thus, manage the read/write of segments files)
-            if(li==starts.size()-1 && waveform_labels[li]->toPlainText()=="")
+            if(li==starts.size()-1 && labels[li]=="")
                 continue;
 
             double last = starts[li] + 1.0/gFL->getFs(); // If not end, add a single sample to start
@@ -651,7 +844,7 @@ void FTLabels::save() {
                 if(gFL->ftsnds.size()>0)
                     last = gFL->getCurrentFTSound(true)->getLastSampleTime(); // Or last wav's sample time
             }
-            stream << starts[li] << " " << last << " " << waveform_labels[li]->toPlainText() << endl;
+            stream << starts[li] << " " << last << " " << labels[li] << endl;
         }
     }
     else if(m_fileformat==FFTEXTSegmentsSample){
@@ -666,7 +859,7 @@ void FTLabels::save() {
         for(size_t li=0; li<starts.size(); li++) {
             // If this is the last one AND its text is empty, skip it.
             // (thus, manage the read/write of segments files)
-            if(li==starts.size()-1 && waveform_labels[li]->toPlainText()=="")
+            if(li==starts.size()-1 && labels[li]=="")
                 continue;
 
             double last = starts[li] + 1.0/gFL->getFs(); // If not end, add a single sample to start
@@ -676,7 +869,7 @@ void FTLabels::save() {
                 if(gFL->ftsnds.size()>0)
                     last = gFL->getCurrentFTSound(true)->getLastSampleTime(); // Or last wav's sample time
             }
-            stream << int(fs*starts[li]) << " " << int(fs*last) << " " << waveform_labels[li]->toPlainText() << endl;
+            stream << int(fs*starts[li]) << " " << int(fs*last) << " " << labels[li] << endl;
         }
     }
     else if(m_fileformat==FFTEXTSegmentsHTK){
@@ -689,7 +882,7 @@ void FTLabels::save() {
         for(size_t li=0; li<starts.size(); li++) {
             // If this is the last one AND its text is empty, skip it.
             // (thus, manage the read/write of segments files)
-            if(li==starts.size()-1 && waveform_labels[li]->toPlainText()=="")
+            if(li==starts.size()-1 && labels[li]=="")
                 continue;
 
             double last = starts[li] + 1.0/gFL->getFs(); // If not end, add a single sample to start
@@ -699,7 +892,7 @@ void FTLabels::save() {
                 if(gFL->ftsnds.size()>0)
                     last = gFL->getCurrentFTSound(true)->getLastSampleTime(); // Or last wav's sample time
             }
-            stream << int(0.5+1e7*starts[li]) << " " << int(0.5+1e7*last) << " " << waveform_labels[li]->toPlainText() << endl;
+            stream << int(0.5+1e7*starts[li]) << " " << int(0.5+1e7*last) << " " << labels[li] << endl;
         }
     }
     else if(m_fileformat==FFSDIF){
@@ -743,7 +936,7 @@ void FTLabels::save() {
 
                 // Fill the matrix
                 SDIFMatrix tmpMatrix("1LAB");
-                tmpMatrix.Set(std::string(waveform_labels[li]->toPlainText().toLatin1().constData()));
+                tmpMatrix.Set(std::string(labels[li].toLatin1().constData()));
                 frameToWrite.AddMatrix(tmpMatrix);
 
                 frameToWrite.Write(filew);
@@ -805,19 +998,20 @@ void FTLabels::updateTextsGeometryWaveform(){
     if(!m_actionShow->isChecked())
         return;
 
-    QRectF waveform_viewrect = gMW->m_gvWaveform->mapToScene(gMW->m_gvWaveform->viewport()->rect()).boundingRect();
     QTransform waveform_trans = gMW->m_gvWaveform->transform();
+    m_giWaveformLabels->viewChanged(gMW->m_gvWaveform->viewportTransform());
 
-    for(size_t u=0; u<starts.size(); ++u){
+    if(m_giEditor){
+        QRectF waveform_viewrect = gMW->m_gvWaveform->mapToScene(gMW->m_gvWaveform->viewport()->rect()).boundingRect();
 
         double x = 0.0;
-        if(starts[u]>gFL->getMaxLastSampleTime()-24.0/waveform_trans.m11())
-            x = -(waveform_labels[u]->boundingRect().width()-4)/waveform_trans.m11();
+        if(starts[m_giEditor->index()]>gFL->getMaxLastSampleTime()-24.0/waveform_trans.m11())
+            x = -(m_giEditor->boundingRect().width()-4)/waveform_trans.m11();
 
         QTransform mat1;
         mat1.translate(x-2.0/waveform_trans.m11(), waveform_viewrect.top()+10.0/waveform_trans.m22());
         mat1.scale(1.0/waveform_trans.m11(), 1.0/waveform_trans.m22());
-        waveform_labels[u]->setTransform(mat1);
+        m_giEditor->setTransform(mat1);
     }
 }
 
@@ -827,145 +1021,161 @@ void FTLabels::updateTextsGeometrySpectrogram(){
     if(!m_actionShow->isChecked())
         return;
 
-    QRectF spectrogram_viewrect = gMW->m_gvSpectrogram->mapToScene(gMW->m_gvSpectrogram->viewport()->rect()).boundingRect();
-    QTransform spectrogram_trans = gMW->m_gvSpectrogram->transform();
-
-    for(size_t u=0; u<starts.size(); ++u){
-
-        double x = 0.0;
-        if(starts[u]>gFL->getMaxLastSampleTime()-24.0/spectrogram_trans.m11())
-            x = -(spectrogram_labels[u]->boundingRect().width()-4)/spectrogram_trans.m11();
-
-        QTransform mat2;
-        mat2.translate(x+2.0/spectrogram_trans.m11(), spectrogram_viewrect.top()+10.0/spectrogram_trans.m22());
-        mat2.scale(1.0/spectrogram_trans.m11(), 1.0/spectrogram_trans.m22());
-        spectrogram_labels[u]->setTransform(mat2);
-    }
+    m_giSpectrogramLabels->viewChanged(gMW->m_gvSpectrogram->viewportTransform());
 }
 
 void FTLabels::addLabel(double position, const QString& text, QString showntxt){
-    if(showntxt.isEmpty())
-        showntxt = text;
+    addLabels(std::vector<double>(1, position), QStringList(text), QStringList(showntxt));
+}
 
-    QPen pen(getColor());
-    pen.setWidth(0);
-    QBrush brush(getColor());
+void FTLabels::addLabels(const std::vector<double>& positions, const QStringList& newtexts, const QStringList& newshowntxts){
+    if(positions.empty())
+        return;
 
-    starts.push_back(position);
+    finishEditingText(); // The indices are going to change
 
-    waveform_labels.push_back(new FTGraphicsLabelItem(this, showntxt));
-    waveform_labels.back()->setPos(position, 0);
-    waveform_labels.back()->setDefaultTextColor(getColor());
-    waveform_labels.back()->setToolTip(text);
-    if(gMW->ui->actionEditMode->isChecked())
-        waveform_labels.back()->setTextInteractionFlags(Qt::TextEditable);
-    else
-        waveform_labels.back()->setTextInteractionFlags(Qt::NoTextInteraction);
-    gMW->m_gvWaveform->m_scene->addItem(waveform_labels.back());
-
-    spectrogram_labels.push_back(new QGraphicsSimpleTextItem(showntxt));
-    spectrogram_labels.back()->setPos(position, 0);
-    spectrogram_labels.back()->setBrush(brush);
-    spectrogram_labels.back()->setToolTip(text);
-    gMW->m_gvSpectrogram->m_scene->addItem(spectrogram_labels.back());
-    // TODO set Brush and pen for the outline!
-
-    waveform_lines.push_back(new QGraphicsLineItem(0, -1, 0, 1));
-    waveform_lines.back()->setPos(position, 0);
-    waveform_lines.back()->setPen(pen);
-    gMW->m_gvWaveform->m_scene->addItem(waveform_lines.back());
-
-    spectrogram_lines.push_back(new QGraphicsLineItem(0, 0, 0, -0.5*gFL->getFs()));
-    spectrogram_lines.back()->setPos(position, 0);
-    spectrogram_lines.back()->setPen(pen);
-    gMW->m_gvSpectrogram->m_scene->addItem(spectrogram_lines.back());    
+    // Append all the labels first, and sort them only once
+    for(size_t li=0; li<positions.size(); ++li){
+        starts.push_back(positions[li]);
+        texts.push_back(newtexts[int(li)]);
+        if(newshowntxts[int(li)].isEmpty())
+            labels.push_back(newtexts[int(li)]);
+        else
+            labels.push_back(newshowntxts[int(li)]);
+    }
 
     sort();
 
+    m_giWaveformLabels->labelsChanged();
+    m_giSpectrogramLabels->labelsChanged();
+
     m_is_edited = true;
     setStatus();
 }
 
-void FTLabels::moveLabel(int index, double position){
+int FTLabels::findNearest(double position) const {
+    if(starts.empty())
+        return -1;
+
+    int index = int(std::lower_bound(starts.begin(), starts.end(), position)-starts.begin());
+    if(index==int(starts.size()))
+        return index-1;
+    if(index>0 && position-starts[index-1]<starts[index]-position)
+        return index-1;
+
+    return index;
+}
+
+int FTLabels::moveLabel(int index, double position){
+    finishEditingText();
+
     starts[index] = position;
-    waveform_lines[index]->setPos(position, 0);
-    waveform_labels[index]->setPos(position, 0);
-    spectrogram_lines[index]->setPos(position, 0);
-    spectrogram_labels[index]->setPos(position, 0);
+
+    // Keep the labels in ascending order
+    while(index>0 && starts[index]<starts[index-1]){
+        std::swap(starts[index], starts[index-1]);
+        std::swap(texts[index], texts[index-1]);
+        std::swap(labels[index], labels[index-1]);
+        index--;
+    }
+    while(index<int(starts.size())-1 && starts[index+1]<starts[index]){
+        std::swap(starts[index], starts[index+1]);
+        std::swap(texts[index], texts[index+1]);
+        std::swap(labels[index], labels[index+1]);
+        index++;
+    }
+
+    m_giWaveformLabels->labelsChanged();
+    m_giSpectrogramLabels->labelsChanged();
 
     m_is_edited = true;
     setStatus();
+
+    return index;
 }
 void FTLabels::moveAllLabel(double delay){
 //    COUTD << "FTLabels::moveAllLabel " << delay << endl;
-    for(size_t u=0; u<starts.size(); ++u){
+    for(size_t u=0; u<starts.size(); ++u)
         starts[u] += delay;
-        waveform_lines[u]->setPos(waveform_lines[u]->pos().x()+delay, 0);
-        waveform_labels[u]->setPos(waveform_labels[u]->pos().x()+delay, 0);
-        spectrogram_lines[u]->setPos(spectrogram_lines[u]->pos().x()+delay, 0);
-        spectrogram_labels[u]->setPos(spectrogram_labels[u]->pos().x()+delay, 0);
-    }
+
+    m_giWaveformLabels->labelsChanged();
+    m_giSpectrogramLabels->labelsChanged();
+    updateTextsGeometryWaveform();
+
     m_is_edited = true;
     setStatus();
 }
 
 
 void FTLabels::changeText(int index, const QString& text){
-    waveform_labels[index]->setPlainText(text);
-    spectrogram_labels[index]->setText(text);
+    labels[index] = text;
+
+    m_giWaveformLabels->labelsChanged();
+    m_giSpectrogramLabels->labelsChanged();
 
     m_is_edited = true;
     setStatus();
 }
 
+void FTLabels::editText(int index){
+    finishEditingText();
+
+    m_giEditor = new FTGraphicsLabelItem(this, index, labels[index]);
+    m_giEditor->setPos(starts[index], 0);
+    m_giEditor->setDefaultTextColor(getColor());
+    m_giEditor->setToolTip(texts[index]);
+    m_giEditor->setTextInteractionFlags(Qt::TextEditorInteraction);
+    gMW->m_gvWaveform->m_scene->addItem(m_giEditor);
+    updateTextsGeometryWaveform();
+    m_giWaveformLabels->update();
+    m_giEditor->setFocus();
+}
+
+void FTLabels::finishEditingText(){
+    if(m_giEditor==NULL)
+        return;
+
+    FTGraphicsLabelItem* editor = m_giEditor;
+    m_giEditor = NULL;
+    if(editor->index()<int(labels.size()) && editor->toPlainText()!=labels[editor->index()])
+        changeText(editor->index(), editor->toPlainText());
+    editor->hide();
+    editor->deleteLater(); // It might be in its focusOutEvent
+}
+
 void FTLabels::setVisible(bool shown){
 //    cout << "FTLabels::setVisible" << endl;
     FileType::setVisible(shown);
 
+    if(!shown)
+        finishEditingText();
+
     if(shown){
         updateTextsGeometryWaveform();
         updateTextsGeometrySpectrogram();
     }
 
-    for(size_t u=0; u<starts.size(); ++u){
-        waveform_labels[u]->setVisible(shown);
-        spectrogram_labels[u]->setVisible(shown);
-        waveform_lines[u]->setVisible(shown);
-        spectrogram_lines[u]->setVisible(shown);
-    }
+    m_giWaveformLabels->setVisible(shown);
+    m_giSpectrogramLabels->setVisible(shown);
 }
 void FTLabels::setColor(const QColor& color) {
     FileType::setColor(color);
 
-    QPen pen(getColor());
-    pen.setWidth(0);
-    QBrush brush(getColor());
-
-    for(size_t u=0; u<starts.size(); ++u){
-        waveform_labels[u]->setDefaultTextColor(getColor());
-        spectrogram_labels[u]->setBrush(brush);
-        waveform_lines[u]->setPen(pen);
-        spectrogram_lines[u]->setPen(pen);
-    }
+    m_giWaveformLabels->update();
+    m_giSpectrogramLabels->update();
+    if(m_giEditor)
+        m_giEditor->setDefaultTextColor(getColor());
 }
 
 void FTLabels::removeLabel(int index){
+    finishEditingText();
 
     starts.erase(starts.begin()+index);
+    texts.erase(texts.begin()+index);
+    labels.erase(labels.begin()+index);
 
-    QGraphicsTextItem* labeltoremove = *(waveform_labels.begin()+index);
-    waveform_labels.erase(waveform_labels.begin()+index);
-    delete labeltoremove;
-    QGraphicsSimpleTextItem* labelsimpletoremove = *(spectrogram_labels.begin()+index);
-    spectrogram_labels.erase(spectrogram_labels.begin()+index);
-    delete labelsimpletoremove;
-
-    QGraphicsLineItem* linetoremove = *(waveform_lines.begin()+index);
-    waveform_lines.erase(waveform_lines.begin()+index);
-    delete linetoremove;
-    linetoremove = *(spectrogram_lines.begin()+index);
-    spectrogram_lines.erase(spectrogram_lines.begin()+index);
-    delete linetoremove;
+    m_giWaveformLabels->labelsChanged();
+    m_giSpectrogramLabels->labelsChanged();
 
     m_is_edited = true;
     setStatus();
@@ -993,30 +1203,36 @@ void FTLabels::sort(){
 //        cout << starts[u] << " ";
 //    cout << endl;
 
+    // Nothing to do if it is already sorted (e.g. when loading a file)
+    size_t n=1;
+    while(n<starts.size() && !(starts[n]<starts[n-1]))
+        ++n;
+    if(n>=starts.size())
+        return;
+
     vector<size_t> indices(starts.size(), 0);
     for(size_t u=0; u<indices.size(); ++u)
         indices[u] = u;
 
-    std::sort(indices.begin(), indices.end(), compare_indirect_index < std::deque<double> >(starts));
+    std::stable_sort(indices.begin(), indices.end(), compare_indirect_index < std::vector<double> >(starts));
 
-    std::deque<double> sorted_starts(starts.size());
-    std::deque<FTGraphicsLabelItem*> sorted_waveform_labels(waveform_labels.size());
-    std::deque<QGraphicsSimpleTextItem*> sorted_spectrogram_labels(spectrogram_labels.size());
-    std::deque<QGraphicsLineItem*> sorted_waveform_lines(starts.size());
-    std::deque<QGraphicsLineItem*> sorted_spectrogram_lines(starts.size());
+    finishEditingText(); // The indices are going to change
+
+    std::vector<double> sorted_starts(starts.size());
+    std::vector<QString> sorted_texts(starts.size());
+    std::vector<QString> sorted_labels(starts.size());
     for(size_t u=0; u<starts.size(); ++u){
         sorted_starts[u] = starts[indices[u]];
-        sorted_waveform_labels[u] = waveform_labels[indices[u]];
-        sorted_spectrogram_labels[u] = spectrogram_labels[indices[u]];
-        sorted_waveform_lines[u] = waveform_lines[indices[u]];
-        sorted_spectrogram_lines[u] = spectrogram_lines[indices[u]];
+        sorted_texts[u] = texts[indices[u]];
+        sorted_labels[u] = labels[indices[u]];
     }
 
-    starts = sorted_starts;
-    waveform_labels = sorted_waveform_labels;
-    spectrogram_labels = sorted_spectrogram_labels;
-    waveform_lines = sorted_waveform_lines;
-    spectrogram_lines = sorted_spectrogram_lines;
+    starts.swap(sorted_starts);
+    texts.swap(sorted_texts);
+    labels.swap(sorted_labels);
+
+    m_giWaveformLabels->labelsChanged();
+    m_giSpectrogramLabels->labelsChanged();
 
 //    cout << "sorted starts: ";
 //    for(size_t u=0; u<starts.size(); ++u)
@@ -1038,15 +1254,10 @@ QString FTLabels::extractCenterLabel(const QString &txt) {
 
 FTLabels::~FTLabels() {
     clear();
+    finishEditingText();
 
-    for(size_t li=0; li<waveform_labels.size(); ++li)
-        delete waveform_labels[li];
-    for(size_t li=0; li<spectrogram_labels.size(); ++li)
-        delete spectrogram_labels[li];
-    for(size_t li=0; li<waveform_lines.size(); ++li)
-        delete waveform_lines[li];
-    for(size_t li=0; li<spectrogram_lines.size(); ++li)
-        delete spectrogram_lines[li];
+    delete m_giWaveformLabels;
+    delete m_giSpectrogramLabels;
 
     gFL->ftlabels.erase(std::find(gFL->ftlabels.begin(), gFL->ftlabels.end(), this));
 
@@ -1098,22 +1309,24 @@ void FTLabels::estimate(FTFZero *ftfzero, double tstart, double tend) {
 //    }
 
     if(!m_src_fzero->ts.empty()){
+        std::vector<double> positions;
+        QStringList texts;
 
         bool voiced = m_src_fzero->f0s[0]>0;
-        if(voiced)
-            addLabel(m_src_fzero->ts[0], "V");
-        else
-            addLabel(m_src_fzero->ts[0], "U");
+        positions.push_back(m_src_fzero->ts[0]);
+        texts.append(voiced?"V":"U");
 
         for(size_t n=1; n<m_src_fzero->ts.size(); ++n){
 //            COUTD << m_src_fzero->ts[n] << ": " << m_src_fzero->f0s[n] << std::endl;
             bool curvoiced = m_src_fzero->f0s[n]>0;
-            if(!voiced && curvoiced)
-                addLabel(0.5*(m_src_fzero->ts[n-1]+m_src_fzero->ts[n]), "V");
-            if(voiced && !curvoiced)
-                addLabel(0.5*(m_src_fzero->ts[n-1]+m_src_fzero->ts[n]), "U");
+            if(voiced!=curvoiced){
+                positions.push_back(0.5*(m_src_fzero->ts[n-1]+m_src_fzero->ts[n]));
+                texts.append(curvoiced?"V":"U");
+            }
             voiced = curvoiced;
         }
+
+        addLabels(positions, texts, texts);
     }
 
     updateTextsGeometryWaveform();
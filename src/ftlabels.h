@@ -26,26 +26,32 @@ file provided in the source code of DFasma. Another copy can be found at
 #include <iostream>
 
 #include <QString>
+#include <QStringList>
 #include <QColor>
 #include <QAction>
 #include <QGraphicsTextItem>
+#include <QGraphicsItem>
+#include <QFontMetricsF>
 
 #include "filetype.h"
 
-class QGraphicsSimpleTextItem;
-class QGraphicsLineItem;
+class QGraphicsView;
 class FTLabels;
 class FTFZero;
 
+// Editor of the text of a single label, which exists only while editing it
 class FTGraphicsLabelItem : public QGraphicsTextItem
 {
     FTLabels* m_ftl;
+    int m_index;
     static bool s_isEditing;
     QString m_prevText;
 
 public:
-    FTGraphicsLabelItem(FTLabels* ftl, const QString & text);
-    FTGraphicsLabelItem(FTGraphicsLabelItem* ftgi, FTLabels* ftl); // copy ctor
+    FTGraphicsLabelItem(FTLabels* ftl, int index, const QString & text);
+
+    inline int index() const {return m_index;}
+    inline void setIndex(int index) {m_index=index;}
 
     virtual void keyPressEvent(QKeyEvent * event);
     virtual void focusInEvent(QFocusEvent * event);
@@ -56,6 +62,39 @@ public:
     static bool isEditing() {return s_isEditing;}
 };
 
+// Draws all the labels of a FTLabels in the waveform or the spectrogram,
+// but only those in the exposed time range (found by binary search, the labels being sorted).
+// The texts keep their size in pixels whatever the zoom,
+// and a text which would overlap the previous one is skipped.
+class FTGraphicsLabelsItem : public QGraphicsItem
+{
+    FTLabels* m_ftl;
+    bool m_waveform;    // Otherwise for the spectrogram
+    QRectF m_rect;      // The scene's rectangle
+    QTransform m_trans; // The view's transform at the last drawing
+    QFontMetricsF m_fm; // Of the texts' font
+    mutable std::vector<qreal> m_widths; // [pixels] Of the texts (negative if not measured yet)
+
+    QRectF textRect(int li, const QTransform& trans) const; // [pixels]
+
+public:
+    FTGraphicsLabelsItem(FTLabels* ftl, bool waveform);
+
+    // The labels whose text is drawn in [left,right] of a view, with their text's rectangle in pixels
+    void layoutTexts(const QTransform& trans, double left, double right, std::vector<int>& indices, std::vector<QRectF>& rects) const;
+    // The label whose text is at this position of the view (-1 if none)
+    int textAt(const QGraphicsView* view, const QPoint& pos) const;
+
+    void viewChanged(const QTransform& trans); // Redraw if the texts have to move with the view
+    void labelsChanged();
+
+    virtual QRectF boundingRect() const;
+    virtual void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget);
+
+protected:
+    virtual void hoverMoveEvent(QGraphicsSceneHoverEvent * event);
+};
+
 
 class FTLabels : public QObject, public FileType
 {
@@ -84,11 +123,12 @@ public:
     FTLabels(const QString& _fileName, QObject* parent, FileType::FileContainer container=FileType::FCUNSET, FileFormat fileformat=FFNotSpecified);
     virtual FileType* duplicate();
 
-    std::deque<double> starts; // TODO Get ride of ?
-    std::deque<FTGraphicsLabelItem*> waveform_labels;
-    std::deque<QGraphicsSimpleTextItem*> spectrogram_labels;
-    std::deque<QGraphicsLineItem*> waveform_lines;
-    std::deque<QGraphicsLineItem*> spectrogram_lines;
+    std::vector<double> starts;     // [s] Always in ascending order
+    std::vector<QString> texts;     // The full texts
+    std::vector<QString> labels;    // The shown texts (which are saved)
+    FTGraphicsLabelsItem* m_giWaveformLabels;
+    FTGraphicsLabelsItem* m_giSpectrogramLabels;
+    FTGraphicsLabelItem* m_giEditor;    // Only while editing the text of a label
 
     virtual QString info() const;
     virtual double getLastSampleTime() const;
@@ -97,10 +137,13 @@ public:
     void updateTextsGeometrySpectrogram();
 
     int getNbLabels() const                      {return int(starts.size());}
-    void moveLabel(int index, double position);
+    int findNearest(double position) const; // The index of the nearest label (-1 if there is none)
+    int moveLabel(int index, double position); // Return the new index of the label
     void moveAllLabel(double delay);
     void finishEditing()                         {sort();}
     void changeText(int index, const QString& text);
+    void editText(int index);   // Start editing the text of a label in the waveform
+    void finishEditingText();   // Drop the text editor, if any
     void setColor(const QColor& _color);
 
     ~FTLabels();
@@ -118,6 +161,7 @@ public slots:
     void clear();
     void removeLabel(int index);
     void addLabel(double position, const QString& text, QString showntxt="");
+    void addLabels(const std::vector<double>& positions, const QStringList& newtexts, const QStringList& newshowntxts); // Sorted at once
     void setVisible(bool shown);
 };
 
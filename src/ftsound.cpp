@@ -32,6 +32,9 @@ using namespace std;
 #include <QFileInfo>
 #include <QGraphicsRectItem>
 #include <QProgressDialog>
+#include <QStatusBar>
+#include <QThread>
+#include <QCoreApplication>
 #include "wmainwindow.h"
 #include "ui_wmainwindow.h"
 #include "gvspectrumamplitude.h"
@@ -47,6 +50,8 @@ using namespace std;
 #include "gvspectrogram.h"
 #include "gvspectrogramwdialogsettings.h"
 #include "ui_gvspectrogramwdialogsettings.h"
+#include "stftcache.h"
+#include "filtercomputethread.h"
 
 bool FTSound::s_playwin_use = false;
 std::vector<WAVTYPE> FTSound::s_avoidclickswindow;
@@ -120,22 +125,32 @@ bool FTSound::DFTParameters::operator==(const DFTParameters& param) const {
 
 
 void FTSound::constructor_internal() {
-    m_imgSTFT = QImage(1, 1, QImage::Format_ARGB32);
-    m_imgSTFT.fill(Qt::white);
-
     m_giWavForWaveform = NULL;
+    m_giFilteredWavForWaveform = NULL;
     m_channelid = 0;
     m_isclipped = false;
     m_isfiltered = false;
     m_isplaying = false;
-    wavtoplay  = &wav;
     m_filteredmaxamp = 0.0;
+    m_filteredbegin = 0;
+    m_filteredend = 0;
+    m_filteredgeneration = 0;
+    m_filteredselbegin = 0;
+    m_filteredselend = 0;
+    m_filteredreqbegin = 0;
+    m_filteredreqend = 0;
     m_start = 0;
     m_pos = 0;
     m_end = 0;
     m_avoidclickswinpos = 0;
 
+    m_loading = false;
+    m_loading_nbread = 0;
+    connect(this, SIGNAL(loadingProgressed()), this, SLOT(updateLoadingProgress()), Qt::QueuedConnection);
+    connect(this, SIGNAL(loadingFinished()), this, SLOT(finalizeLoading()), Qt::QueuedConnection);
+
     m_stftpa = NULL;
+    m_stftfile = NULL;
     m_stft_min = std::numeric_limits<FFTTYPE>::infinity();
     m_stft_max = -std::numeric_limits<FFTTYPE>::infinity();
 
@@ -178,11 +193,20 @@ void FTSound::constructor_external() {
     QPen pen(getColor());
     pen.setWidth(0);
 
-    m_giWavForWaveform = new QAEGIUniformlySampledSignal(wavtoplay, fs, gMW->m_gvWaveform);
+    m_giWavForWaveform = new QAEGIUniformlySampledSignal(&wav, fs, gMW->m_gvWaveform);
     m_giWavForWaveform->setPen(pen);
     m_giWavForWaveform->setClip(-1.0, 1.0);
     gMW->m_gvWaveform->m_scene->addItem(m_giWavForWaveform);
 
+    m_giFilteredWavForWaveform = new QAEGIUniformlySampledSignal(&wavfiltered, fs, gMW->m_gvWaveform);
+    QPen filteredpen(getColor().darker());
+    filteredpen.setWidth(0);
+    m_giFilteredWavForWaveform->setPen(filteredpen);
+    m_giFilteredWavForWaveform->setClip(-1.0, 1.0);
+    m_giFilteredWavForWaveform->setZValue(m_giWavForWaveform->zValue()+0.5);
+    m_giFilteredWavForWaveform->hide();
+    gMW->m_gvWaveform->m_scene->addItem(m_giFilteredWavForWaveform);
+
     m_giWavForSpectrumAmplitude = new QAEGIUniformlySampledSignal(&m_dftamp, 1.0, gMW->m_gvSpectrumAmplitude);
     m_giWavForSpectrumAmplitude->setPen(pen);
     gMW->m_gvSpectrumAmplitude->m_scene->addItem(m_giWavForSpectrumAmplitude);
@@ -219,6 +243,52 @@ FTSound::FTSound(const QString& _fileName, QObject *parent, int channelid)
 //    QIODevice::open(QIODevice::ReadOnly);
 }
 
+FTSound::FTSound(const QString& _fileName, QObject *parent, int channelid, bool)
+    : QIODevice(parent)
+    , FileType(FTSOUND, _fileName, this)
+{
+    FTSound::constructor_internal();
+    m_channelid = channelid;
+}
+
+std::vector<FTSound*> FTSound::createChannels(const QString& _fileName, QObject* parent, const std::vector<int>& channelids) {
+    std::vector<FTSound*> snds;
+    for(size_t ci=0; ci<channelids.size(); ++ci)
+        snds.push_back(new FTSound(_fileName, parent, channelids[ci], false));
+
+    try{
+        snds[0]->checkFileStatus(CFSMEXCEPTION);
+        try{
+            load(snds);
+        }
+        catch(std::bad_alloc err){
+            throw QString("There is not enough free memory to hold this file!");
+        }
+    }
+    catch(...){
+        for(size_t si=0; si<snds.size(); ++si){
+            snds[si]->constructor_external(); // Needed for the destruction
+            delete snds[si];
+        }
+        throw;
+    }
+
+    for(size_t si=0; si<snds.size(); ++si){
+        snds[si]->load_finalize();
+        snds[si]->constructor_external();
+    }
+
+    return snds;
+}
+
+#ifndef file_audio_LIBSNDFILE
+// The other file libraries read the file once per channel
+void FTSound::load(const std::vector<FTSound*>& snds){
+    for(size_t si=0; si<snds.size(); ++si)
+        snds[si]->load(snds[si]->m_channelid);
+}
+#endif
+
 FTSound::FTSound(const FTSound& ft)
     : QIODevice(ft.parent())
     , FileType(FTSOUND, ft.fileFullPath, this)
@@ -256,9 +326,58 @@ void FTSound::load_finalize() {
     setStatus();
 }
 
+void FTSound::updateLoadingProgress() {
+    if(!m_loading)
+        return;
+
+    gMW->statusBar()->showMessage(QString("Loading ")+QFileInfo(fileFullPath).fileName()+QString(" ... %1%").arg(m_loading_progress.loadAcquire()));
+
+    // Show what is already loaded
+    m_giWavForWaveform->clearCache();
+    gMW->m_gvWaveform->m_scene->update();
+}
+
+void FTSound::finalizeLoading() {
+    if(!m_loading)
+        return;
+
+    m_loading = false;
+    if(m_loading_nbread<qint64(wav.size()))
+        wav.resize(m_loading_nbread); // The file was shorter than announced
+
+    gMW->statusBar()->clearMessage();
+
+    m_giWavForWaveform->updateMinMaxValues();
+    m_giWavForWaveform->clearCache();
+    updateClippedState();
+    gMW->m_gvWaveform->fitViewToSoundsAmplitude();
+    gMW->m_gvWaveform->m_scene->update();
+
+    // Now the pending DFT and STFT can be computed
+    needDFTUpdate();
+    gMW->allSoundsChanged();
+    gMW->m_gvSpectrogram->updateSTFTPlot();
+}
+
+void FTSound::cancelLoading() {
+    if(!m_loading)
+        return;
+
+    m_loading_canceled.storeRelease(1);
+    while(m_loading_running.loadAcquire())
+        QThread::msleep(1);
+    m_loading = false;
+
+    // Drop the notifications of the loader which are not delivered yet
+    QCoreApplication::removePostedEvents(this, QEvent::MetaCall);
+
+    gMW->statusBar()->clearMessage();
+}
+
 void FTSound::setVisible(bool shown){
     FileType::setVisible(shown);
     m_giWavForWaveform->setVisible(shown);
+    updateFilteredWaveform();
     m_giWavForSpectrumAmplitude->setVisible(shown);
     m_giWavForSpectrumPhase->setVisible(shown);
     m_giWavForSpectrumGroupDelay->setVisible(shown);
@@ -287,6 +406,9 @@ void FTSound::setColor(const QColor &_color){
     QPen pen(getColor());
     pen.setWidth(0);
     m_giWavForWaveform->setPen(pen);
+    QPen filteredpen(getColor().darker());
+    filteredpen.setWidth(0);
+    m_giFilteredWavForWaveform->setPen(filteredpen);
     m_giWavForSpectrumAmplitude->setPen(pen);
     m_giWavForSpectrumPhase->setPen(pen);
     m_giWavForSpectrumGroupDelay->setPen(pen);
@@ -295,6 +417,7 @@ void FTSound::setColor(const QColor &_color){
 
 void FTSound::zposReset(){
     m_giWavForWaveform->setZValue(0.0);
+    m_giFilteredWavForWaveform->setZValue(0.5);
     m_giWavForSpectrumAmplitude->setZValue(0.0);
     m_giWavForSpectrumPhase->setZValue(0.0);
     m_giWavForSpectrumGroupDelay->setZValue(0.0);
@@ -302,6 +425,7 @@ void FTSound::zposReset(){
 }
 void FTSound::zposBringForward(){
     m_giWavForWaveform->setZValue(1.0);
+    m_giFilteredWavForWaveform->setZValue(1.5);
     m_giWavForSpectrumAmplitude->setZValue(1.0);
     m_giWavForSpectrumPhase->setZValue(1.0);
     m_giWavForSpectrumGroupDelay->setZValue(1.0);
@@ -312,14 +436,14 @@ bool FTSound::reload() {
 //    COUTD << "FTSound::reload" << endl;
 
     stopPlay();
+    cancelLoading();
     gMW->m_gvSpectrogram->m_stftcomputethread->cancelComputation(this);
+    gMW->m_gvWaveform->m_filtercomputethread->cancelComputation(this);
 
     if(!checkFileStatus(CFSMMESSAGEBOX))
         return false;
 
     // Reset everything ...
-    wavtoplay = &wav;
-    m_giWavForWaveform->setSignal(wavtoplay);
 //    m_ampscale = 1.0;
 //    m_delay = 0;
     m_start = 0;
@@ -328,17 +452,19 @@ bool FTSound::reload() {
     m_avoidclickswinpos = 0;
     wav.clear();
     wavfiltered.clear();
+    m_filteredbegin = 0;
+    m_filteredend = 0;
     setFiltered(false);
-    gMW->m_gvSpectrogram->m_stftcomputethread->m_mutex_changingstft.lock();
+    gMW->m_gvSpectrogram->m_stftcomputethread->m_lock_changingstft.lockForWrite();
 //    m_stft.clear();
-    if(m_stftpa){
-        delete m_stftpa;
-        m_stftpa = NULL;
-    }
+    deleteSTFT();
+    m_wavhash.clear();
+    m_stftpyramid.clear();
     m_stftts.clear();
-    gMW->m_gvSpectrogram->m_stftcomputethread->m_mutex_changingstft.unlock();
-    m_imgSTFTParams.clear();
     m_stftparams.clear();
+    m_stfttiles.clear();
+    gMW->m_gvSpectrogram->m_stftcomputethread->m_lock_changingstft.unlock();
+    m_imgSTFTParams.clear();
 
     // ... and reload the data from the file
     try{
@@ -445,23 +571,91 @@ void FTSound::fillContextMenu(QMenu& contextmenu) {
     contextmenu.addAction(gMW->ui->actionEstimationF0);
 }
 
+void FTSound::deleteSTFT() {
+    if(m_stftpa){
+        if(m_stftfile)
+            STFTCache::unmap(m_stftfile, m_stftpa);
+        else
+            delete[] m_stftpa;
+    }
+    m_stftpa = NULL;
+    m_stftfile = NULL;
+}
+
 void FTSound::needDFTUpdate() {
     m_stftparams.clear();
+    updateFilteredWaveform();
+}
+
+void FTSound::updateFilteredWaveform(bool samplesChanged) {
+    if(m_giFilteredWavForWaveform==NULL)
+        return;
+
+    if(samplesChanged)
+        m_giFilteredWavForWaveform->updateMinMaxValues();
+
+    bool shown = m_isfiltered && m_filteredend>m_filteredbegin && m_giWavForWaveform->isVisible();
+    if(shown){
+        if(samplesChanged
+           || m_giFilteredWavForWaveform->gain()!=m_giWavForWaveform->gain()
+           || m_giFilteredWavForWaveform->delay()!=m_giWavForWaveform->delay()+m_filteredbegin){
+            m_giFilteredWavForWaveform->setGain(m_giWavForWaveform->gain());
+            m_giFilteredWavForWaveform->setDelay(m_giWavForWaveform->delay()+m_filteredbegin);
+            m_giFilteredWavForWaveform->clearCache();
+        }
+    }
+    m_giFilteredWavForWaveform->setVisible(shown);
+}
+
+void FTSound::requestFiltering() {
+    if(!m_isfiltered || m_playfilter.isEmpty())
+        return;
+
+    // The visible samples of the selection
+    QRectF viewrect = gMW->m_gvWaveform->mapToScene(gMW->m_gvWaveform->viewport()->rect()).boundingRect();
+    qint64 delay = m_giWavForWaveform->delay();
+    qint64 vbegin = qint64(std::floor(viewrect.left()*fs))-delay;
+    qint64 vend = qint64(std::ceil(viewrect.right()*fs))-delay+1;
+    qint64 vlen = vend-vbegin;
+    vbegin = std::max(vbegin, m_filteredselbegin);
+    vend = std::min(vend, m_filteredselend);
+    if(vend<=vbegin)
+        return;
+
+    // Already filtered, or in progress
+    if((vbegin>=m_filteredbegin && vend<=m_filteredend)
+       || (vbegin>=m_filteredreqbegin && vend<=m_filteredreqend))
+        return;
+
+    // Add the width of the view on each side, so that scrolling doesn't ask again immediately
+    m_filteredreqbegin = std::max(vbegin-vlen, m_filteredselbegin);
+    m_filteredreqend = std::min(vend+vlen, m_filteredselend);
+
+    FilterComputeThread::Request req;
+    req.results.resize(1);
+    req.results[0].set(this, m_filteredgeneration, m_playfilter, wav, m_filteredreqbegin, m_filteredreqend);
+    gMW->globalWaitingBarMessage("Filtering the selection", 100);
+    gMW->m_gvWaveform->m_filtercomputethread->compute(req); // Any filtering in progress is canceled
 }
 
 void FTSound::setFiltered(bool filtered){
     if(filtered!=m_isfiltered){
-        if(filtered){
-            wavtoplay = &wavfiltered;
-            m_giWavForWaveform->setSignal(wavtoplay);
-        }
-        else{
-            wavtoplay = &wav;
-            m_giWavForWaveform->setSignal(wavtoplay);
+        if(!filtered){
+            std::vector<WAVTYPE>().swap(wavfiltered);
+            m_filteredbegin = 0;
+            m_filteredend = 0;
             m_filteredmaxamp = 0.0;
+            m_filteredselbegin = 0;
+            m_filteredselend = 0;
+            m_filteredreqbegin = 0;
+            m_filteredreqend = 0;
+            m_playfilter.clear();
+            m_filteredgeneration++;
+            gMW->m_gvWaveform->m_filtercomputethread->cancelComputation(this);
             needDFTUpdate();
         }
         m_isfiltered = filtered;
+        updateFilteredWaveform();
     }
     setStatus();
     gFL->fileInfoUpdate();
@@ -497,6 +691,7 @@ void FTSound::resetDelay(){
 void FTSound::inversePolarity(){
     m_giWavForWaveform->setGain(-m_giWavForWaveform->gain());
     m_giWavForWaveform->clearCache();
+    updateFilteredWaveform();
     gMW->m_gvSpectrumAmplitude->updateDFTs();
     gMW->m_gvSpectrumPhase->m_scene->update();
     gMW->m_gvSpectrumGroupDelay->m_scene->update();
@@ -515,6 +710,8 @@ bool FTSound::isModified() {
 void FTSound::setStatus(){
     FileType::setStatus();
 
+    updateFilteredWaveform();
+
     updateClippedState();
 }
 void FTSound::updateClippedState(){
@@ -558,6 +755,10 @@ double FTSound::setPlay(const QAudioFormat& format, double tstart, double tstop,
     if(format.sampleRate()!=fs)
         throw QString("The sampling frequency of the file is different from that of the audio engine. They have to be the same.");
 
+    // Neither play nor filter a partly loaded signal (as for the DFT and STFT)
+    if(isLoading())
+        throw QString("The file is still loading.");
+
     m_isplaying = true;
 
     // Draw an arrow in the icon
@@ -592,10 +793,10 @@ double FTSound::setPlay(const QAudioFormat& format, double tstart, double tstop,
 
     int delayedstart = m_start-m_giWavForWaveform->delay();
     if(delayedstart<0) delayedstart=0;
-    if(delayedstart>int(wavtoplay->size())-1) delayedstart=int(wavtoplay->size())-1;
+    if(delayedstart>int(wav.size())-1) delayedstart=int(wav.size())-1;
     int delayedend = m_end-m_giWavForWaveform->delay();
     if(delayedend<0) delayedend=0;
-    if(delayedend>int(wavtoplay->size())-1) delayedend=int(wavtoplay->size())-1;
+    if(delayedend>int(wav.size())-1) delayedend=int(wav.size())-1;
 
     // Fix frequency cutoffs
     if(fstart>fstop){
@@ -617,20 +818,16 @@ double FTSound::setPlay(const QAudioFormat& format, double tstart, double tstop,
     if ((fstart<fstop) && (doLowPass || doHighPass)) {
         // Filtered play
         try{
-            wavfiltered = wav; // Is it acceptable for big files ? Reason of issue #117 also ?
-
-            // Compute the energy of the non-filtered signal
-            double enerwav = 0.0;
-            if(gMW->m_dlgSettings->ui->cbPlaybackFilteringCompensateEnergy->isChecked()){
-                for(int n=delayedstart; n<=delayedend; n++)
-                    enerwav += wav[n]*wav[n];
-                enerwav = std::sqrt(enerwav);
-            }
+            // The previous filtering is not shown anymore
+            std::vector<WAVTYPE>().swap(wavfiltered);
+            m_filteredbegin = 0;
+            m_filteredend = 0;
 
             int butterworth_order = gMW->m_dlgSettings->ui->sbPlaybackButterworthOrder->value();
             gMW->m_gvSpectrumAmplitude->m_filterresponse = std::vector<FFTTYPE>(BUTTERRESPONSEDFTLEN/2+1,1.0);
             std::vector< std::vector<double> > num, den;
             std::vector<double> filterresponse;
+            m_playfilter.clear();
 
             if (doLowPass) {
                 // Compute the Butterworth filter coefficients
@@ -643,14 +840,7 @@ double FTSound::setPlay(const QAudioFormat& format, double tstart, double tstop,
                     gMW->m_gvSpectrumAmplitude->m_filterresponse[k] *= filterresponse[k];
                 }
 
-                gMW->globalWaitingBarMessage(QString("Low-pass filtering (cutoff=")+QString::number(fstop)+"Hz)");
-
-                cout << "LP-filtering (cutoff=" << fstop << ", size=" << wavfiltered.size() << ")" << endl;
-                // Filter the signal
-                for(size_t bi=0; bi<num.size(); bi++)
-                    qae::filtfilt<WAVTYPE>(wavfiltered, num[bi], den[bi], wavfiltered, delayedstart, delayedend);
-
-                gMW->globalWaitingBarClear();
+                m_playfilter.addBiquads(num, den);
             }
 
             if (doHighPass) {
@@ -664,37 +854,29 @@ double FTSound::setPlay(const QAudioFormat& format, double tstart, double tstop,
                     gMW->m_gvSpectrumAmplitude->m_filterresponse[k] *= filterresponse[k];
                 }
 
-                gMW->globalWaitingBarMessage(QString("Low-pass filtering (cutoff=")+QString::number(fstop)+"Hz)");
-
-                cout << "HP-filtering (cutoff=" << fstart << ", size=" << wavfiltered.size() << ")" << endl;
-
-                // Filter the signal
-                for(size_t bi=0; bi<num.size(); bi++)
-                    qae::filtfilt<WAVTYPE>(wavfiltered, num[bi], den[bi], wavfiltered, delayedstart, delayedend);
-
-                gMW->globalWaitingBarClear();
+                m_playfilter.addBiquads(num, den);
             }
 
-            if(gMW->m_dlgSettings->ui->cbPlaybackFilteringCompensateEnergy->isChecked()){
-                // Compute the energy of the filtered signal ...
-                double enerfilt = 0.0;
-                for(int n=delayedstart; n<=delayedend; n++)
-                    enerfilt += wavfiltered[n]*wavfiltered[n];
-                enerfilt = std::sqrt(enerfilt);
-
-                // ... and equalize the energy with the non-filtered signal
-                enerwav = enerwav/enerfilt; // Pre-compute the ratio
-                m_filteredmaxamp = 0.0;
-                for(int n=delayedstart; n<=delayedend; n++){
-                    wavfiltered[n] *= enerwav;
-                    m_filteredmaxamp = std::max(m_filteredmaxamp, std::abs(wavfiltered[n]));
-                }
-            }
+            // Equalize the energy with the non-filtered signal
+            // (estimated from the spectrum of the selection, so that nothing has to be filtered beforehand)
+            if(gMW->m_dlgSettings->ui->cbPlaybackFilteringCompensateEnergy->isChecked())
+                m_playfilter.setGain(m_playfilter.energyCompensation(wav, delayedstart, delayedend+1));
+
+            // The playback filters the samples by blocks while playing,
+            // the visible part of the selection is filtered for the views in the background
+            // (see requestFiltering and GVWaveform::filteringDone)
+            m_filteredgeneration++;
+            m_filteredmaxamp = 0.0;
+            m_filteredselbegin = delayedstart;
+            m_filteredselend = delayedend+1;
+            m_filteredreqbegin = 0;
+            m_filteredreqend = 0;
 
             // It seems the filtering went well, we can use the filtered sound and update the views
 
-            m_giWavForWaveform->updateMinMaxValues();
             setFiltered(true);
+            updateFilteredWaveform();
+            requestFiltering();
 
             // The filter response has been computed
             // Convert it to dB and multiply by 2 bcs the filtfilt doubled the effect.
@@ -728,11 +910,8 @@ double FTSound::setPlay(const QAudioFormat& format, double tstart, double tstop,
     gMW->m_gvSpectrumAmplitude->updateDFTs();
 
     if(isFiltered()){
-        if(gMW->m_gvWaveform->m_giSelection->rect().width()>0)
-            gMW->m_gvWaveform->m_giFilteredSelection->setRect(gMW->m_gvWaveform->m_giSelection->rect());
-        else
-            gMW->m_gvWaveform->m_giFilteredSelection->setRect(-0.5/gFL->getFs(), -1.0, getLastSampleTime()+1.0/gFL->getFs(), 2.0);
-        gMW->m_gvWaveform->m_giFilteredSelection->show();
+        // Shown once the selection is filtered for the views
+        gMW->m_gvWaveform->m_giFilteredSelection->hide();
         // SPEEDUP Could clear/update/invalidate only the concerned time selection
         m_giWavForWaveform->clearCache();
         gMW->m_gvWaveform->m_scene->update();
@@ -780,10 +959,10 @@ qint64 FTSound::readData(char *data, qint64 askedlen)
     unsigned char *ptr = reinterpret_cast<unsigned char *>(data);
     int delayedstart = m_start-m_giWavForWaveform->delay();
     if(delayedstart<0) delayedstart=0;
-    if(delayedstart>int(wavtoplay->size()-1)) delayedstart=int(wavtoplay->size())-1;
+    if(delayedstart>int(wav.size()-1)) delayedstart=int(wav.size())-1;
     int delayedend = m_end-m_giWavForWaveform->delay();
     if(delayedend<0) delayedend=0;
-    if(delayedend>int(wavtoplay->size()-1)) delayedend=int(wavtoplay->size())-1;
+    if(delayedend>int(wav.size()-1)) delayedend=int(wav.size())-1;
 
     // Polarity apparently matters in very particular cases
     // so take it into account when playing.
@@ -796,16 +975,17 @@ qint64 FTSound::readData(char *data, qint64 askedlen)
         qint16 value = 0;
 
         if(s_playwin_use && (m_avoidclickswinpos<qint64(s_avoidclickswindow.size()-1)/2)) {
-            value = qint16((gain*(*wavtoplay)[delayedstart]*s_avoidclickswindow[m_avoidclickswinpos++])*32767);
+            value = qint16((gain*playSample(delayedstart)*s_avoidclickswindow[m_avoidclickswinpos++])*32767);
         }
         else if(s_playwin_use && (m_pos>m_end) && m_avoidclickswinpos<qint64(s_avoidclickswindow.size()-1)) {
-            value = qint16((gain*(*wavtoplay)[delayedend]*s_avoidclickswindow[1+m_avoidclickswinpos++])*32767);
+            value = qint16((gain*playSample(delayedend)*s_avoidclickswindow[1+m_avoidclickswinpos++])*32767);
         }
         else if (m_pos<=m_end) {
             int delayedpos = m_pos - m_giWavForWaveform->delay();
-            if(delayedpos>=0 && delayedpos<int(wavtoplay->size())){
+            if(delayedpos>=0 && delayedpos<int(wav.size())){
         //        WAVTYPE e = samples[m_pos]*samples[m_pos];
-                WAVTYPE e = abs(gain*(*wavtoplay)[delayedpos]);
+                WAVTYPE w = gain*playSample(delayedpos);
+                WAVTYPE e = abs(w);
 //                s_play_power += e;
                 s_play_power_values.push_front(e);
                 while(s_play_power_values.size()/fs>1.0){ // Has to correspond to the delay between readData calls
@@ -817,8 +997,6 @@ qint64 FTSound::readData(char *data, qint64 askedlen)
 
                 // Assuming the output audio device has been open in 16bits ...
                 // TODO Manage more output formats
-                WAVTYPE w = gain*(*wavtoplay)[delayedpos];
-
                 if(w>1.0)       w = 1.0;
                 else if(w<-1.0) w = -1.0;
 
@@ -863,23 +1041,26 @@ qint64 FTSound::writeData(const char *data, qint64 askedlen){
 FTSound::~FTSound(){
     if(gFL->m_prevSelectedSound==this)
         gFL->m_prevSelectedSound = NULL;
+    if(gMW->m_lastFilteredSound==this)
+        gMW->m_lastFilteredSound = NULL;
 
     stopPlay();
+    cancelLoading();
     if(gMW->m_gvSpectrogram)
         gMW->m_gvSpectrogram->m_stftcomputethread->cancelComputation(this, true);
+    if(gMW->m_gvWaveform)
+        gMW->m_gvWaveform->m_filtercomputethread->cancelComputation(this);
     QIODevice::close();
 
     delete m_giWavForWaveform;
+    delete m_giFilteredWavForWaveform;
     delete m_giWavForSpectrumAmplitude;
     delete m_giWavForSpectrumPhase;
     delete m_giWavForSpectrumGroupDelay;
 
     gFL->ftsnds.erase(std::find(gFL->ftsnds.begin(), gFL->ftsnds.end(), this));
 
-    if(m_stftpa){
-        delete m_stftpa;
-        m_stftpa = NULL;
-    }
+    deleteSTFT();
 
     delete m_actionResetFiltering;
     delete m_actionResetDelay;
@@ -30,9 +30,12 @@ file provided in the source code of DFasma. Another copy can be found at
 #include <QAudioFormat>
 #include <QAction>
 #include <QGraphicsItem>
+#include <QAtomicInt>
 
 #include "filetype.h"
 #include "stftcomputethread.h"
+#include "stftimagetiles.h"
+#include "playbackfilter.h"
 
 #include "qaegiuniformlysampledsignal.h"
 
@@ -46,6 +49,7 @@ file provided in the source code of DFasma. Another copy can be found at
 
 #include "stftcomputethread.h"
 
+class QFile;
 class GIWaveform;
 class GISpectrumAmplitude;
 
@@ -56,8 +60,10 @@ class FTSound : public QIODevice, public FileType
 private:
     void constructor_internal();
     void constructor_external();
+    FTSound(const QString& _fileName, QObject* parent, int channelid, bool); // Without loading, see createChannels(.)
 
     void load(int channelid=1);       // Implementation depends on the used file library (sox, lisndfile, ...)
+    static void load(const std::vector<FTSound*>& snds); // Load the sounds' channels (m_channelid) of the same file, reading it once if possible
     void load_finalize();             // Independent of the used file lib.
 
     QAudioFormat m_fileaudioformat;   // Format of the audio data
@@ -69,8 +75,22 @@ private:
     QAudioFormat m_outputaudioformat; // Temporary copy for readData
     bool m_isfiltered;
     bool m_isplaying;
+    PlaybackFilter m_playfilter;    // Filters the played samples on the fly
+    // The sample to play (filtered by blocks, if the playback is filtered)
+    inline WAVTYPE playSample(qint64 n) {return m_isfiltered?m_playfilter.at(wav, n):wav[n];}
+
+    bool m_loading;
 
 public:
+    // Loading in background (depends on the used file library, see load())
+    // wav has already its final size while loading.
+    QAtomicInt m_loading_running;   // Set to 0 by the loader when it doesn't access this sound anymore
+    QAtomicInt m_loading_canceled;
+    QAtomicInt m_loading_progress;  // [%]
+    qint64 m_loading_nbread;        // [samples] Actually read by the loader
+    inline bool isLoading() const {return m_loading;}
+    void cancelLoading();
+
     static QString getAudioFileReadingDescription();
     static QStringList getAudioFileReadingSupportedFormats();
     static int getNumberOfChannels(const QString& filePath);
@@ -78,14 +98,28 @@ public:
 
     FTSound(const QString& _fileName, QObject* parent, int channelid=1);
     FTSound(const FTSound& ft);
+    // Create one sound per channel ID (as in the constructor) from a single reading of the file
+    static std::vector<FTSound*> createChannels(const QString& _fileName, QObject* parent, const std::vector<int>& channelids);
     virtual FileType* duplicate();
 
     double fs; // [Hz] Sampling frequency of this specific wav file
     std::vector<WAVTYPE> wav;
-    std::vector<WAVTYPE> wavfiltered;
-    std::vector<WAVTYPE>* wavtoplay;
-    WAVTYPE m_filteredmaxamp;
+    std::vector<WAVTYPE> wavfiltered;   // For the views, the filtered samples of [m_filteredbegin,m_filteredend[ only
+    qint64 m_filteredbegin; // [sample index]
+    qint64 m_filteredend;   // [sample index]
+    int m_filteredgeneration;   // Changes with the filter, to drop the outdated filterings
+    WAVTYPE m_filteredmaxamp;   // Among the samples filtered so far
+    qint64 m_filteredselbegin;  // [sample index] The filtered selection [m_filteredselbegin,m_filteredselend[,
+    qint64 m_filteredselend;    //                only its visible part is filtered for the views
+    qint64 m_filteredreqbegin;  // [sample index] The segment being filtered in the background
+    qint64 m_filteredreqend;
+    void requestFiltering(); // Filter the visible part of the selection for the views, if not done yet
+    // The samples shown in the views: wav, overlaid by wavfiltered if filtered
+    inline WAVTYPE viewSample(qint64 n) const {return (m_isfiltered && n>=m_filteredbegin && n<m_filteredend)?wavfiltered[n-m_filteredbegin]:wav[n];}
+    inline std::vector<WAVTYPE>* viewSignal() {return m_isfiltered?&wavfiltered:&wav;} // Identifies the shown samples (e.g. for the DFTs)
     QAEGIUniformlySampledSignal* m_giWavForWaveform;
+    QAEGIUniformlySampledSignal* m_giFilteredWavForWaveform; // Drawn over m_giWavForWaveform
+    void updateFilteredWaveform(bool samplesChanged=false); // Follow the gain and delay of m_giWavForWaveform
 
     // Spectra
     class DFTParameters{
@@ -145,13 +179,17 @@ public:
     // Spectrogram
 //    std::vector<std::vector<WAVTYPE> > m_stft;
     WAVTYPE* m_stftpa;
+    QFile* m_stftfile;  // If not NULL, m_stftpa is mapped from this file of the STFT cache
+    QByteArray m_wavhash; // Hash of the samples, to find the STFT in the cache
+    void deleteSTFT();  // Free m_stftpa, whether it is allocated or mapped
+    std::vector<std::vector<WAVTYPE> > m_stftpyramid; // Max-pooled over time by 2, 4, 8, ... frames
     std::vector<FFTTYPE> m_stftts;
     STFTComputeThread::STFTParameters m_stftparams;
     FFTTYPE m_stft_min;
     FFTTYPE m_stft_max;
-    QImage m_imgSTFT;
+    STFTImageTiles m_stfttiles;
     STFTComputeThread::ImageParameters m_imgSTFTParams; // This is the target parameters for the image
-                                                        // During STFT update, it doesn't correspond to m_imgSTFT
+                                                        // During STFT update, it doesn't correspond to m_stfttiles
 
 
     // Play (from QIODevice)
@@ -201,6 +239,14 @@ public:
 
     ~FTSound();
 
+signals:
+    void loadingProgressed();
+    void loadingFinished();
+
+private slots:
+    void updateLoadingProgress();
+    void finalizeLoading();
+
 public slots:
     bool reload();
     void needDFTUpdate();
@@ -22,6 +22,7 @@ file provided in the source code of DFasma. Another copy can be found at
 #include "gvspectrogramwdialogsettings.h"
 #include "ui_gvspectrogramwdialogsettings.h"
 #include "stftcomputethread.h"
+#include "stftcache.h"
 
 #include "wmainwindow.h"
 #include "ui_wmainwindow.h"
@@ -229,6 +230,7 @@ GVSpectrogram::GVSpectrogram(WMainWindow* parent)
 
     connect(m_stftcomputethread, SIGNAL(stftComputingStateChanged(int)), this, SLOT(stftComputingStateChanged(int)));
     connect(m_stftcomputethread, SIGNAL(stftProgressing(int)), gMW->ui->pgbSpectrogramSTFTCompute, SLOT(setValue(int)));
+    connect(m_stftcomputethread, SIGNAL(stftTileRendered()), m_scene, SLOT(update()));
 
     // Fill the toolbar
     m_toolBar = new QToolBar(this);
@@ -332,6 +334,9 @@ void GVSpectrogram::updateSTFTSettings(){
 
     gMW->ui->pbSpectrogramSTFTUpdate->hide();
     m_dlgSettings->checkImageSize();
+    STFTImageTiles::setMemoryLimit(qint64(m_dlgSettings->ui->sbSpectrogramImageCacheLimit->value())*1024*1024);
+    STFTCache::setDirectory(m_dlgSettings->ui->gbSpectrogramCache->isChecked()?m_dlgSettings->ui->leSpectrogramCacheDir->text():QString());
+    STFTCache::setSizeLimit(qint64(m_dlgSettings->ui->sbSpectrogramCacheLimit->value())*1024*1024);
 
     int winlen = std::floor(0.5+gFL->getFs()*m_dlgSettings->ui->sbSpectrogramWindowSize->value());
 
@@ -339,40 +344,11 @@ void GVSpectrogram::updateSTFTSettings(){
         winlen++;
 
     // Create the window
+    // (normalized to sum=1)
     int wintype = m_dlgSettings->ui->cbSpectrogramWindowType->currentIndex();
-    if(wintype==0)
-        m_win = qae::rectangular(winlen);
-    else if(wintype==1)
-        m_win = qae::hamming(winlen);
-    else if(wintype==2)
-        m_win = qae::hann(winlen);
-    else if(wintype==3)
-        m_win = qae::blackman(winlen);
-    else if(wintype==4)
-        m_win = qae::blackmannutall(winlen);
-    else if(wintype==5)
-        m_win = qae::blackmanharris(winlen);
-    else if(wintype==6)
-        m_win = qae::nutall(winlen);
-    else if(wintype==7)
-        m_win = qae::flattop(winlen);
-    else if(wintype==8)
-        m_win = qae::normwindow(winlen, m_dlgSettings->ui->spSpectrogramWindowNormSigma->value());
-    else if(wintype==9)
-        m_win = qae::expwindow(winlen, m_dlgSettings->ui->spSpectrogramWindowExpDecay->value());
-    else if(wintype==10)
-        m_win = qae::gennormwindow(winlen, m_dlgSettings->ui->spSpectrogramWindowNormSigma->value(), m_dlgSettings->ui->spSpectrogramWindowNormPower->value());
-    else
-        throw QString("No window selected");
-
-//    assert(m_win.size()==winlen);
-
-    // Normalize the window energy to sum=1
-    double winsum = 0.0;
-    for(size_t n=0; n<m_win.size(); ++n)
-        winsum += m_win[n];
-    for(size_t n=0; n<m_win.size(); ++n)
-        m_win[n] /= winsum;
+    m_win = WindowCache::get(wintype, winlen, WindowCache::WNSum, m_dlgSettings->ui->spSpectrogramWindowNormSigma->value(), m_dlgSettings->ui->spSpectrogramWindowExpDecay->value(), m_dlgSettings->ui->spSpectrogramWindowNormPower->value());
+
+//    assert(m_win->size()==winlen);
 
     updateSTFTPlot();
 
@@ -453,7 +429,7 @@ void GVSpectrogram::stftComputingStateChanged(int state){
         }
     }
     else if(state==STFTComputeThread::SCSMemoryFull){
-        m_giInfoTxtInCenter->setText("There is not enough free memory for computing this STFT.\nThe image itself is "+qae::humanReadableSize(m_dlgSettings->getLastImgSize())+"\nTry reducing the DFT size and/or increasing the time step size.");
+        m_giInfoTxtInCenter->setText("There is not enough free memory for computing this STFT.\nThe STFT itself is "+qae::humanReadableSize(m_dlgSettings->getLastSTFTSize())+"\nTry reducing the DFT size and/or increasing the time step size.");
         m_giInfoTxtInCenter->show();
     }
 //    COUTD << "GVSpectrogram::~stftComputingStateChanged" << endl;
@@ -475,6 +451,9 @@ void GVSpectrogram::updateSTFTPlot(bool force){
     if(!gMW->ui->actionShowSpectrogram->isChecked())
         return;
 
+    if(m_win.isNull())
+        return; // The STFT settings are not set yet
+
     // Fix limits between min and max sliders
     FTSound* csnd = gFL->getCurrentFTSound(true);
     if(csnd){
@@ -490,14 +469,21 @@ void GVSpectrogram::updateSTFTPlot(bool force){
             if(m_dlgSettings->ui->cbSpectrogramDFTSizeType->currentIndex()==0)
                 dftlen = m_dlgSettings->ui->sbSpectrogramDFTSize->value();
             else if(m_dlgSettings->ui->cbSpectrogramDFTSizeType->currentIndex()==1)
-                dftlen = std::pow(2.0, std::ceil(log2(float(m_win.size())))+m_dlgSettings->ui->sbSpectrogramOversamplingFactor->value());//[samples]
+                dftlen = std::pow(2.0, std::ceil(log2(float(m_win->size())))+m_dlgSettings->ui->sbSpectrogramOversamplingFactor->value());//[samples]
             int cepliftorder = -1;//[samples]
-            if(gMW->m_gvSpectrogram->m_dlgSettings->ui->gbSpectrogramCepstralLiftering->isChecked())
+            int cqtbinsperoctave = 0;
+            FFTTYPE cqtfmin = 0.0;
+            if(m_dlgSettings->ui->gbSpectrogramConstantQ->isChecked()){
+                cqtbinsperoctave = m_dlgSettings->ui->sbSpectrogramConstantQBinsPerOctave->value();
+                cqtfmin = m_dlgSettings->ui->sbSpectrogramConstantQMinFrequency->value();
+            }
+            bool reassigned = m_dlgSettings->ui->cbSpectrogramReassigned->isChecked() && cqtbinsperoctave==0;
+            if(gMW->m_gvSpectrogram->m_dlgSettings->ui->gbSpectrogramCepstralLiftering->isChecked() && !reassigned && cqtbinsperoctave==0)
                 cepliftorder = gMW->m_gvSpectrogram->m_dlgSettings->ui->sbSpectrogramCepstralLifteringOrder->value();
             bool cepliftpresdc = gMW->m_gvSpectrogram->m_dlgSettings->ui->cbSpectrogramCepstralLifteringPreserveDC->isChecked();
 
-            STFTComputeThread::STFTParameters reqSTFTParams(csnd, m_win, stepsize, dftlen, cepliftorder, cepliftpresdc);
-            STFTComputeThread::ImageParameters reqImgSTFTParams(reqSTFTParams, &(csnd->m_imgSTFT), m_dlgSettings->ui->cbSpectrogramColorMaps->currentIndex(), m_dlgSettings->ui->cbSpectrogramColorMapReversed->isChecked(), gMW->m_qxtSpectrogramSpanSlider->lowerValue()/100.0, gMW->m_qxtSpectrogramSpanSlider->upperValue()/100.0, m_dlgSettings->ui->cbSpectrogramLoudnessWeighting->isChecked(), m_dlgSettings->ui->cbSpectrogramColorRangeMode->currentIndex());
+            STFTComputeThread::STFTParameters reqSTFTParams(csnd, *m_win, stepsize, dftlen, cepliftorder, cepliftpresdc, reassigned, cqtbinsperoctave, cqtfmin);
+            STFTComputeThread::ImageParameters reqImgSTFTParams(reqSTFTParams, m_dlgSettings->ui->cbSpectrogramColorMaps->currentIndex(), m_dlgSettings->ui->cbSpectrogramColorMapReversed->isChecked(), gMW->m_qxtSpectrogramSpanSlider->lowerValue()/100.0, gMW->m_qxtSpectrogramSpanSlider->upperValue()/100.0, m_dlgSettings->ui->cbSpectrogramLoudnessWeighting->isChecked(), m_dlgSettings->ui->cbSpectrogramColorRangeMode->currentIndex(), m_dlgSettings->ui->cbSpectrogramIndexedColors->isChecked());
 
             if(csnd->m_imgSTFTParams.isEmpty() || reqImgSTFTParams!=csnd->m_imgSTFTParams) {
                 gMW->ui->pbSpectrogramSTFTUpdate->hide();
@@ -1295,63 +1281,91 @@ void GVSpectrogram::drawBackground(QPainter* painter, const QRectF& rect){
 //    cout << "GVSpectrogram::~drawBackground" << endl;
 }
 
+// The tiles' images are transposed (one scanline per column)
+static void draw_tile(QPainter* painter, const QRectF& rect, const QImage& img){
+    painter->save();
+    painter->setTransform(QTransform(0, 1, 1, 0, 0, 0), true); // Swap x and y
+    painter->drawImage(QRectF(rect.top(), rect.left(), rect.height(), rect.width()), img);
+    painter->restore();
+}
+
 void GVSpectrogram::draw_spectrogram(QPainter* painter, const QRectF& rect, const QRectF& viewrect, FTSound* snd){
     Q_UNUSED(rect)
 
-    gMW->m_gvSpectrogram->m_stftcomputethread->m_mutex_changingstft.lock();
     if(snd==NULL
-      || !snd->m_actionShow->isChecked()
-      || snd->m_imgSTFT.isNull()
-      || snd->m_stftts.empty()) // First need to be computed
-    {
-        gMW->m_gvSpectrogram->m_stftcomputethread->m_mutex_changingstft.unlock();
+      || !snd->m_actionShow->isChecked())
+        return;
+
+    STFTImageTiles::Setup setup = snd->m_stfttiles.getSetup();
+    if(setup.isEmpty()) // First need to be computed
         return;
+
+    // Choose the zoom levels so that there is at least one frame (and bin) per pixel of the view
+    // (in time, this is also the level of the STFT pyramid used for rendering the tiles)
+    double framesperpixel = viewrect.width()/setup.dt/std::max(1, viewport()->width());
+    int tlevel = 0;
+    while(tlevel+1<setup.nbLevelsTime() && double(2<<tlevel)<=framesperpixel)
+        tlevel++;
+    double binsperpixel = viewrect.height()/setup.binhz/std::max(1, viewport()->height());
+    int flevel = 0;
+    while(flevel+1<setup.nbLevelsFreq() && double(2<<flevel)<=binsperpixel)
+        flevel++;
+
+    // Find the visible tiles
+    int nbtilestime = setup.nbTilesTime(tlevel);
+    int nbtilesfreq = setup.nbTilesFreq(flevel);
+    double tilewidth = double(STFTTILESIZE<<tlevel); // [frames]
+    double tileheight = double(STFTTILESIZE<<flevel); // [bins]
+    int tibegin = int(std::floor(((viewrect.left()-setup.t0)/setup.dt+0.5)/tilewidth));
+    int tiend = int(std::floor(((viewrect.right()-setup.t0)/setup.dt+0.5)/tilewidth));
+    int fibegin = int(std::floor(((viewrect.top()+(setup.dftsize-1)*setup.binhz)/setup.binhz+0.5)/tileheight));
+    int fiend = int(std::floor(((viewrect.bottom()+(setup.dftsize-1)*setup.binhz)/setup.binhz+0.5)/tileheight));
+    tibegin = std::max(0, tibegin);
+    tiend = std::min(nbtilestime-1, tiend);
+    fibegin = std::max(0, fibegin);
+    fiend = std::min(nbtilesfreq-1, fiend);
+
+    for(int ti=tibegin; ti<=tiend; ++ti){
+        for(int fi=fibegin; fi<=fiend; ++fi){
+            STFTImageTiles::Key key(tlevel, flevel, ti, fi);
+            QImage img;
+            if(snd->m_stfttiles.get(key, img)){
+                draw_tile(painter, setup.tileRect(key), img);
+            }
+            else {
+                m_stftcomputethread->renderTile(snd, tlevel, flevel, ti, fi, 1);
+
+                // While waiting for it, draw the tile with the previous colors, if any
+                if(snd->m_stfttiles.getStale(key, img)){
+                    draw_tile(painter, setup.tileRect(key), img);
+                    continue;
+                }
+
+                // Otherwise, a coarser tile, if any
+                STFTImageTiles::Key coarse = key;
+                while(coarse.tlevel+1<setup.nbLevelsTime() || coarse.flevel+1<setup.nbLevelsFreq()){
+                    coarse.tlevel = std::min(coarse.tlevel+1, setup.nbLevelsTime()-1);
+                    coarse.flevel = std::min(coarse.flevel+1, setup.nbLevelsFreq()-1);
+                    coarse.ti = ti>>(coarse.tlevel-tlevel);
+                    coarse.fi = fi>>(coarse.flevel-flevel);
+                    if(snd->m_stfttiles.get(coarse, img)){
+                        painter->save();
+                        painter->setClipRect(setup.tileRect(key), Qt::IntersectClip);
+                        draw_tile(painter, setup.tileRect(coarse), img);
+                        painter->restore();
+                        break;
+                    }
+                }
+            }
+        }
     }
 
-    double stftwidth = snd->m_stftts.back()-snd->m_stftts.front();
-
-    QRect imgrect = snd->m_imgSTFT.rect();
-
-//    DCOUT << imgrect.width() << ":" << imgrect.height() << std::endl;
-//    QRectF fullviewrect = mapToScene(viewport()->rect()).boundingRect();
-//    DCOUT << "Full view: " << fullviewrect << std::endl;
-
-    // Build the piece of STFT which will be drawn in the view
-    QRectF srcrect;
-    srcrect.setLeft(0.5+(imgrect.width()-1)*(viewrect.left()-snd->m_stftts.front())/stftwidth);
-    srcrect.setRight(0.5+(imgrect.width()-1)*(viewrect.right()-snd->m_stftts.front())/stftwidth);
-//        COUTD << "viewrect=" << viewrect << endl;
-//        COUTD << "IMG: " << m_imgSTFT.rect() << endl;
-    // This one is vertically super sync,
-    // but the cursor falls always on the top of the line, not in the middle of it.
-//        srcrect.setTop((m_imgSTFT.rect().height()-1)*viewrect.top()/m_scene->sceneRect().height());
-//        srcrect.setBottom((m_imgSTFT.rect().height()-1)*viewrect.bottom()/m_scene->sceneRect().height());
-    srcrect.setTop((imgrect.height()-1)*-(m_scene->sceneRect().top()-viewrect.top())/m_scene->sceneRect().height());
-    srcrect.setBottom((imgrect.height()-1)*-(m_scene->sceneRect().top()-viewrect.bottom())/m_scene->sceneRect().height());
-    srcrect.setTop(srcrect.top()+0.5);
-    srcrect.setBottom(srcrect.bottom()+0.5);
-    QRectF trgrect = viewrect;
-
-    // This one is the basic synchronized version,
-    // but it creates flickering when zooming
-    //    double fs = gFL->getFs();
-    //    QRectF srcrect = imgrect;
-    //    QRectF trgrect = m_scene->sceneRect();
-    //    trgrect.setLeft(snd->m_stftts.front()-0.5*snd->m_stftparams.stepsize/fs);
-    //    trgrect.setRight(snd->m_stftts.back()+0.5*snd->m_stftparams.stepsize/fs);
-    //    double bin2hz = fs*1/snd->m_stftparams.dftlen;
-    //    DCOUT << bin2hz << std::endl;
-    //    trgrect.setTop(-fs/2-bin2hz/2);// Hard to verify because of the flickering
-    //    trgrect.setBottom(+bin2hz/2);// Hard to verify because of the flickering
-
-    //    DCOUT << "Src: " << srcrect << std::endl;
-    //    DCOUT << "Trg: " << trgrect << std::endl;
-
-    gMW->m_gvSpectrogram->m_stftcomputethread->m_mutex_changingstft.unlock();
-
-    if(m_stftcomputethread->m_mutex_imageallocation.tryLock()) {
-        painter->drawImage(trgrect, snd->m_imgSTFT, srcrect);
-        m_stftcomputethread->m_mutex_imageallocation.unlock();
+    // Prepare the neighbor tiles, in case of scrolling
+    for(int fi=fibegin; fi<=fiend; ++fi){
+        if(tibegin>0)
+            m_stftcomputethread->renderTile(snd, tlevel, flevel, tibegin-1, fi);
+        if(tiend+1<nbtilestime)
+            m_stftcomputethread->renderTile(snd, tlevel, flevel, tiend+1, fi);
     }
 }
 
@@ -35,6 +35,7 @@ class QTime;
 
 #include "wmainwindow.h"
 #include "ftsound.h"
+#include "windowcache.h"
 
 class GVSpectrogramWDialogSettings;
 class MainWindow;
@@ -66,7 +67,7 @@ public:
 
     STFTComputeThread* m_stftcomputethread;
 
-    std::vector<FFTTYPE> m_win;
+    WindowCache::Window m_win;
 
     // Cursor
     QGraphicsLineItem* m_giMouseCursorLineTimeBack;
@@ -22,6 +22,9 @@ file provided in the source code of DFasma. Another copy can be found at
 #include "ui_gvspectrogramwdialogsettings.h"
 
 #include <QSettings>
+#include <QDir>
+#include <QFileDialog>
+#include <QStandardPaths>
 
 #include "gvspectrogram.h"
 
@@ -31,7 +34,7 @@ file provided in the source code of DFasma. Another copy can be found at
 
 GVSpectrogramWDialogSettings::GVSpectrogramWDialogSettings(GVSpectrogram *parent)
     : QDialog((QWidget*)parent)
-    , m_lastimgsize(-1)
+    , m_laststftsize(-1)
     , ui(new Ui::GVSpectrogramWDialogSettings)
 {
     ui->setupUi(this);
@@ -68,6 +71,16 @@ GVSpectrogramWDialogSettings::GVSpectrogramWDialogSettings(GVSpectrogram *parent
     connect(ui->sbSpectrogramDFTSize, SIGNAL(valueChanged(int)), this, SLOT(DFTSizeChanged(int)));
     connect(ui->sbSpectrogramOversamplingFactor, SIGNAL(valueChanged(int)), this, SLOT(DFTSizeChanged(int)));
 
+    gMW->m_settings.add(ui->cbSpectrogramReassigned);
+    gMW->m_settings.add(ui->gbSpectrogramConstantQ);
+    gMW->m_settings.add(ui->sbSpectrogramConstantQBinsPerOctave);
+    gMW->m_settings.add(ui->sbSpectrogramConstantQMinFrequency);
+    connect(ui->cbSpectrogramReassigned, SIGNAL(toggled(bool)), this, SLOT(STFTModeChanged()));
+    connect(ui->gbSpectrogramConstantQ, SIGNAL(toggled(bool)), this, SLOT(STFTModeChanged()));
+    connect(ui->gbSpectrogramConstantQ, SIGNAL(toggled(bool)), this, SLOT(checkImageSize()));
+    connect(ui->sbSpectrogramConstantQBinsPerOctave, SIGNAL(valueChanged(int)), this, SLOT(checkImageSize()));
+    connect(ui->sbSpectrogramConstantQMinFrequency, SIGNAL(valueChanged(double)), this, SLOT(checkImageSize()));
+    STFTModeChanged();
     gMW->m_settings.add(ui->gbSpectrogramCepstralLiftering);
     gMW->m_settings.add(ui->sbSpectrogramCepstralLifteringOrder);
     gMW->m_settings.add(ui->cbSpectrogramCepstralLifteringPreserveDC);
@@ -78,6 +91,11 @@ GVSpectrogramWDialogSettings::GVSpectrogramWDialogSettings(GVSpectrogram *parent
     gMW->m_settings.add(ui->cbSpectrogramColorMaps);
     gMW->m_settings.add(ui->cbSpectrogramColorMapReversed);
     gMW->m_settings.add(ui->cbSpectrogramLoudnessWeighting);
+    gMW->m_settings.add(ui->cbSpectrogramIndexedColors);
+    gMW->m_settings.add(ui->sbSpectrogramImageCacheLimit);
+    gMW->m_settings.add(ui->gbSpectrogramCache);
+    gMW->m_settings.add(ui->sbSpectrogramCacheLimit);
+    ui->leSpectrogramCacheDir->setText(gMW->m_settings.value("leSpectrogramCacheDir", QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"stft").toString());
 
     gMW->m_settings.add(ui->cbSpectrogramColorRangeMode);
     colorRangeModeCurrentIndexChanged(ui->cbSpectrogramColorRangeMode->currentIndex());
@@ -89,6 +107,17 @@ GVSpectrogramWDialogSettings::GVSpectrogramWDialogSettings(GVSpectrogram *parent
 
     connect(ui->cbSpectrogramWindowType, SIGNAL(currentIndexChanged(QString)), this, SLOT(windowTypeCurrentIndexChanged(QString)));
     connect(ui->cbSpectrogramColorRangeMode, SIGNAL(currentIndexChanged(int)), this, SLOT(colorRangeModeCurrentIndexChanged(int)));
+    connect(ui->btnSpectrogramCacheDirBrowse, SIGNAL(clicked()), this, SLOT(cacheDirBrowse()));
+}
+
+void GVSpectrogramWDialogSettings::settingsSave() {
+    gMW->m_settings.setValue("leSpectrogramCacheDir", ui->leSpectrogramCacheDir->text());
+}
+
+void GVSpectrogramWDialogSettings::cacheDirBrowse() {
+    QString dir = QFileDialog::getExistingDirectory(this, "Choose the STFT cache directory", ui->leSpectrogramCacheDir->text());
+    if(!dir.isEmpty())
+        ui->leSpectrogramCacheDir->setText(dir);
 }
 
 void GVSpectrogramWDialogSettings::checkImageSize(){
@@ -109,21 +138,28 @@ void GVSpectrogramWDialogSettings::checkImageSize(){
     ui->sbSpectrogramWindowSize->setToolTip(QString("Actual value is %2s (%1 samples)").arg(winlen).arg(double(winlen)/gFL->getFs()));
     ui->sbSpectrogramStepSize->setToolTip(QString("Actual value is  %2s (%1 samples)").arg(stepsize).arg(double(stepsize)/gFL->getFs()));
 
-    int imgheight = dftlen/2+1;
-    int imgwidth = int(1+double(maxsampleindex+1)/stepsize); // TODO Review this formula
+    int stftheight = dftlen/2+1;
+    if(ui->gbSpectrogramConstantQ->isChecked())
+        stftheight = STFTComputeThread::STFTParameters::cqtNbOctaves(gFL->getFs(), ui->sbSpectrogramConstantQMinFrequency->value())*ui->sbSpectrogramConstantQBinsPerOctave->value();
+    int stftwidth = int(1+double(maxsampleindex+1)/stepsize); // TODO Review this formula
 
-    m_lastimgsize = double(imgwidth)*imgheight*sizeof(QImage::Format_ARGB32);
+    // The image is drawn by tiles, only the STFT itself has to fit in memory
+    m_laststftsize = double(stftwidth)*stftheight*sizeof(WAVTYPE);
 
     QString text = "<html><head/><body>";
-    text += QString("Image size: %1x%2 = %3").arg(imgwidth).arg(imgheight).arg(qae::humanReadableSize(m_lastimgsize));
+    text += QString("STFT size: %1x%2 = %3").arg(stftwidth).arg(stftheight).arg(qae::humanReadableSize(m_laststftsize));
 
-    if(imgwidth>32768 || imgheight>32768){
-        text += "<br/><font color=\"red\">Image dimensions need to be smaller than 32768.<br/>You can: increase step size, reduce window length, reduce oversampling factor,<br/>or try it! (visual artefacts expected)</font>";
-    }
     text += "</body></html>";
     ui->lblImgSizeWarning->setText(text);
 }
 
+// The constant-Q transform excludes the reassignment, and both exclude the liftering
+void GVSpectrogramWDialogSettings::STFTModeChanged(){
+    bool cqt = ui->gbSpectrogramConstantQ->isChecked();
+    ui->cbSpectrogramReassigned->setDisabled(cqt);
+    ui->gbSpectrogramCepstralLiftering->setDisabled(cqt || ui->cbSpectrogramReassigned->isChecked());
+}
+
 void GVSpectrogramWDialogSettings::colorRangeModeCurrentIndexChanged(int index){
     if(index==0){
         // Relative %
@@ -35,7 +35,7 @@ class GVSpectrogramWDialogSettings : public QDialog
 {
     Q_OBJECT
 
-    long int m_lastimgsize;
+    long int m_laststftsize;
 
     GVSpectrogram* m_spectrogram;
 
@@ -51,13 +51,15 @@ public:
 
     void settingsSave();
 
-    long int getLastImgSize() const {return m_lastimgsize;}
+    long int getLastSTFTSize() const {return m_laststftsize;}
 
 private:
 
 private slots:
     void windowTypeCurrentIndexChanged(QString txt);
     void colorRangeModeCurrentIndexChanged(int index);
+    void cacheDirBrowse();
+    void STFTModeChanged();
 
 public slots:
     void checkImageSize();
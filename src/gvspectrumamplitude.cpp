@@ -35,6 +35,7 @@ file provided in the source code of DFasma. Another copy can be found at
 #include "gvspectrogram.h"
 #include "ftsound.h"
 #include "ftfzero.h"
+#include "fftplanpool.h"
 
 #include <iostream>
 #include <algorithm>
@@ -52,6 +53,8 @@ using namespace std;
 #include <QMessageBox>
 #include <QScrollBar>
 #include <QToolTip>
+#include <QStandardPaths>
+#include <QDir>
 
 #include "qaesigproc.h"
 #include "qaehelpers.h"
@@ -136,9 +139,11 @@ GVSpectrumAmplitude::GVSpectrumAmplitude(WMainWindow* parent)
     m_aFollowPlayCursor->setChecked(false);
     gMW->m_settings.add(m_aFollowPlayCursor);
 
-    m_fft = new qae::FFTwrapper();
     qae::FFTwrapper::setTimeLimitForPlanPreparation(m_dlgSettings->ui->sbAmplitudeSpectrumFFTW3MaxTimeForPlanPreparation->value());
-    m_fftresizethread = new FFTResizeThread(m_fft, this);
+    if(m_dlgSettings->ui->cbAmplitudeSpectrumFFTW3KeepWisdom->isChecked())
+        FFTPlanPool::loadWisdom(wisdomFilePath());
+    m_fftresizethread = new FFTResizeThread(this);
+    m_dftcomputethread = new DFTComputeThread(this);
 
     // Cursor
     m_giCursorHoriz = new QGraphicsLineItem(0, -1000, 0, 1000);
@@ -243,6 +248,7 @@ GVSpectrumAmplitude::GVSpectrumAmplitude(WMainWindow* parent)
 
     connect(m_fftresizethread, SIGNAL(fftResized(int,int)), this, SLOT(updateDFTs()));
     connect(m_fftresizethread, SIGNAL(fftResizing(int,int)), this, SLOT(fftResizing(int,int)));
+    connect(m_dftcomputethread, SIGNAL(dftsComputed()), this, SLOT(dftsComputed()));
 
     // Fill the toolbar
     m_toolBar = new QToolBar(this);
@@ -341,6 +347,10 @@ void GVSpectrumAmplitude::updateSceneRect() {
     m_giSpectrogramMin->setLine(QLineF(0, 0, gFL->getFs()/2.0, 0));
 }
 
+QString GVSpectrumAmplitude::wisdomFilePath() {
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"fftw.wisdom";
+}
+
 void GVSpectrumAmplitude::fftResizing(int prevSize, int newSize){
     Q_UNUSED(prevSize);
 
@@ -403,46 +413,9 @@ void GVSpectrumAmplitude::setWindowRange(qreal tstart, qreal tend){
        || m_trgDFTParameters.normtype!=newDFTParams.normtype
        || wintype>7){
 
-        if(wintype==0)
-            m_win = qae::rectangular(newDFTParams.winlen);
-        else if(wintype==1)
-            m_win = qae::hamming(newDFTParams.winlen);
-        else if(wintype==2)
-            m_win = qae::hann(newDFTParams.winlen);
-        else if(wintype==3)
-            m_win = qae::blackman(newDFTParams.winlen);
-        else if(wintype==4)
-            m_win = qae::blackmannutall(newDFTParams.winlen);
-        else if(wintype==5)
-            m_win = qae::blackmanharris(newDFTParams.winlen);
-        else if(wintype==6)
-            m_win = qae::nutall(newDFTParams.winlen);
-        else if(wintype==7)
-            m_win = qae::flattop(newDFTParams.winlen);
-        else if(wintype==8)
-            m_win = qae::normwindow(newDFTParams.winlen, m_dlgSettings->ui->spAmplitudeSpectrumWindowNormSigma->value());
-        else if(wintype==9)
-            m_win = qae::expwindow(newDFTParams.winlen, m_dlgSettings->ui->spAmplitudeSpectrumWindowExpDecay->value());
-        else if(wintype==10)
-            m_win = qae::gennormwindow(newDFTParams.winlen, m_dlgSettings->ui->spAmplitudeSpectrumWindowNormSigma->value(), m_dlgSettings->ui->spAmplitudeSpectrumWindowNormPower->value());
-        else
-            throw QString("No window selected");
-
-        double winsum = 0.0;
-        if(normtype==0) {
-            // Normalize the window's sum to 1
-            for(int n=0; n<newDFTParams.winlen; n++)
-                winsum += m_win[n];
-        }
-        else if(normtype==1) {
-            // Normalize the window's energy to 1
-            for(int n=0; n<newDFTParams.winlen; n++)
-                winsum += m_win[n]*m_win[n];
-        }
-        for(int n=0; n<newDFTParams.winlen; n++)
-            m_win[n] /= winsum;
+        m_win = WindowCache::get(wintype, newDFTParams.winlen, normtype, m_dlgSettings->ui->spAmplitudeSpectrumWindowNormSigma->value(), m_dlgSettings->ui->spAmplitudeSpectrumWindowExpDecay->value(), m_dlgSettings->ui->spAmplitudeSpectrumWindowNormPower->value());
 
-        newDFTParams.win = m_win;
+        newDFTParams.win = *m_win;
     }
 
     // Set the DFT length
@@ -513,111 +486,61 @@ void GVSpectrumAmplitude::updateDFTs(){
     m_fftresizethread->resize(m_trgDFTParameters.dftlen);
 
     if(m_fftresizethread->m_mutex_resizing.tryLock()){
-        int dftlen = m_fft->size(); // Local copy of the actual dftlen
+        qae::FFTwrapper* fft = m_fftresizethread->fft();
+        int dftlen = fft->size(); // Local copy of the actual dftlen
 
         gMW->ui->pgbFFTResize->hide();
         gMW->ui->lblSpectrumInfoTxt->setText(QString("DFT size=%1").arg(dftlen));
 
-        std::vector<FFTTYPE>& win = m_trgDFTParameters.win; // For speeding up access
-
         bool didany = false;
+
+        // Find the DFTs which need to be updated
+        DFTComputeThread::Request req;
         for(unsigned int fi=0; fi<gFL->ftsnds.size(); fi++){
             FTSound* snd = gFL->ftsnds[fi];
             if(!snd->isVisible())
                 continue;
+            if(snd->isLoading())
+                continue; // It will be updated once the sound is loaded
 
             if(!snd->m_dftparams.isEmpty()
                && snd->m_dftparams==m_trgDFTParameters
-               && snd->m_dftparams.wav==snd->wavtoplay
+               && snd->m_dftparams.wav==snd->viewSignal()
                && snd->m_dftparams.ampscale==snd->m_giWavForWaveform->gain()
                && snd->m_dftparams.delay==snd->m_giWavForWaveform->delay())
                 continue;
 
-            WAVTYPE gain = snd->m_giWavForWaveform->gain();
+            req.results.push_back(DFTComputeThread::Result());
+            DFTComputeThread::Result& result = req.results.back();
+            result.snd = snd;
+            result.wav = snd->viewSignal();
+            result.ampscale = snd->m_giWavForWaveform->gain();
+            result.delay = snd->m_giWavForWaveform->delay();
 
-            int n = 0;
-            int wn = 0;
-            for(; n<m_trgDFTParameters.winlen; n++){
-                wn = m_trgDFTParameters.nl+n - snd->m_giWavForWaveform->delay();
+            // Copy the windowed samples, the rest is done in the background
+            result.frame.resize(m_trgDFTParameters.winlen);
+            for(int n=0; n<m_trgDFTParameters.winlen; n++){
+                int wn = m_trgDFTParameters.nl+n - result.delay;
 
-                if(wn>=0 && wn<int(snd->wavtoplay->size())) {
-                    WAVTYPE value = gain*(*(snd->wavtoplay))[wn];
+                if(wn>=0 && wn<int(snd->wav.size())) {
+                    WAVTYPE value = result.ampscale*snd->viewSample(wn);
 
                     if(value>1.0)       value = 1.0;
                     else if(value<-1.0) value = -1.0;
 
-                    m_fft->in[n] = value*win[n];
+                    result.frame[n] = value*m_trgDFTParameters.win[n];
                 }
                 else
-                    m_fft->in[n] = 0.0;
-            }
-            for(; n<dftlen; n++)
-                m_fft->in[n] = 0.0;
-
-            m_fft->execute(); // Compute the DFT
-
-            // Store first the complex values of the DFT
-            // (so that it can be used to compute the group delay)
-            std::vector<std::complex<WAVTYPE> > dft;
-            dft.resize(dftlen/2+1);
-            for(n=0; n<dftlen/2+1; n++)
-                dft[n] = m_fft->out[n];
-
-            snd->m_dftamp.resize(dftlen/2+1);
-            for(n=0; n<dftlen/2+1; n++)
-                snd->m_dftamp[n] = 20*std::log10(std::abs(m_fft->out[n]));
-            snd->m_giWavForSpectrumAmplitude->updateMinMaxValues();
-            snd->m_giWavForSpectrumAmplitude->setSamplingRate(1.0/double(gFL->getFs()/dftlen));
-            snd->m_giWavForSpectrumAmplitude->clearCache();
-
-            snd->m_dftphase.resize(dftlen/2+1);
-            double delay = (2.0*M_PI*(win.size()-1)/2.0)/dftlen;
-            for(n=0; n<dftlen/2+1; n++){
-                if(qIsInf(snd->m_dftamp[n]))
-                    snd->m_dftphase[n] = std::numeric_limits<WAVTYPE>::infinity();
-                else
-                    snd->m_dftphase[n] = qae::wrap(std::arg(m_fft->out[n])+delay*n);
-            }
-            snd->m_giWavForSpectrumPhase->updateMinMaxValues();
-            snd->m_giWavForSpectrumPhase->setSamplingRate(1.0/double(gFL->getFs()/dftlen));
-            snd->m_giWavForSpectrumPhase->clearCache();
-
-            // If the group delay is requested, update its data
-            if(gMW->ui->actionShowGroupDelaySpectrum->isChecked()){
-                // y = nx[n]
-                for(int n=0; n<m_trgDFTParameters.winlen; n++)
-                    m_fft->in[n] *= n;
-
-                m_fft->execute(); // Compute the DFT of y
-
-                // (Xr*Yr+Xi*Yi) / |X|^2
-                snd->m_dftgd.resize(dftlen/2+1);
-                WAVTYPE fs = gFL->getFs();
-                WAVTYPE delay = ((m_trgDFTParameters.winlen-1)/2)/fs;
-                for(int n=0; n<dftlen/2+1; n++) {
-                    if(qIsInf(snd->m_dftamp[n]))
-                        snd->m_dftgd[n] = std::numeric_limits<WAVTYPE>::infinity();
-                    else {
-                        WAVTYPE xp2 = std::real(dft[n])*std::real(dft[n]) + std::imag(dft[n])*std::imag(dft[n]);
-                        snd->m_dftgd[n] = (std::real(dft[n])*std::real(m_fft->out[n]) + std::imag(dft[n])*std::imag(m_fft->out[n]))/xp2;
-
-                        snd->m_dftgd[n] /= fs; // measure it in [second]
-
-                        snd->m_dftgd[n] -= delay; // Remove the window's delay
-                    }
-                }
-                snd->m_giWavForSpectrumGroupDelay->updateMinMaxValues();
-                snd->m_giWavForSpectrumGroupDelay->setSamplingRate(1.0/double(gFL->getFs()/dftlen));
-                snd->m_giWavForSpectrumGroupDelay->clearCache();
+                    result.frame[n] = 0.0;
             }
+        }
 
-            // Convert the spectrum values to log values
-            snd->m_dftparams = m_trgDFTParameters;
-            snd->m_dftparams.wav = snd->wavtoplay;
-            snd->m_dftparams.ampscale = snd->m_giWavForWaveform->gain();
-            snd->m_dftparams.delay = snd->m_giWavForWaveform->delay();
-
-            didany = true;
+        if(!req.isEmpty()){
+            req.params = m_trgDFTParameters;
+            req.dftlen = dftlen;
+            req.computegd = gMW->ui->actionShowGroupDelaySpectrum->isChecked();
+            req.fs = gFL->getFs();
+            m_dftcomputethread->compute(req); // Any older request still waiting is dropped
         }
 
         // Compute the window's DFT
@@ -625,15 +548,15 @@ void GVSpectrumAmplitude::updateDFTs(){
 
             int n = 0;
             for(; n<m_trgDFTParameters.winlen; n++)
-                m_fft->in[n] = m_trgDFTParameters.win[n];
+                fft->in[n] = m_trgDFTParameters.win[n];
             for(; n<dftlen; n++)
-                m_fft->in[n] = 0.0;
+                fft->in[n] = 0.0;
 
-            m_fft->execute();
+            fft->execute();
 
             m_windft.resize(dftlen/2+1);
             for(n=0; n<dftlen/2+1; n++)
-                m_windft[n] = qae::mag2db(m_fft->out[n]);
+                m_windft[n] = qae::mag2db(fft->out[n]);
             m_giWindow->updateMinMaxValues();
 
             m_giWindow->setSamplingRate(1.0/double(gFL->getFs()/dftlen));
@@ -657,6 +580,57 @@ void GVSpectrumAmplitude::updateDFTs(){
 //    COUTD << "~QGVAmplitudeSpectrum::updateDFTs" << endl;
 }
 
+void GVSpectrumAmplitude::dftsComputed(){
+    DFTComputeThread::Request req;
+    if(!m_dftcomputethread->takeResults(req))
+        return;
+
+    int dftlen = req.dftlen;
+    bool didany = false;
+    for(size_t ri=0; ri<req.results.size(); ++ri){
+        DFTComputeThread::Result& result = req.results[ri];
+
+        // The sound might have been closed or modified meanwhile
+        FTSound* snd = result.snd;
+        if(std::find(gFL->ftsnds.begin(), gFL->ftsnds.end(), snd)==gFL->ftsnds.end())
+            continue;
+        if(snd->viewSignal()!=result.wav)
+            continue;
+
+        snd->m_dftamp.swap(result.amp);
+        snd->m_giWavForSpectrumAmplitude->updateMinMaxValues();
+        snd->m_giWavForSpectrumAmplitude->setSamplingRate(1.0/double(req.fs/dftlen));
+        snd->m_giWavForSpectrumAmplitude->clearCache();
+
+        snd->m_dftphase.swap(result.phase);
+        snd->m_giWavForSpectrumPhase->updateMinMaxValues();
+        snd->m_giWavForSpectrumPhase->setSamplingRate(1.0/double(req.fs/dftlen));
+        snd->m_giWavForSpectrumPhase->clearCache();
+
+        if(req.computegd){
+            snd->m_dftgd.swap(result.gd);
+            snd->m_giWavForSpectrumGroupDelay->updateMinMaxValues();
+            snd->m_giWavForSpectrumGroupDelay->setSamplingRate(1.0/double(req.fs/dftlen));
+            snd->m_giWavForSpectrumGroupDelay->clearCache();
+        }
+
+        snd->m_dftparams = req.params;
+        snd->m_dftparams.wav = result.wav;
+        snd->m_dftparams.ampscale = result.ampscale;
+        snd->m_dftparams.delay = result.delay;
+
+        didany = true;
+    }
+
+    if(didany){
+        m_scene->update();
+        if(gMW->m_gvSpectrumPhase)
+            gMW->m_gvSpectrumPhase->m_scene->update();
+        if(gMW->m_gvSpectrumGroupDelay)
+            gMW->m_gvSpectrumGroupDelay->m_scene->update();
+    }
+}
+
 void GVSpectrumAmplitude::viewSet(QRectF viewrect, bool sync) {
 //    cout << "QGVAmplitudeSpectrum::viewSet" << endl;
 
@@ -1392,7 +1366,9 @@ GVSpectrumAmplitude::~GVSpectrumAmplitude(){
     m_fftresizethread->m_mutex_changingsizes.unlock();
     m_fftresizethread->wait();
     delete m_fftresizethread;
-    delete m_fft;
+    delete m_dftcomputethread;
+    if(m_dlgSettings->ui->cbAmplitudeSpectrumFFTW3KeepWisdom->isChecked())
+        FFTPlanPool::saveWisdom(wisdomFilePath());
     delete m_dlgSettings;
     delete m_toolBar;
 }
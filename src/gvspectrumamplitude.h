@@ -33,6 +33,8 @@ file provided in the source code of DFasma. Another copy can be found at
 
 #include "wmainwindow.h"
 #include "fftresizethread.h"
+#include "dftcomputethread.h"
+#include "windowcache.h"
 #include "ftsound.h"
 
 class GVAmplitudeSpectrumWDialogSettings;
@@ -45,7 +47,7 @@ class GVSpectrumAmplitude : public QGraphicsView
 
     QTime m_last_parameters_change;
 
-    std::vector<FFTTYPE> m_win; // Keep one here to limit allocations
+    WindowCache::Window m_win;
 
 protected:
     void contextMenuEvent(QContextMenuEvent * event);
@@ -53,10 +55,12 @@ protected:
 public:
     explicit GVSpectrumAmplitude(WMainWindow* parent);
 
+    static QString wisdomFilePath(); // Where the FFT plans' wisdom is kept across runs
+
     GVAmplitudeSpectrumWDialogSettings* m_dlgSettings;
 
-    qae::FFTwrapper* m_fft;
-    FFTResizeThread* m_fftresizethread;
+    FFTResizeThread* m_fftresizethread; // Its FFT is used for the window's DFT
+    DFTComputeThread* m_dftcomputethread; // For the sounds' DFTs
 
     QGraphicsScene* m_scene;
 
@@ -130,6 +134,7 @@ protected slots:
     void windowSetVisible(bool visible);
     void elcSetVisible(bool visible);
     void sqnrSetVisible(bool visible);
+    void dftsComputed();
 
 public slots:
     void updateScrollBars();
@@ -34,6 +34,7 @@ GVAmplitudeSpectrumWDialogSettings::GVAmplitudeSpectrumWDialogSettings(GVSpectru
 
     ui->lblAmplitudeSpectrumFFTW3MaxTimeForPlanPreparation->hide();
     ui->sbAmplitudeSpectrumFFTW3MaxTimeForPlanPreparation->hide();
+    ui->cbAmplitudeSpectrumFFTW3KeepWisdom->hide();
 
     m_ampspec = parent;
 
@@ -43,6 +44,10 @@ GVAmplitudeSpectrumWDialogSettings::GVAmplitudeSpectrumWDialogSettings(GVSpectru
     ui->sbAmplitudeSpectrumFFTW3MaxTimeForPlanPreparation->show();
     gMW->m_settings.add(ui->sbAmplitudeSpectrumFFTW3MaxTimeForPlanPreparation);
     #endif
+    #ifdef FFT_FFTW3
+    ui->cbAmplitudeSpectrumFFTW3KeepWisdom->show();
+    gMW->m_settings.add(ui->cbAmplitudeSpectrumFFTW3KeepWisdom);
+    #endif
     gMW->m_settings.add(ui->cbAmplitudeSpectrumWindowSizeForcedOdd);
     gMW->m_settings.add(ui->cbAmplitudeSpectrumLimitWindowDuration);
     gMW->m_settings.add(ui->sbAmplitudeSpectrumWindowDurationLimit);
@@ -86,7 +86,7 @@ public:
     void viewSet(QRectF viewrect=QRectF(), bool forwardsync=true);
     void viewUpdateTexts();
     void drawBackground(QPainter* painter, const QRectF& rect);
-    void draw_spectrum(QPainter* painter, std::vector<WAVTYPE> &gd, double fs, const QRectF& rect);
+    void draw_spectrum(QPainter* painter, std::vector<FFTTYPE> &gd, double fs, const QRectF& rect);
 
     ~GVSpectrumGroupDelay();
 
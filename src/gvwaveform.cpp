@@ -36,6 +36,7 @@ file provided in the source code of DFasma. Another copy can be found at
 #include "gvspectrogram.h"
 #include "wgenerictimevalue.h"
 #include "gvgenerictimevalue.h"
+#include "filtercomputethread.h"
 
 #include <iostream>
 using namespace std;
@@ -135,6 +136,9 @@ GVWaveform::GVWaveform(WMainWindow* parent)
     gMW->ui->lblSelectionTxt->setText("No selection");
     m_giFilteredSelection = new QGraphicsRectItem();
     m_giFilteredSelection->hide();
+    m_filtercomputethread = new FilterComputeThread(this);
+    connect(m_filtercomputethread, SIGNAL(filteringProgressing(int)), this, SLOT(filteringProgressing(int)));
+    connect(m_filtercomputethread, SIGNAL(filteringDone(bool)), this, SLOT(filteringDone(bool)));
     QColor filtsecbrush(255, 128, 128);
     QPen filteredSelectionPen(filtsecbrush);
     filteredSelectionPen.setWidth(0);
@@ -283,7 +287,7 @@ void GVWaveform::fitViewToSoundsAmplitude() {
         WAVTYPE maxwavmaxamp = 0.0;
         for(unsigned int si=0; si<gFL->ftsnds.size(); si++)
             if(gFL->ftsnds[si]->isVisible())
-                maxwavmaxamp = std::max(maxwavmaxamp, gFL->ftsnds[si]->m_giWavForWaveform->getMaxAbsoluteValue());
+                maxwavmaxamp = std::max(maxwavmaxamp, WAVTYPE(gFL->ftsnds[si]->m_giWavForWaveform->getMaxAbsoluteValue()));
 //                maxwavmaxamp = std::max(maxwavmaxamp, gFL->ftsnds[si]->m_giWaveform->gain()*gFL->ftsnds[si]->m_wavmaxamp);
 
         if(maxwavmaxamp==0.0)
@@ -329,6 +333,9 @@ void GVWaveform::viewSet(QRectF viewrect, bool sync) {
         updateTextsGeometry();
         m_giGrid->updateLines();
 
+        if(gMW->m_lastFilteredSound)
+            gMW->m_lastFilteredSound->requestFiltering(); // Filter what becomes visible
+
         if(sync){
             if(gMW->m_gvSpectrogram && gMW->ui->actionShowSpectrogram->isChecked()) {
 //                DCOUT << gMW->m_gvSpectrogram->viewport()->rect() << endl;
@@ -495,6 +502,9 @@ void GVWaveform::scrollContentsBy(int dx, int dy){
     QGraphicsView::scrollContentsBy(dx, dy);
 
     m_giGrid->updateLines();
+
+    if(gMW->m_lastFilteredSound)
+        gMW->m_lastFilteredSound->requestFiltering(); // Filter what becomes visible
 }
 
 void GVWaveform::wheelEvent(QWheelEvent* event){
@@ -587,14 +597,19 @@ void GVWaveform::mousePressEvent(QMouseEvent* event){
                 // Look for a nearby marker to modify
                 m_ca_pressed_index=-1;
                 FTLabels* selectedlabels = gFL->getCurrentFTLabels();
-                if(selectedlabels){
-                    for(int lli=0; m_ca_pressed_index==-1 && lli<int(selectedlabels->starts.size()); lli++) {
-                        QPoint slp = mapFromScene(QPointF(selectedlabels->starts[lli],0));
-                        if(std::abs(slp.x()-event->x())<5) {
-                            m_ca_pressed_index = lli;
-                            m_currentAction = CALabelModifPosition;
-                            gMW->setEditing(selectedlabels);
-                        }
+                int textindex = -1;
+                if(selectedlabels)
+                    textindex = selectedlabels->m_giWaveformLabels->textAt(this, event->pos());
+                if(textindex!=-1) {
+                    // Edit the text of the label
+                    selectedlabels->editText(textindex);
+                }
+                else if(selectedlabels){
+                    int lli = selectedlabels->findNearest(p.x());
+                    if(lli!=-1 && std::abs(mapFromScene(QPointF(selectedlabels->starts[lli],0)).x()-event->x())<5) {
+                        m_ca_pressed_index = lli;
+                        m_currentAction = CALabelModifPosition;
+                        gMW->setEditing(selectedlabels);
                     }
                     if(m_ca_pressed_index==-1) {
                         if(event->modifiers().testFlag(Qt::ControlModifier)){
@@ -800,7 +815,7 @@ void GVWaveform::mouseMoveEvent(QMouseEvent* event){
     else if(m_currentAction==CALabelModifPosition){
         FTLabels* ftlabel = gFL->getCurrentFTLabels();
         if(ftlabel) {
-            ftlabel->moveLabel(m_ca_pressed_index, p.x());
+            m_ca_pressed_index = ftlabel->moveLabel(m_ca_pressed_index, p.x());
             updateTextsGeometry();
         }
     }
@@ -840,11 +855,9 @@ void GVWaveform::mouseMoveEvent(QMouseEvent* event){
             bool foundclosemarker = false;
             FTLabels* ftl = gFL->getCurrentFTLabels();
             if(ftl){
-                for(int lli=0; !foundclosemarker && lli<ftl->getNbLabels(); lli++) {
-                    // cout << ftl->labels[lli].toLatin1().data() << ": " << ftl->starts[lli] << endl;
-                    QPoint slp = mapFromScene(QPointF(ftl->starts[lli],0));
-                    foundclosemarker = std::abs(slp.x()-event->x())<5;
-                }
+                int lli = ftl->findNearest(mapToScene(event->pos()).x());
+                if(lli!=-1)
+                    foundclosemarker = std::abs(mapFromScene(QPointF(ftl->starts[lli],0)).x()-event->x())<5;
             }
             if(foundclosemarker)
                 setCursor(Qt::SplitHCursor);
@@ -1035,7 +1048,7 @@ void GVWaveform::keyPressEvent(QKeyEvent* event){
             if(ftlabel && !FTGraphicsLabelItem::isEditing()){
                 if(event->text().size()>0){
                     if(m_currentAction==CALabelWritting && m_ftlabel_current_index!=-1){
-                        ftlabel->changeText(m_ftlabel_current_index, ftlabel->waveform_labels[m_ftlabel_current_index]->toPlainText()+event->text());
+                        ftlabel->changeText(m_ftlabel_current_index, ftlabel->labels[m_ftlabel_current_index]+event->text());
                     }
                     else{
                         m_currentAction = CALabelWritting;
@@ -1136,16 +1149,51 @@ void GVWaveform::fixTimeLimitsToSamples(QRectF& selection, const QRectF& mouseSe
 //            selection.setRight(selection.right()+dt);
 
             int si = int((selection.center().x()*gFL->getFs()-1 - (cursnd->m_stftparams.win.size()-1)/2.0) / cursnd->m_stftparams.stepsize + 0.5);
-            gMW->m_gvSpectrogram->m_stftcomputethread->m_mutex_changingstft.lock();
+            gMW->m_gvSpectrogram->m_stftcomputethread->m_lock_changingstft.lockForRead();
             si = std::min(std::max(0, si), int(cursnd->m_stftts.size())-1);
-            gMW->m_gvSpectrogram->m_stftcomputethread->m_mutex_changingstft.unlock();
+            gMW->m_gvSpectrogram->m_stftcomputethread->m_lock_changingstft.unlock();
             selection.setLeft((si*cursnd->m_stftparams.stepsize)/gFL->getFs());
             selection.setRight((si*cursnd->m_stftparams.stepsize + cursnd->m_stftparams.win.size()-1)/gFL->getFs());
         }
     }
 }
 
+void GVWaveform::filteringProgressing(int progress){
+    gMW->globalWaitingBarSetValue(progress);
+}
+
+void GVWaveform::filteringDone(bool last){
+    FilterComputeThread::Request req;
+    if(m_filtercomputethread->takeResults(req)){
+        for(size_t ri=0; ri<req.results.size(); ++ri){
+            FilterComputeThread::Result& result = req.results[ri];
+            FTSound* snd = result.snd;
+
+            // Drop it if the filter has changed or has been removed meanwhile
+            if(!snd->isFiltered() || snd->m_filteredgeneration!=result.generation)
+                continue;
+
+            snd->wavfiltered.swap(result.filtered);
+            snd->m_filteredbegin = result.begin;
+            snd->m_filteredend = result.end;
+            snd->m_filteredmaxamp = std::max(snd->m_filteredmaxamp, result.maxamp);
+            snd->m_dftparams.clear(); // The shown samples have changed
+            snd->updateFilteredWaveform(true);
+            snd->updateClippedState();
+
+            m_giFilteredSelection->setRect((snd->m_filteredselbegin+snd->m_giWavForWaveform->delay()-0.5)/snd->fs, -1.0, (snd->m_filteredselend-snd->m_filteredselbegin)/snd->fs, 2.0);
+            m_giFilteredSelection->show();
+        }
+        m_scene->update();
+        gMW->m_gvSpectrumAmplitude->updateDFTs();
+    }
+
+    if(last)
+        gMW->globalWaitingBarDone();
+}
+
 GVWaveform::~GVWaveform(){
+    delete m_filtercomputethread;
     delete m_toolBar;
 }
 
@@ -1284,10 +1332,10 @@ void GVWaveform::drawBackground(QPainter* painter, const QRectF& rect){
             outlinePen.setWidth(0);
             painter->setPen(outlinePen);
 
-            gMW->m_gvSpectrogram->m_stftcomputethread->m_mutex_changingstft.lock();
+            gMW->m_gvSpectrogram->m_stftcomputethread->m_lock_changingstft.lockForRead();
             for(size_t wci=0; wci<cursnd->m_stftts.size(); wci++)
                 painter->drawLine(QLineF(cursnd->m_stftts[wci], -1.0, cursnd->m_stftts[wci], 1.0));
-            gMW->m_gvSpectrogram->m_stftcomputethread->m_mutex_changingstft.unlock();
+            gMW->m_gvSpectrogram->m_stftcomputethread->m_lock_changingstft.unlock();
         }
     }
 }
@@ -31,6 +31,7 @@ file provided in the source code of DFasma. Another copy can be found at
 class QToolBar;
 class WMainWindow;
 class FTLabels;
+class FilterComputeThread;
 
 class GVWaveform : public QGraphicsView
 {
@@ -68,6 +69,7 @@ public:
     qreal m_initialPlayPosition;
     QGraphicsLineItem* m_giPlayCursor;
     QGraphicsRectItem* m_giFilteredSelection;
+    FilterComputeThread* m_filtercomputethread; // For the filtered selection
 
     // Graphic items
     QGraphicsScene* m_scene;
@@ -134,6 +136,8 @@ public slots:
     void selectionZoomOn();
     void setMouseCursorPosition(double position, bool forwardsync);
     void playCursorSet(double t, bool forwardsync=true);
+    void filteringProgressing(int progress);
+    void filteringDone(bool last);
 
 };
 
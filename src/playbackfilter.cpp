@@ -0,0 +1,208 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "playbackfilter.h"
+
+#include <cmath>
+#include <complex>
+#include <algorithm>
+
+#include "fftplanpool.h"
+
+#define PLAYBACKFILTERBLOCKLEN 16384        // [samples] Min length of the blocks for the streaming
+#define PLAYBACKFILTERMAXMARGIN (1<<21)     // [samples]
+#define PLAYBACKFILTERENERGYFRAMELEN 8192   // [samples] For the energy compensation
+#define PLAYBACKFILTERENERGYNBFRAMES 64
+
+PlaybackFilter::PlaybackFilter()
+    : m_margin(0)
+    , m_gain(1.0)
+    , m_blockstart(0)
+{
+}
+
+void PlaybackFilter::clear() {
+    m_num.clear();
+    m_den.clear();
+    m_margin = 0;
+    m_gain = 1.0;
+    m_block.clear();
+}
+
+void PlaybackFilter::addBiquads(const std::vector< std::vector<double> >& num, const std::vector< std::vector<double> >& den) {
+    for(size_t bi=0; bi<num.size(); ++bi){
+        // Normalise so that den[0]=1
+        std::vector<double> b(3, 0.0), a(3, 0.0);
+        for(size_t n=0; n<3 && n<num[bi].size(); ++n)
+            b[n] = num[bi][n]/den[bi][0];
+        for(size_t n=0; n<3 && n<den[bi].size(); ++n)
+            a[n] = den[bi][n]/den[bi][0];
+        m_num.push_back(b);
+        m_den.push_back(a);
+    }
+    m_block.clear();
+
+    // The margin is where the impulse response of the cascade vanishes
+    // (below -100dB of its energy, per block of 1024 samples)
+    std::vector<double> z1(m_num.size(), 0.0), z2(m_num.size(), 0.0);
+    double energy = 0.0;
+    double chunkenergy = 0.0;
+    int n = 0;
+    for(; n<PLAYBACKFILTERMAXMARGIN; ++n){
+        double v = (n==0)?1.0:0.0;
+        for(size_t bi=0; bi<m_num.size(); ++bi){
+            const double* b = &(m_num[bi][0]);
+            const double* a = &(m_den[bi][0]);
+            double x = v;
+            v = b[0]*x + z1[bi];
+            z1[bi] = b[1]*x - a[1]*v + z2[bi];
+            z2[bi] = b[2]*x - a[2]*v;
+        }
+        energy += v*v;
+        chunkenergy += v*v;
+        if(n%1024==1023){
+            if(chunkenergy<1e-10*energy)
+                break;
+            chunkenergy = 0.0;
+        }
+    }
+    m_margin = n+1;
+}
+
+void PlaybackFilter::setGain(double gain) {
+    m_gain = gain;
+    m_block.clear();
+}
+
+void PlaybackFilter::filter(const std::vector<WAVTYPE>& wav, qint64 begin, qint64 end, WAVTYPE* out) const {
+    if(end<=begin)
+        return;
+
+    qint64 fbegin = begin-m_margin;
+    qint64 fend = end+m_margin;
+    qint64 wavsize = qint64(wav.size());
+    std::vector<double> y(fend-fbegin, 0.0);
+    for(qint64 n=std::max(fbegin, qint64(0)); n<std::min(fend, wavsize); ++n)
+        y[n-fbegin] = wav[n];
+
+    for(size_t bi=0; bi<m_num.size(); ++bi){
+        const double* b = &(m_num[bi][0]);
+        const double* a = &(m_den[bi][0]);
+
+        // Forward (transposed direct form II)
+        double z1 = 0.0;
+        double z2 = 0.0;
+        for(size_t n=0; n<y.size(); ++n){
+            double x = y[n];
+            double v = b[0]*x + z1;
+            z1 = b[1]*x - a[1]*v + z2;
+            z2 = b[2]*x - a[2]*v;
+            y[n] = v;
+        }
+
+        // Backward
+        z1 = 0.0;
+        z2 = 0.0;
+        for(size_t n=y.size(); n>0; --n){
+            double x = y[n-1];
+            double v = b[0]*x + z1;
+            z1 = b[1]*x - a[1]*v + z2;
+            z2 = b[2]*x - a[2]*v;
+            y[n-1] = v;
+        }
+    }
+
+    for(qint64 n=begin; n<end; ++n)
+        out[n-begin] = m_gain*y[n-fbegin];
+}
+
+WAVTYPE PlaybackFilter::at(const std::vector<WAVTYPE>& wav, qint64 n) {
+    if(m_block.empty() || n<m_blockstart || n>=m_blockstart+qint64(m_block.size())){
+        m_blockstart = n;
+        m_block.resize(std::max(PLAYBACKFILTERBLOCKLEN, 2*m_margin));
+        filter(wav, m_blockstart, m_blockstart+qint64(m_block.size()), &(m_block[0]));
+    }
+    return m_block[n-m_blockstart];
+}
+
+double PlaybackFilter::response(double f) const {
+    std::complex<double> z = std::polar(1.0, -2.0*M_PI*f);
+    double resp = 1.0;
+    for(size_t bi=0; bi<m_num.size(); ++bi){
+        const double* b = &(m_num[bi][0]);
+        const double* a = &(m_den[bi][0]);
+        resp *= std::norm(b[0]+z*(b[1]+z*b[2]))/std::norm(a[0]+z*(a[1]+z*a[2]));
+    }
+    return resp; // Amplitude response, |H|^2 since the signal is filtered twice
+}
+
+double PlaybackFilter::energyCompensation(const std::vector<WAVTYPE>& wav, qint64 begin, qint64 end) const {
+    begin = std::max(begin, qint64(0));
+    end = std::min(end, qint64(wav.size()));
+    qint64 len = end-begin;
+    if(len<=0)
+        return 1.0;
+
+    int dftlen = PLAYBACKFILTERENERGYFRAMELEN;
+    int framelen = int(std::min(qint64(dftlen), len));
+    int nbframes = int(std::min(qint64(PLAYBACKFILTERENERGYNBFRAMES), std::max(qint64(1), len/framelen)));
+    std::vector<FFTTYPE> win = qae::hann(framelen);
+
+    std::vector<double> resp2(dftlen/2+1);
+    for(int k=0; k<=dftlen/2; ++k){
+        double r = response(double(k)/dftlen);
+        resp2[k] = r*r; // Power response
+    }
+
+    // The frames are spread evenly over the segment
+    qae::FFTwrapper* fft = FFTPlanPool::acquire(dftlen);
+    double enerwav = 0.0;
+    double enerfilt = 0.0;
+    for(int fi=0; fi<nbframes; ++fi){
+        qint64 start = begin;
+        if(nbframes>1)
+            start += ((len-framelen)*fi)/(nbframes-1);
+
+        FFTTYPE* in = &(fft->in[0]);
+        for(int n=0; n<framelen; ++n)
+            in[n] = wav[start+n]*win[n];
+        for(int n=framelen; n<dftlen; ++n)
+            in[n] = 0.0;
+        fft->execute(false);
+
+        double p = std::norm(std::complex<FFTTYPE>(fft->getDCOutput()));
+        enerwav += p;
+        enerfilt += p*resp2[0];
+        for(int k=1; k<dftlen/2; ++k){
+            p = 2*std::norm(std::complex<FFTTYPE>(fft->getMidOutput(k)));
+            enerwav += p;
+            enerfilt += p*resp2[k];
+        }
+        p = std::norm(std::complex<FFTTYPE>(fft->getNyquistOutput()));
+        enerwav += p;
+        enerfilt += p*resp2[dftlen/2];
+    }
+    FFTPlanPool::release(fft);
+
+    if(!(enerfilt>0.0))
+        return 1.0;
+
+    return std::sqrt(enerwav/enerfilt);
+}
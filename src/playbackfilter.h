@@ -0,0 +1,79 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PLAYBACKFILTER_H
+#define PLAYBACKFILTER_H
+
+#include <vector>
+
+#include <QtGlobal>
+
+#include "qaesigproc.h"
+
+#ifdef SIGPROC_FLOAT
+#define WAVTYPE float
+#else
+#define WAVTYPE double
+#endif
+
+// The forward-backward (zero-phase) filtering of a cascade of biquads (as filtfilt),
+// computed by blocks, so that the playback can start immediately
+// and only the samples which are needed are filtered.
+// Each block is filtered with a margin on both sides, starting from a null state,
+// the margin being long enough for the impulse response of the filter to vanish.
+// Thus, the blocks can be computed independently and anywhere in the sound.
+class PlaybackFilter
+{
+    std::vector< std::vector<double> > m_num; // The biquads' coefficients
+    std::vector< std::vector<double> > m_den;
+    int m_margin;       // [samples]
+    double m_gain;      // Applied on the filtered samples (e.g. to compensate the energy)
+
+    // The last filtered block, for the streaming
+    std::vector<WAVTYPE> m_block;
+    qint64 m_blockstart;  // [sample index]
+
+public:
+    PlaybackFilter();
+
+    void clear();
+    inline bool isEmpty() const {return m_num.empty();}
+
+    // Add biquads to the cascade
+    void addBiquads(const std::vector< std::vector<double> >& num, const std::vector< std::vector<double> >& den);
+    void setGain(double gain);
+    inline double gain() const {return m_gain;}
+    inline int margin() const {return m_margin;}
+
+    // Filter wav[begin,end[ (zero outside of wav)
+    void filter(const std::vector<WAVTYPE>& wav, qint64 begin, qint64 end, WAVTYPE* out) const;
+    // A filtered sample, filtered with the block around it
+    // (quick if the samples are asked in order, as for the playback)
+    WAVTYPE at(const std::vector<WAVTYPE>& wav, qint64 n);
+
+    // The amplitude response of the forward-backward filtering, at the relative frequency f
+    // (i.e. the product of the biquads' |H|^2, the power response is its square)
+    double response(double f) const;
+    // Estimate of sqrt(E_wav/E_filtered) over wav[begin,end[,
+    // from the power spectrum of a few frames of the segment (thus without filtering it)
+    double energyCompensation(const std::vector<WAVTYPE>& wav, qint64 begin, qint64 end) const;
+};
+
+#endif // PLAYBACKFILTER_H
@@ -0,0 +1,197 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "stftcache.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include <QFile>
+#include <QDir>
+#include <QFileInfo>
+#include <QCryptographicHash>
+
+#define STFTCACHEMAGIC "DFSTFT01"
+
+// The header of a cache file, followed by the STFT values
+struct STFTCacheHeader {
+    char magic[8];
+    qint32 wavtypesize;
+    qint32 stftlen;
+    qint32 dftsize;
+    qint32 reserved;
+    double stftmin;
+    double stftmax;
+};
+
+QMutex STFTCache::s_mutex;
+QString STFTCache::s_dir;
+qint64 STFTCache::s_sizelimit = qint64(4096)*1024*1024;
+
+void STFTCache::setDirectory(const QString& dir) {
+    QMutexLocker locker(&s_mutex);
+    s_dir = dir;
+    if(!s_dir.isEmpty())
+        QDir().mkpath(s_dir);
+}
+
+void STFTCache::setSizeLimit(qint64 sizelimit) {
+    QMutexLocker locker(&s_mutex);
+    s_sizelimit = sizelimit;
+}
+
+bool STFTCache::isEnabled() {
+    QMutexLocker locker(&s_mutex);
+    return !s_dir.isEmpty();
+}
+
+QString STFTCache::filePath(const QString& key) {
+    QMutexLocker locker(&s_mutex);
+    return s_dir+QDir::separator()+key+".stft";
+}
+
+QByteArray STFTCache::hashWav(const std::vector<WAVTYPE>& wav) {
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    const char* data = (const char*)(wav.empty()?NULL:&(wav[0]));
+    qint64 size = qint64(wav.size())*sizeof(WAVTYPE);
+    // Feed it by blocks, addData takes only an int as length
+    for(qint64 pos=0; pos<size; pos+=(1<<24))
+        hash.addData(data+pos, int(std::min(qint64(1<<24), size-pos)));
+    return hash.result();
+}
+
+QString STFTCache::key(const QByteArray& wavhash, const STFTComputeThread::STFTParameters& params, int minsi, int stftlen) {
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(wavhash);
+    QString paramstxt = QString("%1 %2 %3 %4 %5 %6 %7 %8 %9").arg(sizeof(WAVTYPE)).arg(params.ampscale, 0, 'g', 17).arg(params.delay).arg(params.stepsize).arg(params.dftlen).arg(params.cepliftorder).arg(params.cepliftpresdc).arg(minsi).arg(stftlen);
+    if(params.reassigned)
+        paramstxt += " reassigned";
+    if(params.isCQT())
+        paramstxt += QString(" cqt %1 %2").arg(params.cqtbinsperoctave).arg(params.cqtfmin, 0, 'g', 17);
+    hash.addData(paramstxt.toLatin1());
+    if(!params.win.empty())
+        hash.addData((const char*)&(params.win[0]), int(params.win.size()*sizeof(FFTTYPE)));
+    return QString(hash.result().toHex());
+}
+
+WAVTYPE* STFTCache::map(const QString& key, int stftlen, int dftsize, QFile*& file, FFTTYPE& stftmin, FFTTYPE& stftmax) {
+    file = new QFile(filePath(key));
+    if(!file->exists() || !file->open(QIODevice::ReadWrite)){
+        delete file;
+        file = NULL;
+        return NULL;
+    }
+
+    STFTCacheHeader header;
+    qint64 datasize = qint64(stftlen)*dftsize*sizeof(WAVTYPE);
+    if(file->read((char*)&header, sizeof(header))!=sizeof(header)
+       || std::strncmp(header.magic, STFTCACHEMAGIC, 8)!=0
+       || header.wavtypesize!=int(sizeof(WAVTYPE))
+       || header.stftlen!=stftlen
+       || header.dftsize!=dftsize
+       || file->size()!=qint64(sizeof(header))+datasize){
+        // Unusable (e.g. unfinished or from another version)
+        file->remove();
+        delete file;
+        file = NULL;
+        return NULL;
+    }
+
+    // Rewrite the header so that its modification time marks it as recently used
+    file->seek(0);
+    file->write((const char*)&header, sizeof(header));
+    file->flush();
+
+    // Copy-on-write, so that the values can still be modified in memory
+    WAVTYPE* stftpa = (WAVTYPE*)(file->map(sizeof(header), datasize, QFileDevice::MapPrivateOption));
+    if(stftpa==NULL){
+        delete file;
+        file = NULL;
+        return NULL;
+    }
+
+    stftmin = header.stftmin;
+    stftmax = header.stftmax;
+
+    return stftpa;
+}
+
+void STFTCache::unmap(QFile* file, WAVTYPE* stftpa) {
+    file->unmap((uchar*)stftpa);
+    delete file;
+}
+
+void STFTCache::store(const QString& key, const WAVTYPE* stftpa, int stftlen, int dftsize, FFTTYPE stftmin, FFTTYPE stftmax) {
+    QString filepath = filePath(key);
+
+    STFTCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::strncpy(header.magic, STFTCACHEMAGIC, 8);
+    header.wavtypesize = sizeof(WAVTYPE);
+    header.stftlen = stftlen;
+    header.dftsize = dftsize;
+    header.stftmin = stftmin;
+    header.stftmax = stftmax;
+
+    // Write it aside first, so that an unfinished file is never used
+    QFile file(filepath+".tmp");
+    if(!file.open(QIODevice::WriteOnly))
+        return;
+    bool ok = file.write((const char*)&header, sizeof(header))==sizeof(header);
+    const char* data = (const char*)stftpa;
+    qint64 datasize = qint64(stftlen)*dftsize*sizeof(WAVTYPE);
+    for(qint64 pos=0; ok && pos<datasize; ){
+        qint64 written = file.write(data+pos, std::min(qint64(1<<24), datasize-pos));
+        ok = written>0;
+        pos += written;
+    }
+    file.close();
+
+    if(!ok){
+        file.remove();
+        return;
+    }
+    QFile::remove(filepath);
+    file.rename(filepath);
+
+    evict(filepath);
+}
+
+void STFTCache::evict(const QString& keep) {
+    s_mutex.lock();
+    QDir dir(s_dir);
+    qint64 sizelimit = s_sizelimit;
+    s_mutex.unlock();
+
+    // Oldest first
+    QFileInfoList files = dir.entryInfoList(QStringList("*.stft"), QDir::Files, QDir::Time | QDir::Reversed);
+
+    qint64 size = 0;
+    for(int fi=0; fi<files.size(); ++fi)
+        size += files[fi].size();
+
+    for(int fi=0; fi<files.size() && size>sizelimit; ++fi){
+        if(files[fi].absoluteFilePath()==QFileInfo(keep).absoluteFilePath())
+            continue;
+        // A mapped file might not be removable (e.g. on Windows), then try the next one
+        if(QFile::remove(files[fi].absoluteFilePath()))
+            size -= files[fi].size();
+    }
+}
@@ -0,0 +1,71 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STFTCACHE_H
+#define STFTCACHE_H
+
+#include <vector>
+
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+
+#include "stftcomputethread.h"
+
+#ifdef SIGPROC_FLOAT
+#define WAVTYPE float
+#else
+#define WAVTYPE double
+#endif
+
+class QFile;
+
+// A directory of STFT magnitudes [dB], one file per sound and STFT parameters.
+// The files are named after a hash of the sound's samples and of the parameters,
+// so that they can be found again, e.g. when reopening a session.
+// The entries are memory-mapped instead of being loaded.
+// The least recently used entries are removed when the size limit is reached.
+class STFTCache
+{
+    static QMutex s_mutex;
+    static QString s_dir;       // Empty if the cache is disabled
+    static qint64 s_sizelimit;  // [bytes]
+
+    static QString filePath(const QString& key);
+    static void evict(const QString& keep);
+
+public:
+    static void setDirectory(const QString& dir);
+    static void setSizeLimit(qint64 sizelimit);
+    static bool isEnabled();
+
+    static QByteArray hashWav(const std::vector<WAVTYPE>& wav);
+    static QString key(const QByteArray& wavhash, const STFTComputeThread::STFTParameters& params, int minsi, int stftlen);
+
+    // Map an existing entry (copy-on-write) and return its values, or NULL if there is no valid entry.
+    // The mapping belongs to the returned file, see unmap(.).
+    static WAVTYPE* map(const QString& key, int stftlen, int dftsize, QFile*& file, FFTTYPE& stftmin, FFTTYPE& stftmax);
+    static void unmap(QFile* file, WAVTYPE* stftpa);
+
+    // Save a new entry
+    static void store(const QString& key, const WAVTYPE* stftpa, int stftlen, int dftsize, FFTTYPE stftmin, FFTTYPE stftmax);
+};
+
+#endif // STFTCACHE_H
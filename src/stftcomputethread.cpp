@@ -20,18 +20,31 @@ file provided in the source code of DFasma. Another copy can be found at
 
 #include "stftcomputethread.h"
 
+#include <limits>
+
 #include <QtGlobal>
+#include <QRunnable>
+#include <QAtomicInt>
 
 #include "wmainwindow.h"
 #include "ui_wmainwindow.h"
 #include "ftsound.h"
+#include "stftimagetiles.h"
+#include "stftkernels.h"
+#include "stftcache.h"
+#include "windowcache.h"
+#include "fftplanpool.h"
 #include "../external/libqxt/qxtspanslider.h"
 
 #include "qaecolormap.h"
 #include "qaesigproc.h"
 #include "qaehelpers.h"
 
-STFTComputeThread::STFTParameters::STFTParameters(FTSound* reqnd, const std::vector<FFTTYPE>& reqwin, int reqstepsize, int reqdftlen, int reqcepliftorder, bool reqcepliftpresdc){
+#define STFTCQTMAXFREQ 0.425    // [fs] Upper limit of the constant-Q bins
+#define STFTCQTDECIMORDER 40    // Half length of the half-band decimation filter
+#define STFTCQTKERNELTHRESHOLD 0.005 // Drop the kernels' values below this proportion of their max
+
+STFTComputeThread::STFTParameters::STFTParameters(FTSound* reqnd, const std::vector<FFTTYPE>& reqwin, int reqstepsize, int reqdftlen, int reqcepliftorder, bool reqcepliftpresdc, bool reqreassigned, int reqcqtbinsperoctave, FFTTYPE reqcqtfmin){
     clear();
 
     snd = reqnd;
@@ -42,6 +55,9 @@ STFTComputeThread::STFTParameters::STFTParameters(FTSound* reqnd, const std::vec
     dftlen = reqdftlen;
     cepliftorder = reqcepliftorder;
     cepliftpresdc = reqcepliftpresdc;
+    reassigned = reqreassigned;
+    cqtbinsperoctave = reqcqtbinsperoctave;
+    cqtfmin = reqcqtfmin;
 }
 
 bool STFTComputeThread::STFTParameters::operator==(const STFTParameters& param) const {
@@ -59,6 +75,12 @@ bool STFTComputeThread::STFTParameters::operator==(const STFTParameters& param)
         return false;
     if(cepliftpresdc!=param.cepliftpresdc)
         return false;
+    if(reassigned!=param.reassigned)
+        return false;
+    if(cqtbinsperoctave!=param.cqtbinsperoctave)
+        return false;
+    if(cqtfmin!=param.cqtfmin)
+        return false;
     if(win.size()!=param.win.size())
         return false;
     for(size_t n=0; n<win.size(); n++)
@@ -68,10 +90,575 @@ bool STFTComputeThread::STFTParameters::operator==(const STFTParameters& param)
     return true;
 }
 
+int STFTComputeThread::STFTParameters::nbBins() const {
+    if(isCQT())
+        return cqtNbOctaves()*cqtbinsperoctave;
+    return dftlen/2+1;
+}
+
+int STFTComputeThread::STFTParameters::cqtNbOctaves(int fs, FFTTYPE fmin) {
+    return std::max(1, int(std::floor(std::log(STFTCQTMAXFREQ*fs/fmin)/std::log(2.0))));
+}
+
+int STFTComputeThread::STFTParameters::cqtNbOctaves() const {
+    return cqtNbOctaves(snd->fs, cqtfmin);
+}
+
+int STFTComputeThread::STFTParameters::cqtDFTLength() const {
+    // The longest kernel is the one of the first bin of an octave,
+    // whose frequency is the same for all octaves, relatively to their decimated sampling rate
+    FFTTYPE Q = 1.0/(std::pow(2.0, 1.0/cqtbinsperoctave)-1.0);
+    FFTTYPE relfreq = cqtfmin*std::pow(2.0, cqtNbOctaves()-1)/snd->fs;
+    int winlen = int(std::ceil(Q/relfreq));
+    return 1<<int(std::ceil(std::log(double(winlen+1))/std::log(2.0)));
+}
+
+// The description of the frames to compute, shared by all the workers
+class STFTComputeThread::FramesJob {
+public:
+    const STFTParameters* params;
+    const std::vector<WAVTYPE>* wav;
+    WAVTYPE* stftpa;
+    qreal gain;
+    qint64 snddelay;
+    int minsi;
+    int stftlen;    // [frames]
+    const std::vector<int>* frames; // The frames to compute (all of them if NULL)
+    int nbframes;   // [frames] To compute
+    int chunksize;  // [frames]
+    int nbchunks;
+
+    // The cepstral liftering (if cepliftorder>0)
+    WindowCache::Window lifterwin;  // The lifter is its first half
+    bool lifterdct;                 // Use the truncated DCT instead of two FFTs
+    std::vector<FFTTYPE> liftercos; // [cepliftorder x dftsize] cos(2*pi*k*n/dftlen), for k=1..cepliftorder
+
+    // The reassignment (if reassigned)
+    // The energies are accumulated in stftpa and converted to dB at the end of the job.
+    std::vector<FFTTYPE> wint;      // The time-weighted window [samples]
+    std::vector<FFTTYPE> wind;      // The derivative of the window [1/samples]
+    int reassignmargin;             // [frames] The largest shift in time
+    QMutex mutex_reassign;          // To accumulate in stftpa
+
+    // The constant-Q transform (if cqtbinsperoctave>0)
+    // All the octaves use the same kernels, on the signal decimated by 2 for each octave below.
+    int cqtnboctaves;
+    int cqtlen;                                     // [samples] The DFT length of the kernels
+    std::vector<std::vector<WAVTYPE> > cqtwavs;     // [octave] The clipped signal decimated by 2, 4, ... (empty for octave 0, clipped on the fly from wav)
+    std::vector<int> cqtkernelbegins;               // [bins per octave + 1] First value of each bin's kernel
+    std::vector<int> cqtkernelbins;                 // The DFT bins of the sparse kernels
+    std::vector<std::complex<FFTTYPE> > cqtkernels; // The sparse kernels (conjugated and divided by cqtlen)
+
+    QAtomicInt chunk_next;  // The next chunk to be computed by any worker
+    QAtomicInt frames_done; // The number of frames done so far (for the progress bar)
+    QAtomicInt memoryfull;  // A worker couldn't allocate its buffers
+};
+
+// A worker computes chunks of frames until there is no more chunk to compute.
+// It keeps track of the min and max amplitudes of the frames it computed.
+class STFTComputeThread::FramesWorker : public QRunnable {
+public:
+    FramesJob* m_job;
+    qae::FFTwrapper* m_fft; // The FFT of this worker only
+    FFTTYPE m_stftmin;
+    FFTTYPE m_stftmax;
+
+    // Allocated once for all the frames
+    // The log amplitudes are kept in FFTTYPE until the end of the liftering,
+    // so that the storage precision (WAVTYPE) doesn't impact the cepstrum
+    std::vector<FFTTYPE> m_values;
+    std::vector<FFTTYPE> m_cc;
+    std::vector<FFTTYPE> m_weighted; // For the truncated DCT
+    // For the reassignment
+    std::vector<WAVTYPE> m_frame;    // The clipped samples of a frame
+    std::vector<std::complex<FFTTYPE> > m_xh, m_xth, m_xdh;
+    std::vector<FFTTYPE> m_accum;    // The energies reassigned by a chunk
+
+    FramesWorker(FramesJob* job, qae::FFTwrapper* fft)
+        : m_job(job)
+        , m_fft(fft)
+        , m_stftmin(std::numeric_limits<FFTTYPE>::infinity())
+        , m_stftmax(-std::numeric_limits<FFTTYPE>::infinity())
+    {
+        setAutoDelete(false);
+    }
+
+    void run();
+    void computeFrames(int nibegin, int niend, FFTTYPE& chunkmin, FFTTYPE& chunkmax);
+    void lifter(std::vector<FFTTYPE>& values);
+    void computeReassignedFrames(int nibegin, int niend);
+    void computeCQTFrames(int nibegin, int niend, FFTTYPE& chunkmin, FFTTYPE& chunkmax);
+    void dft(const std::vector<FFTTYPE>& win, int n0, int n1, std::vector<std::complex<FFTTYPE> >& dft);
+};
+
+void STFTComputeThread::FramesWorker::run() {
+    try{
+        int dftsize = m_job->params->dftlen/2+1;
+        m_values.resize(m_job->params->isCQT()?m_job->params->cqtbinsperoctave:dftsize);
+        if(m_job->params->cepliftorder>0){
+            m_cc.reserve(dftsize);
+            if(m_job->lifterdct)
+                m_weighted.resize(dftsize);
+        }
+        if(m_job->params->reassigned){
+            m_frame.resize(m_job->params->win.size());
+            m_xh.resize(dftsize);
+            m_xth.resize(dftsize);
+            m_xdh.resize(dftsize);
+        }
+        if(m_job->params->isCQT())
+            m_xh.resize(m_job->cqtlen/2+1);
+
+        int ci;
+        while((ci=m_job->chunk_next.fetchAndAddOrdered(1))<m_job->nbchunks
+              && !gMW->ui->pbSTFTComputingCancel->isChecked()){
+            int nibegin = ci*m_job->chunksize;
+            int niend = std::min(nibegin+m_job->chunksize, m_job->nbframes);
+
+            FFTTYPE chunkmin = std::numeric_limits<FFTTYPE>::infinity();
+            FFTTYPE chunkmax = -std::numeric_limits<FFTTYPE>::infinity();
+            if(m_job->params->isCQT())
+                computeCQTFrames(nibegin, niend, chunkmin, chunkmax);
+            else if(m_job->params->reassigned)
+                computeReassignedFrames(nibegin, niend);
+            else if(m_job->frames){
+                for(int fi=nibegin; fi<niend; ++fi)
+                    computeFrames((*(m_job->frames))[fi], (*(m_job->frames))[fi]+1, chunkmin, chunkmax);
+            }
+            else
+                computeFrames(nibegin, niend, chunkmin, chunkmax);
+
+            m_stftmin = std::min(m_stftmin, chunkmin);
+            m_stftmax = std::max(m_stftmax, chunkmax);
+
+            m_job->frames_done.fetchAndAddOrdered(niend-nibegin);
+        }
+    }
+    catch(std::bad_alloc err){
+        // Exceptions cannot cross the thread pool, let STFTComputeThread::run throw it
+        m_job->memoryfull.store(1);
+    }
+}
+
+void STFTComputeThread::FramesWorker::computeFrames(int nibegin, int niend, FFTTYPE& chunkmin, FFTTYPE& chunkmax) {
+
+    const STFTParameters& params = *(m_job->params);
+    const std::vector<FFTTYPE>& win = params.win;
+    const std::vector<WAVTYPE>* wav = m_job->wav;
+    int stepsize = params.stepsize;
+    int dftlen = params.dftlen;
+    int dftsize = dftlen/2+1;
+    WAVTYPE* stftpa = m_job->stftpa;
+    WAVTYPE* stftfrpa = NULL; // Pointer to a single frame
+    qreal gain = m_job->gain;
+    std::vector<FFTTYPE>& values = m_values;
+
+    int winlen = int(win.size());
+    int wavsize = int(wav->size());
+
+    for(int ni=nibegin; ni<niend && !gMW->ui->pbSTFTComputingCancel->isChecked(); ++ni){
+        int si = m_job->minsi + ni;
+        FFTTYPE* in = &(m_fft->in[0]);
+
+        // Set the DFT's input
+        // (only the part of the window which overlaps the samples is computed,
+        //  the rest is zero, as well as the padding)
+        qint64 wstart = qint64(si)*stepsize - m_job->snddelay;
+        int n0 = int(std::min(qint64(winlen), std::max(qint64(0), -wstart)));
+        int n1 = int(std::max(qint64(n0), std::min(qint64(winlen), wavsize-wstart)));
+        int n = 0;
+        for(; n<n0; ++n)
+            in[n] = 0.0;
+        bool hasnonzerovalues = false;
+        if(n1>n0)
+            hasnonzerovalues = stft_frame_input(&((*wav)[wstart+n0]), n1-n0, gain, &(win[n0]), in+n0);
+        n = n1;
+
+        if(hasnonzerovalues){
+            // Zero-pad the DFT's input
+            for(; n<dftlen; ++n)
+                in[n] = 0.0;
+
+            m_fft->execute(false); // Compute the DFT
+
+            // Retrieve DFT's output
+            // (log|X| = 0.5*log|X|^2, which avoids the hypot of std::abs)
+            values[0] = std::log(std::abs(m_fft->getDCOutput()));
+            for(n=1; n<dftlen/2; ++n)
+                values[n] = std::norm(m_fft->getMidOutput(n));
+            for(n=1; n<dftlen/2; ++n)
+                values[n] = 0.5*std::log(values[n]);
+            values[dftlen/2] = std::log(std::abs(m_fft->getNyquistOutput()));
+
+            if(params.cepliftorder>0)
+                lifter(values);
+
+            // Convert to [dB] and compute min and max magnitudes[dB]
+            // Do not consider Inf values as well as DC and Nyquist (Too easy to degenerate)
+            stftfrpa = stftpa+ni*dftsize;
+            FFTTYPE dcnyqmin = std::numeric_limits<FFTTYPE>::infinity();
+            FFTTYPE dcnyqmax = -std::numeric_limits<FFTTYPE>::infinity();
+            stft_frame_db(&(values[0]), 1, stftfrpa, dcnyqmin, dcnyqmax);
+            stft_frame_db(&(values[1]), dftlen/2-1, stftfrpa+1, chunkmin, chunkmax);
+            stft_frame_db(&(values[dftlen/2]), 1, stftfrpa+dftlen/2, dcnyqmin, dcnyqmax);
+        }
+        else{
+            stftfrpa = stftpa+ni*dftsize;
+            for(n=0; n<dftsize; n++, stftfrpa++)
+                *stftfrpa = -std::numeric_limits<FFTTYPE>::infinity();
+        }
+    }
+}
+
+// Smooth the log amplitudes by attenuating the first cepliftorder cepstral coefficients
+void STFTComputeThread::FramesWorker::lifter(std::vector<FFTTYPE>& values) {
+    const STFTParameters& params = *(m_job->params);
+    const std::vector<FFTTYPE>& lifterwin = *(m_job->lifterwin);
+    int dftlen = params.dftlen;
+    int dftsize = dftlen/2+1;
+
+    // First, fix possible Inf amplitudes to avoid ending up with NaNs.
+    if(qIsInf(values[0]))
+        values[0] = values[1]; // TOOD Use extrap ??
+    for(int n=1; n<dftsize; ++n) {
+        if(qIsInf(values[n]))
+            values[n] = values[n-1]; // TOOD Use extrap ??
+    }
+
+    if(m_job->lifterdct){
+        // Compute only the coefficients to attenuate, using the precomputed cosines,
+        // and remove the attenuated part from the amplitudes
+        // (the coefficients are independent, since the cosines are orthogonal)
+        m_weighted[0] = values[0];
+        for(int n=1; n<dftlen/2; ++n)
+            m_weighted[n] = 2*values[n];
+        m_weighted[dftlen/2] = values[dftlen/2];
+
+        m_cc.resize(params.cepliftorder+1);
+        for(int cci=1; cci<1+params.cepliftorder; ++cci){
+            const FFTTYPE* coses = &(m_job->liftercos[size_t(cci-1)*dftsize]);
+            FFTTYPE cc = 0.0;
+            for(int n=0; n<dftsize; ++n)
+                cc += m_weighted[n]*coses[n];
+            m_cc[cci] = (1.0-lifterwin[cci-1])*2.0*cc/dftlen;
+        }
+        m_cc[0] = 0.0;
+        if(!params.cepliftpresdc){
+            for(int n=0; n<dftsize; ++n)
+                m_cc[0] += m_weighted[n];
+            m_cc[0] /= dftlen;
+        }
+
+        for(int cci=1; cci<1+params.cepliftorder; ++cci){
+            const FFTTYPE* coses = &(m_job->liftercos[size_t(cci-1)*dftsize]);
+            FFTTYPE cc = m_cc[cci];
+            for(int n=0; n<dftsize; ++n)
+                values[n] -= cc*coses[n];
+        }
+        if(m_cc[0]!=0.0)
+            for(int n=0; n<dftsize; ++n)
+                values[n] -= m_cc[0];
+    }
+    else{
+        hspec2rcc(values, m_fft, m_cc);
+        for(int cci=1; cci<1+params.cepliftorder && cci<int(m_cc.size()); ++cci)
+            m_cc[cci] *= lifterwin[cci-1];
+        if(!params.cepliftpresdc)
+            m_cc[0] = 0.0;
+        rcc2hspec(m_cc, m_fft, values);
+    }
+}
+
+// The DFT of the clipped samples [n0,n1[ of a frame, multiplied by the given window
+void STFTComputeThread::FramesWorker::dft(const std::vector<FFTTYPE>& win, int n0, int n1, std::vector<std::complex<FFTTYPE> >& dft) {
+    int dftlen = m_job->params->dftlen;
+    FFTTYPE* in = &(m_fft->in[0]);
+    int n = 0;
+    for(; n<n0; ++n)
+        in[n] = 0.0;
+    for(; n<n1; ++n)
+        in[n] = m_frame[n]*win[n];
+    for(; n<dftlen; ++n)
+        in[n] = 0.0;
+
+    m_fft->execute(false);
+
+    dft[0] = std::complex<FFTTYPE>(m_fft->getDCOutput());
+    for(n=1; n<dftlen/2; ++n)
+        dft[n] = m_fft->getMidOutput(n);
+    dft[dftlen/2] = std::complex<FFTTYPE>(m_fft->getNyquistOutput());
+}
+
+// Reassigned spectrogram: the energy of each bin is moved to its center of gravity,
+// in time: t + Re(X_th/X_h) and in frequency: w - Im(X_dh/X_h)
+// (with the window h, the time-weighted window th and the derivative window dh).
+void STFTComputeThread::FramesWorker::computeReassignedFrames(int nibegin, int niend) {
+    const STFTParameters& params = *(m_job->params);
+    const std::vector<WAVTYPE>* wav = m_job->wav;
+    int stepsize = params.stepsize;
+    int dftlen = params.dftlen;
+    int dftsize = dftlen/2+1;
+    int winlen = int(params.win.size());
+    int wavsize = int(wav->size());
+    qreal gain = m_job->gain;
+    int margin = m_job->reassignmargin;
+
+    // The energies are first accumulated locally, on the frames which can receive them
+    int fibegin = std::max(0, nibegin-margin);
+    int fiend = std::min(m_job->stftlen, niend+margin);
+    m_accum.assign(size_t(fiend-fibegin)*dftsize, 0.0);
+
+    for(int ni=nibegin; ni<niend && !gMW->ui->pbSTFTComputingCancel->isChecked(); ++ni){
+        int si = m_job->minsi + ni;
+
+        // The part of the window which overlaps the samples
+        qint64 wstart = qint64(si)*stepsize - m_job->snddelay;
+        int n0 = int(std::min(qint64(winlen), std::max(qint64(0), -wstart)));
+        int n1 = int(std::max(qint64(n0), std::min(qint64(winlen), wavsize-wstart)));
+        bool hasnonzerovalues = false;
+        for(int n=n0; n<n1; ++n){
+            WAVTYPE value = gain*(*wav)[wstart+n];
+            value = std::min(std::max(value, WAVTYPE(-1.0)), WAVTYPE(1.0));
+            m_frame[n] = value;
+            hasnonzerovalues |= (std::abs(value)>0.0);
+        }
+        if(!hasnonzerovalues)
+            continue;
+
+        dft(params.win, n0, n1, m_xh);
+        dft(m_job->wint, n0, n1, m_xth);
+        dft(m_job->wind, n0, n1, m_xdh);
+
+        for(int k=0; k<dftsize; ++k){
+            FFTTYPE energy = std::norm(m_xh[k]);
+            if(!(energy>0.0))
+                continue;
+
+            std::complex<FFTTYPE> xhconj = std::conj(m_xh[k]);
+            FFTTYPE tshift = std::real(m_xth[k]*xhconj)/(energy*stepsize);         // [frames]
+            FFTTYPE fshift = -std::imag(m_xdh[k]*xhconj)*dftlen/(energy*2*M_PI);   // [bins]
+            // Drop the energies sent out of the window (too weak to be reliable)
+            if(!(std::abs(tshift)<=margin) || !(std::abs(fshift)<dftsize))
+                continue;
+
+            int fi = ni + int(std::floor(tshift+0.5));
+            int ki = k + int(std::floor(fshift+0.5));
+            if(fi<fibegin || fi>=fiend || ki<0 || ki>=dftsize)
+                continue;
+
+            m_accum[size_t(fi-fibegin)*dftsize+ki] += energy;
+        }
+    }
+
+    // Add them to the STFT
+    QMutexLocker locker(&(m_job->mutex_reassign));
+    WAVTYPE* stftpa = m_job->stftpa+size_t(fibegin)*dftsize;
+    for(size_t n=0; n<m_accum.size(); ++n)
+        stftpa[n] += m_accum[n];
+}
+
+// The amplified signal is clipped in [-1,1] before the constant-Q transform
+static inline WAVTYPE cqt_clip(WAVTYPE value){
+    return std::min(std::max(value, WAVTYPE(-1.0)), WAVTYPE(1.0));
+}
+
+// Constant-Q transform [Brown & Puckette 1992]: the sparse spectral kernels of an octave
+// are applied to the DFT of each octave's (decimated) signal.
+void STFTComputeThread::FramesWorker::computeCQTFrames(int nibegin, int niend, FFTTYPE& chunkmin, FFTTYPE& chunkmax) {
+    const STFTParameters& params = *(m_job->params);
+    int nbbinsperoctave = params.cqtbinsperoctave;
+    int nboctaves = m_job->cqtnboctaves;
+    int nbbins = nboctaves*nbbinsperoctave;
+    int cqtlen = m_job->cqtlen;
+    int stepsize = params.stepsize;
+    int winlen = int(params.win.size());
+    const int* kernelbegins = &(m_job->cqtkernelbegins[0]);
+    const int* kernelbins = &(m_job->cqtkernelbins[0]);
+    const std::complex<FFTTYPE>* kernels = &(m_job->cqtkernels[0]);
+    std::vector<FFTTYPE>& values = m_values;
+
+    for(int ni=nibegin; ni<niend && !gMW->ui->pbSTFTComputingCancel->isChecked(); ++ni){
+        int si = m_job->minsi + ni;
+        // Centered like the frames of the STFT
+        double center = double(qint64(si)*stepsize - m_job->snddelay) + (winlen-1)/2.0;
+        WAVTYPE* stftfrpa = m_job->stftpa+size_t(ni)*nbbins;
+
+        for(int o=0; o<nboctaves; ++o){
+            const std::vector<WAVTYPE>& wav = (o==0)?*(m_job->wav):m_job->cqtwavs[o];
+            int wavsize = int(wav.size());
+            WAVTYPE* octpa = stftfrpa+(nboctaves-1-o)*nbbinsperoctave; // From the lowest frequency
+            FFTTYPE* in = &(m_fft->in[0]);
+
+            qint64 wstart = qint64(std::floor(center/(1<<o)+0.5)) - cqtlen/2;
+            int n0 = int(std::min(qint64(cqtlen), std::max(qint64(0), -wstart)));
+            int n1 = int(std::max(qint64(n0), std::min(qint64(cqtlen), wavsize-wstart)));
+            int n = 0;
+            for(; n<n0; ++n)
+                in[n] = 0.0;
+            bool hasnonzerovalues = false;
+            if(o==0){
+                for(; n<n1; ++n){
+                    in[n] = cqt_clip(m_job->gain*wav[wstart+n]);
+                    hasnonzerovalues |= (std::abs(in[n])>0.0);
+                }
+            }
+            else{
+                for(; n<n1; ++n){
+                    in[n] = wav[wstart+n];
+                    hasnonzerovalues |= (std::abs(in[n])>0.0);
+                }
+            }
+            for(; n<cqtlen; ++n)
+                in[n] = 0.0;
+
+            if(!hasnonzerovalues){
+                for(int k=0; k<nbbinsperoctave; ++k)
+                    octpa[k] = -std::numeric_limits<FFTTYPE>::infinity();
+                continue;
+            }
+
+            m_fft->execute(false);
+
+            m_xh[0] = std::complex<FFTTYPE>(m_fft->getDCOutput());
+            for(n=1; n<cqtlen/2; ++n)
+                m_xh[n] = m_fft->getMidOutput(n);
+            m_xh[cqtlen/2] = std::complex<FFTTYPE>(m_fft->getNyquistOutput());
+
+            for(int k=0; k<nbbinsperoctave; ++k){
+                std::complex<FFTTYPE> cq = 0.0;
+                for(int ki=kernelbegins[k]; ki<kernelbegins[k+1]; ++ki)
+                    cq += m_xh[kernelbins[ki]]*kernels[ki];
+                values[k] = 0.5*std::log(std::norm(cq));
+            }
+            stft_frame_db(&(values[0]), nbbinsperoctave, octpa, chunkmin, chunkmax);
+        }
+    }
+}
+
+// Decimate by 2 with a zero-phase half-band filter (dec[m] is at wav[2m])
+// If clip, the samples are first amplified by gain and clipped, as for the first octave.
+static void cqt_decimate(const std::vector<WAVTYPE>& wav, bool clip, qreal gain, const std::vector<FFTTYPE>& halfband, std::vector<WAVTYPE>& dec){
+    int order = int(halfband.size()-1)/2;
+    int wavsize = int(wav.size());
+    dec.resize((wavsize+1)/2);
+    for(int m=0; m<int(dec.size()); ++m){
+        int c = 2*m;
+        FFTTYPE value = halfband[order]*(clip?cqt_clip(gain*wav[c]):wav[c]);
+        // Only the odd taps are non-zero
+        for(int d=1; d<=order; d+=2){
+            FFTTYPE pair = 0.0;
+            if(c-d>=0)
+                pair += clip?cqt_clip(gain*wav[c-d]):wav[c-d];
+            if(c+d<wavsize)
+                pair += clip?cqt_clip(gain*wav[c+d]):wav[c+d];
+            value += halfband[order+d]*pair;
+        }
+        dec[m] = value;
+    }
+}
+
+// Max-pool the STFT over time by factors 2, 4, 8, ...
+// until a level fits in a single tile.
+static void stft_build_pyramid(const WAVTYPE* stftpa, int stftlen, int dftsize, std::vector<std::vector<WAVTYPE> >& pyramid){
+    int nblevels = 0;
+    for(int len=stftlen; len>STFTTILESIZE; len=(len+1)/2)
+        nblevels++;
+    pyramid.clear();
+    pyramid.resize(nblevels);
+
+    const WAVTYPE* prevpa = stftpa;
+    int prevlen = stftlen;
+    for(int l=0; l<nblevels && !gMW->ui->pbSTFTComputingCancel->isChecked(); ++l){
+        int len = (prevlen+1)/2;
+        pyramid[l].resize(size_t(len)*dftsize);
+        WAVTYPE* levelpa = &(pyramid[l][0]);
+        for(int si=0; si<len; ++si){
+            const WAVTYPE* pa = prevpa+size_t(2*si)*dftsize;
+            WAVTYPE* pl = levelpa+size_t(si)*dftsize;
+            if(2*si+1<prevlen){
+                const WAVTYPE* pb = pa+dftsize;
+                for(int n=0; n<dftsize; ++n)
+                    pl[n] = std::max(pa[n], pb[n]);
+            }
+            else{
+                for(int n=0; n<dftsize; ++n)
+                    pl[n] = pa[n];
+            }
+        }
+        prevpa = levelpa;
+        prevlen = len;
+    }
+}
+
+// Renders one tile of the image of a sound from its STFT
+class STFTComputeThread::TileWorker : public QRunnable {
+public:
+    STFTComputeThread* m_thread;
+    FTSound* m_snd;
+    STFTImageTiles::Key m_key;
+    int m_generation;
+
+    TileWorker(STFTComputeThread* thread, FTSound* snd, const STFTImageTiles::Key& key, int generation)
+        : m_thread(thread)
+        , m_snd(snd)
+        , m_key(key)
+        , m_generation(generation)
+    {}
+    ~TileWorker(){
+        // In case it has been removed from the queue before running
+        m_snd->m_stfttiles.release(m_key);
+    }
+
+    void run();
+};
+
+void STFTComputeThread::TileWorker::run() {
+    STFTImageTiles::Setup setup = m_snd->m_stfttiles.getSetup();
+    if(setup.generation!=m_generation || setup.isEmpty())
+        return;
+
+    QSize size = setup.tileSize(m_key);
+    QImage img(size.transposed(), setup.params.indexedcolors?QImage::Format_Indexed8:QImage::Format_ARGB32); // One scanline per column, see STFTImageTiles
+    if(img.isNull())
+        return;
+
+    int tstep = 1<<m_key.tlevel;
+
+    m_thread->m_lock_changingstft.lockForRead(); // The other tiles can be rendered meanwhile
+
+    // Render only if the STFT still corresponds to the image parameters
+    if(m_snd->m_stftpa==NULL || m_snd->m_stftparams!=setup.params.stftparams){
+        m_thread->m_lock_changingstft.unlock();
+        return;
+    }
+
+    // Use the pyramid level corresponding to the zoom level, if available
+    const WAVTYPE* levelpa = m_snd->m_stftpa;
+    int levelstep = tstep;
+    if(m_key.tlevel>0 && m_key.tlevel<=int(m_snd->m_stftpyramid.size())){
+        levelpa = &(m_snd->m_stftpyramid[m_key.tlevel-1][0]);
+        levelstep = 1;
+    }
+
+    STFTImageTiles::render(setup, m_key, levelpa, levelstep, img);
+
+    m_thread->m_lock_changingstft.unlock();
+
+    m_snd->m_stfttiles.insert(m_generation, m_key, img);
+
+    emit m_thread->stftTileRendered();
+}
+
 STFTComputeThread::STFTComputeThread(QObject* parent)
     : QThread(parent)
 {
-    m_fft = new qae::FFTwrapper();
+    // One worker per core, each one using its own FFT transformer
+    m_workers = new QThreadPool(this);
+    m_workers->setMaxThreadCount(std::max(1, QThread::idealThreadCount()));
+    for(int wi=0; wi<m_workers->maxThreadCount(); ++wi)
+        m_ffts.push_back(new qae::FFTwrapper());
+
+    m_tilesworkers = new QThreadPool(this);
 //    setPriority(QThread::IdlePriority);
 }
 
@@ -85,6 +672,9 @@ void STFTComputeThread::compute(ImageParameters reqImgSTFTParams) {
         return; // TODO
 //        throw QString("Sound is empty");
 
+    if(reqImgSTFTParams.stftparams.snd->isLoading())
+        return; // It will be requested again once the sound is loaded
+
     m_mutex_changingparams.lock();
 
 //    DCOUT << "STFTComputeThread::compute winlen=" << reqImgSTFTParams.stftparams.win.size() << " stepsize=" << reqImgSTFTParams.stftparams.stepsize << " dftlen=" << reqImgSTFTParams.stftparams.dftlen << std::endl;
@@ -98,6 +688,16 @@ void STFTComputeThread::compute(ImageParameters reqImgSTFTParams) {
     if(m_mutex_computing.tryLock()) {
         // Currently not computing, so start it!
 
+        if(!reqImgSTFTParams.stftparams.computestft){
+            // Only the colors change, this is quick enough without the thread
+            // (the tiles are then rendered in parallel by the tiles' workers)
+            m_mutex_changingparams.unlock();
+            updateImage(reqImgSTFTParams);
+            m_mutex_computing.unlock();
+            emit stftComputingStateChanged(SCSFinished);
+            return;
+        }
+
         gMW->ui->pbSTFTComputingCancel->setChecked(false);
         gMW->ui->pbSTFTComputingCancel->show();
         gMW->ui->pbSpectrogramSTFTUpdate->hide();
@@ -120,210 +720,479 @@ void STFTComputeThread::compute(ImageParameters reqImgSTFTParams) {
 //    DCOUT << "STFTComputeThread::~compute" << std::endl;
 }
 
+void STFTComputeThread::updateImage(const ImageParameters& params) {
+    FTSound* snd = params.stftparams.snd;
+
+    // Only the tiles' setup is prepared here,
+    // the tiles are then rendered when they are needed for drawing.
+    m_lock_changingstft.lockForRead();
+    if(snd->m_stftts.empty())
+        snd->m_stfttiles.clear();
+    else
+        snd->m_stfttiles.reset(params, snd->m_stftts, snd->m_stft_min, snd->m_stft_max, snd->getColor());
+    m_lock_changingstft.unlock();
+
+    m_mutex_changingparams.lock();
+    snd->m_imgSTFTParams = params;
+    m_mutex_changingparams.unlock();
+}
+
+void STFTComputeThread::renderTile(FTSound* snd, int tlevel, int flevel, int ti, int fi, int priority) {
+    STFTImageTiles::Key key(tlevel, flevel, ti, fi);
+
+    if(!snd->m_stfttiles.request(key))
+        return; // Already there or in preparation
+
+    m_tilesworkers->start(new TileWorker(this, snd, key, snd->m_stfttiles.getSetup().generation), priority);
+}
+
 STFTComputeThread::~STFTComputeThread(){
-    delete m_fft;
+    m_tilesworkers->clear();
+    m_tilesworkers->waitForDone();
+    m_workers->waitForDone();
+    for(size_t wi=0; wi<m_ffts.size(); ++wi)
+        delete m_ffts[wi];
+}
+
+int STFTComputeThread::prepareFrames(const STFTParameters& params, std::vector<FFTTYPE>& stftts) {
+    FTSound* snd = params.snd;
+    int stepsize = params.stepsize;
+    int winlen = int(params.win.size());
+
+    int maxsampleindex = int(snd->wav.size())-1 + int(params.delay);
+    maxsampleindex = std::min(maxsampleindex, int(gFL->getFs()*gFL->getMaxLastSampleTime()));
+
+    int minsampleindex = int(params.delay);
+    minsampleindex = std::max(minsampleindex, 0);
+    int minsi = int(minsampleindex/stepsize);
+
+    int stftlen = 0;
+    for(int si=minsi; int(si*stepsize)<maxsampleindex; ++si)
+        stftlen++;
+    stftts.resize(stftlen);
+    int stfttsi = 0;
+    for(int si=minsi; int(si*stepsize)<maxsampleindex; ++si){
+        stftts[stfttsi] = (si*stepsize+(winlen-1)/2.0)/snd->fs;
+        stfttsi++;
+    }
+
+    return minsi;
+}
+
+void STFTComputeThread::runFramesJob(FramesJob& job, FFTTYPE& stftmin, FFTTYPE& stftmax) {
+
+    // Split the frames in chunks, which are then distributed among the workers
+    job.gain = job.params->ampscale;
+    job.snddelay = job.params->delay;
+    job.chunksize = std::max(1, std::min(256, job.nbframes/(4*int(m_ffts.size()))));
+    job.nbchunks = (job.nbframes+job.chunksize-1)/job.chunksize;
+    job.chunk_next.store(0);
+    job.frames_done.store(0);
+    job.memoryfull.store(0);
+
+    // Prepare the lifter
+    job.lifterdct = false;
+    job.liftercos.clear();
+    int cepliftorder = job.params->cepliftorder;
+    if(cepliftorder>0){
+        int dftlen = job.params->dftlen;
+        int dftsize = dftlen/2+1;
+        job.lifterwin = WindowCache::get(WindowCache::WTHamming, cepliftorder*2+1);
+
+        // The truncated DCT needs ~2*cepliftorder*dftsize multiply-adds per frame,
+        // whereas the two FFTs need ~5*dftlen*log2(dftlen) operations.
+        // Its cosines are also limited in memory.
+        job.lifterdct = cepliftorder<dftlen/2
+                        && 2.0*cepliftorder*dftsize < 5.0*dftlen*std::log(double(dftlen))/std::log(2.0)
+                        && qint64(cepliftorder)*dftsize*qint64(sizeof(FFTTYPE)) < qint64(64)*1024*1024;
+        if(job.lifterdct){
+            job.liftercos.resize(size_t(cepliftorder)*dftsize);
+            for(int cci=1; cci<1+cepliftorder; ++cci)
+                for(int n=0; n<dftsize; ++n)
+                    job.liftercos[size_t(cci-1)*dftsize+n] = std::cos((2.0*M_PI*((qint64(cci)*n)%dftlen))/dftlen);
+        }
+    }
+
+    // Prepare the reassignment
+    if(job.params->reassigned){
+        const std::vector<FFTTYPE>& win = job.params->win;
+        int winlen = int(win.size());
+        FFTTYPE center = (winlen-1)/2.0;
+        job.wint.resize(winlen);
+        job.wind.resize(winlen);
+        for(int n=0; n<winlen; ++n){
+            job.wint[n] = (n-center)*win[n];
+            job.wind[n] = 0.5*(((n+1<winlen)?win[n+1]:0.0) - ((n>0)?win[n-1]:0.0));
+        }
+        job.reassignmargin = (winlen/2)/job.params->stepsize+1;
+
+        std::fill(job.stftpa, job.stftpa+size_t(job.stftlen)*(job.params->dftlen/2+1), WAVTYPE(0.0));
+    }
+
+    // Prepare the constant-Q transform
+    if(job.params->isCQT()){
+        int fs = job.params->snd->fs;
+        int nbbinsperoctave = job.params->cqtbinsperoctave;
+        job.cqtnboctaves = job.params->cqtNbOctaves();
+        job.cqtlen = job.params->cqtDFTLength();
+        int cqtlen = job.cqtlen;
+        FFTTYPE Q = 1.0/(std::pow(2.0, 1.0/nbbinsperoctave)-1.0);
+
+        // The temporal kernels are centered in the DFT's frame
+        // and their DFTs are computed from their real and imaginary parts.
+        // (the negative frequencies are dropped, they are almost zero)
+        qae::FFTwrapper* fft = m_ffts[0];
+        std::vector<std::complex<FFTTYPE> > spec(cqtlen/2+1);
+        job.cqtkernelbegins.assign(1, 0);
+        job.cqtkernelbins.clear();
+        job.cqtkernels.clear();
+        for(int k=0; k<nbbinsperoctave; ++k){
+            FFTTYPE relfreq = job.params->cqtfmin*std::pow(2.0, job.cqtnboctaves-1+double(k)/nbbinsperoctave)/fs;
+            int winlen = std::min(cqtlen-1, int(std::ceil(Q/relfreq)));
+            winlen += 1-winlen%2;
+            std::vector<FFTTYPE> win = qae::hann(winlen);
+            FFTTYPE winsum = 0.0;
+            for(int n=0; n<winlen; ++n)
+                winsum += win[n];
+
+            spec.assign(cqtlen/2+1, 0.0);
+            for(int part=0; part<2; ++part){
+                FFTTYPE* in = &(fft->in[0]);
+                for(int n=0; n<cqtlen; ++n)
+                    in[n] = 0.0;
+                for(int n=0; n<winlen; ++n){
+                    int t = n-(winlen-1)/2;
+                    FFTTYPE phase = 2.0*M_PI*relfreq*t;
+                    in[cqtlen/2+t] = (win[n]/winsum)*((part==0)?std::cos(phase):std::sin(phase));
+                }
+                fft->execute(false);
+
+                std::complex<FFTTYPE> factor = (part==0)?std::complex<FFTTYPE>(1.0, 0.0):std::complex<FFTTYPE>(0.0, 1.0);
+                spec[0] += factor*std::complex<FFTTYPE>(fft->getDCOutput());
+                for(int n=1; n<cqtlen/2; ++n)
+                    spec[n] += factor*std::complex<FFTTYPE>(fft->getMidOutput(n));
+                spec[cqtlen/2] += factor*std::complex<FFTTYPE>(fft->getNyquistOutput());
+            }
+
+            FFTTYPE specmax = 0.0;
+            for(int n=0; n<=cqtlen/2; ++n)
+                specmax = std::max(specmax, std::abs(spec[n]));
+            for(int n=0; n<=cqtlen/2; ++n){
+                if(std::abs(spec[n])>STFTCQTKERNELTHRESHOLD*specmax){
+                    job.cqtkernelbins.push_back(n);
+                    job.cqtkernels.push_back(std::conj(spec[n])/FFTTYPE(cqtlen));
+                }
+            }
+            job.cqtkernelbegins.push_back(int(job.cqtkernelbins.size()));
+        }
+
+        // The clipped signal and its decimated versions
+        std::vector<FFTTYPE> halfband = qae::blackman(2*STFTCQTDECIMORDER+1);
+        FFTTYPE halfbandsum = 0.0;
+        for(int d=-STFTCQTDECIMORDER; d<=STFTCQTDECIMORDER; ++d){
+            if(d!=0)
+                halfband[STFTCQTDECIMORDER+d] *= std::sin(0.5*M_PI*d)/(M_PI*d);
+            else
+                halfband[STFTCQTDECIMORDER] *= 0.5;
+            halfbandsum += halfband[STFTCQTDECIMORDER+d];
+        }
+        for(size_t n=0; n<halfband.size(); ++n)
+            halfband[n] /= halfbandsum;
+
+        job.cqtwavs.resize(job.cqtnboctaves);
+        for(int o=1; o<job.cqtnboctaves && !gMW->ui->pbSTFTComputingCancel->isChecked(); ++o){
+            if(o==1)
+                cqt_decimate(*(job.wav), true, job.gain, halfband, job.cqtwavs[1]);
+            else
+                cqt_decimate(job.cqtwavs[o-1], false, 1.0, halfband, job.cqtwavs[o]);
+        }
+    }
+
+    std::vector<FramesWorker*> workers;
+    for(size_t wi=0; wi<m_ffts.size(); ++wi){
+        workers.push_back(new FramesWorker(&job, m_ffts[wi]));
+        m_workers->start(workers.back());
+    }
+    while(!m_workers->waitForDone(100))
+        emit stftProgressing(int((100.0*job.frames_done.load())/std::max(1,job.nbframes)));
+
+    // Merge the min and max of all workers
+    for(size_t wi=0; wi<workers.size(); ++wi){
+        stftmin = std::min(stftmin, workers[wi]->m_stftmin);
+        stftmax = std::max(stftmax, workers[wi]->m_stftmax);
+        delete workers[wi];
+    }
+    if(job.memoryfull.load())
+        throw std::bad_alloc();
+
+    // Convert the reassigned energies to [dB]
+    if(job.params->reassigned && !gMW->ui->pbSTFTComputingCancel->isChecked()){
+        int dftsize = job.params->dftlen/2+1;
+        for(int ni=0; ni<job.stftlen; ++ni){
+            WAVTYPE* stftfrpa = job.stftpa+size_t(ni)*dftsize;
+            for(int n=0; n<dftsize; ++n){
+                FFTTYPE value = 10.0*std::log10(FFTTYPE(stftfrpa[n]));
+                stftfrpa[n] = value;
+
+                // Do not consider Inf values as well as DC and Nyquist (Too easy to degenerate)
+                if(n!=0 && n!=dftsize-1 && !qIsInf(value)) {
+                    stftmin = std::min(stftmin, value);
+                    stftmax = std::max(stftmax, value);
+                }
+            }
+        }
+    }
+}
+
+bool STFTComputeThread::isUpdatable(const STFTParameters& prevparams, const STFTParameters& params) {
+    if(prevparams.isEmpty())
+        return false;
+
+    // Everything but the gain and the delay has to be the same
+    STFTParameters sameparams = prevparams;
+    sameparams.ampscale = params.ampscale;
+    sameparams.delay = params.delay;
+    if(sameparams!=params)
+        return false;
+
+    // The energy of a reassigned frame spreads over its neighbors
+    if(params.reassigned)
+        return false;
+
+    // The constant-Q transform is computed from the clipped signal
+    if(params.isCQT())
+        return false;
+
+    // A null gain cannot be compensated
+    if(prevparams.ampscale==0.0 || params.ampscale==0.0)
+        return false;
+
+    // The delay has to shift the signal by whole frames
+    if((params.delay-prevparams.delay)%params.stepsize!=0)
+        return false;
+
+    return true;
+}
+
+bool STFTComputeThread::updateSTFT(const STFTParameters& params, const STFTParameters& prevparams, int& stftlen, FFTTYPE& stftmin, FFTTYPE& stftmax) {
+    FTSound* snd = params.snd;
+    const std::vector<WAVTYPE>& wav = snd->wav;
+    int stepsize = params.stepsize;
+    int winlen = int(params.win.size());
+    int dftsize = params.dftlen/2+1;
+
+    // The new frames, the previous STFT is kept until the new one is ready
+    std::vector<FFTTYPE> stftts;
+    int minsi = prepareFrames(params, stftts);
+    stftlen = int(stftts.size());
+    WAVTYPE* stftpa = new WAVTYPE[size_t(stftlen)*dftsize];
+
+    int prevminsi = int(std::max(prevparams.delay, qint64(0))/stepsize);
+    int prevstftlen = int(snd->m_stftts.size());
+    int shift = int((params.delay-prevparams.delay)/stepsize); // [frames]
+
+    // The gain is a constant in the log domain,
+    // unless the DC of the cepstrum is removed by the liftering
+    FFTTYPE offset = 0.0;
+    if(params.cepliftorder<=0 || params.cepliftpresdc)
+        offset = qae::mag2db(std::abs(params.ampscale/prevparams.ampscale));
+
+    // The frames without previous counterpart need to be computed ...
+    std::vector<bool> tocompute(stftlen, false);
+    for(int ni=0; ni<stftlen; ++ni){
+        int prevni = minsi+ni-shift-prevminsi;
+        if(prevni<0 || prevni>=prevstftlen)
+            tocompute[ni] = true;
+    }
+    // ... as well as the frames containing samples which are clipped with either gain
+    qreal maxgain = std::max(std::abs(params.ampscale), std::abs(prevparams.ampscale));
+    for(int wn=0; wn<int(wav.size()); ++wn){
+        if(std::abs(wav[wn])*maxgain>1.0){
+            // The frames si such that si*stepsize-delay <= wn < si*stepsize-delay+winlen
+            int sibegin = int(std::ceil(double(wn+params.delay-winlen+1)/stepsize));
+            int siend = int(std::floor(double(wn+params.delay)/stepsize));
+            for(int ni=std::max(0, sibegin-minsi); ni<=siend-minsi && ni<stftlen; ++ni)
+                tocompute[ni] = true;
+        }
+    }
+
+    // Shift the other frames and add the gain offset
+    std::vector<int> frames;
+    for(int ni=0; ni<stftlen && !gMW->ui->pbSTFTComputingCancel->isChecked(); ++ni){
+        if(tocompute[ni]){
+            frames.push_back(ni);
+        }
+        else{
+            const WAVTYPE* prevfrpa = snd->m_stftpa+size_t(minsi+ni-shift-prevminsi)*dftsize;
+            WAVTYPE* stftfrpa = stftpa+size_t(ni)*dftsize;
+            for(int n=0; n<dftsize; ++n){
+                FFTTYPE value = prevfrpa[n]+offset;
+                stftfrpa[n] = value;
+
+                // Do not consider Inf values as well as DC and Nyquist (Too easy to degenerate)
+                if(n!=0 && n!=dftsize-1 && !qIsInf(value)) {
+                    stftmin = std::min(stftmin, value);
+                    stftmax = std::max(stftmax, value);
+                }
+            }
+        }
+    }
+
+    try{
+        if(!frames.empty() && !gMW->ui->pbSTFTComputingCancel->isChecked()){
+            // Get the FFT plans of this size (prepared only if not used recently)
+            for(size_t wi=0; wi<m_ffts.size(); ++wi)
+                FFTPlanPool::exchange(m_ffts[wi], params.dftlen);
+
+            FramesJob job;
+            job.params = &params;
+            job.wav = &wav;
+            job.stftpa = stftpa;
+            job.minsi = minsi;
+            job.stftlen = stftlen;
+            job.frames = &frames;
+            job.nbframes = int(frames.size());
+            runFramesJob(job, stftmin, stftmax);
+        }
+    }
+    catch(std::bad_alloc err){
+        delete[] stftpa;
+        throw;
+    }
+
+    if(gMW->ui->pbSTFTComputingCancel->isChecked()){
+        delete[] stftpa;
+        return false;
+    }
+
+    // Replace the previous STFT
+    m_mutex_changingparams.lock();
+    m_lock_changingstft.lockForWrite();
+    snd->m_stftparams.clear();
+    snd->m_stftpyramid.clear();
+    snd->deleteSTFT();
+    snd->m_stftpa = stftpa;
+    snd->m_stftts.swap(stftts);
+    m_lock_changingstft.unlock();
+    m_mutex_changingparams.unlock();
+
+    return true;
 }
 
 void STFTComputeThread::run() {
 //    DCOUT << "STFTComputeThread::run" << std::endl;
 
-    // Prepare some usefull variables
-//    std::vector<WAVTYPE>::iterator pstft;
-    WAVTYPE* pstft;
-
     bool canceled = false;
     do{
         m_mutex_changingparams.lock();
         ImageParameters params_running = m_params_current;
         m_mutex_changingparams.unlock();
 
+        bool keptprevious = false; // An update has been canceled before replacing the previous STFT
+
         try{
-            int stepsize = params_running.stftparams.stepsize;
-            int dftlen = params_running.stftparams.dftlen;
-            int dftsize = int(params_running.stftparams.dftlen/2+1);
+            int dftsize = params_running.stftparams.nbBins();
             WAVTYPE* &stftpa = params_running.stftparams.snd->m_stftpa;
-            WAVTYPE* stftfrpa = NULL; // Pointer to a single frame
 
             // If asked, update the STFT
             if(params_running.stftparams.computestft){
                 emit stftComputingStateChanged(SCSDFT);
 
-                m_fft->resize(params_running.stftparams.dftlen);
-
-                m_mutex_changingstft.lock();
-
-                std::vector<FFTTYPE>& win = params_running.stftparams.win;
-                int winlen = int(win.size());
-                int fs = params_running.stftparams.snd->fs;
+                FTSound* snd = params_running.stftparams.snd;
+                int stftlen = 0;
                 FFTTYPE stftmin = std::numeric_limits<FFTTYPE>::infinity();
                 FFTTYPE stftmax = -std::numeric_limits<FFTTYPE>::infinity();
-                qreal gain = params_running.stftparams.ampscale;
-                qint64 snddelay = params_running.stftparams.snd->m_giWavForWaveform->delay();
-                std::vector<FFTTYPE>& stftts = params_running.stftparams.snd->m_stftts;
-                std::vector<WAVTYPE>* wav = &params_running.stftparams.snd->wav;
-
-                int maxsampleindex = int(wav->size())-1 + int(params_running.stftparams.snd->m_giWavForWaveform->delay());
-                maxsampleindex = std::min(maxsampleindex, int(gFL->getFs()*gFL->getMaxLastSampleTime()));
+                QString cachekey;
+                bool fromcache = false;
 
-                int minsampleindex = int(params_running.stftparams.snd->m_giWavForWaveform->delay());
-                minsampleindex = std::max(minsampleindex, 0);
-                int minsi = int(minsampleindex/stepsize);
+                m_mutex_changingparams.lock();
+                STFTParameters prevparams = snd->m_stftparams;
+                m_mutex_changingparams.unlock();
 
-                // Allocate everything
-                int stftlen = 0;
-                for(int si=minsi; int(si*stepsize)<maxsampleindex; ++si)
-                    stftlen++;
-                stftts.resize(stftlen);
-                int stfttsi = 0;
-                for(int si=minsi; int(si*stepsize)<maxsampleindex; ++si){
-                    stftts[stfttsi] = (si*stepsize+(winlen-1)/2.0)/fs;
-                    stfttsi++;
+                bool updated = false;
+                if(stftpa!=NULL && isUpdatable(prevparams, params_running.stftparams)){
+                    // Only the gain and/or the delay changed, the previous STFT can be updated
+                    updated = updateSTFT(params_running.stftparams, prevparams, stftlen, stftmin, stftmax);
+                    keptprevious = !updated;
                 }
-                if(stftpa)
-                    delete stftpa;
-                // Allocate it at once, to be sure the OS will reject it if it's too big
-                // (Linux tends to overcommit small memory allocations,
-                //  and ends up killing the app when it understands, too late,
-                //  that it doesn't have the memory)
-                stftpa = new WAVTYPE[stftlen*dftsize];
-                m_mutex_changingstft.unlock();
-
-                WAVTYPE value;
-                int ni=0;
-                for(int si=minsi; int(si*stepsize)<maxsampleindex && !gMW->ui->pbSTFTComputingCancel->isChecked(); ++si){
-
-                    // Set the DFT's input
-                    int n = 0;
-                    int wn = 0;
-                    bool hasnonzerovalues = false;
-                    for(; n<int(win.size()); ++n){
-                        wn = si*stepsize+n - snddelay;
-                        value = 0.0;
-                        if(wn>=0 && wn<int(wav->size())) {
-                            value = gain*(*(wav))[wn];
-
-                            if(value>1.0)       value = 1.0;
-                            else if(value<-1.0) value = -1.0;
-
-                            value *= win[n];
-
-                            if(std::abs(value)>0.0)
-                                hasnonzerovalues = true;
-                        }
-                        m_fft->setInput(n, value);
-                    }
+                else{
+                    // The hash of the samples is necessary for looking up the STFT in the cache
+                    if(STFTCache::isEnabled() && snd->m_wavhash.isEmpty())
+                        snd->m_wavhash = STFTCache::hashWav(snd->wav);
 
-                    if(hasnonzerovalues){
-                        // Zero-pad the DFT's input
-                        for(; n<dftlen; ++n)
-                            m_fft->setInput(n, 0.0);
-
-                        m_fft->execute(false); // Compute the DFT
-
-                        // Retrieve DFT's output
-                        stftfrpa = stftpa+ni*dftsize;
-                        *stftfrpa = std::log(std::abs(m_fft->getDCOutput()));
-                        stftfrpa++;
-                        for(n=1; n<dftlen/2; ++n, stftfrpa++)
-                            *stftfrpa = std::log(std::abs(m_fft->getMidOutput(n)));
-                        *stftfrpa = std::log(std::abs(m_fft->getNyquistOutput()));
-
-    //                    for(n=0; n<=m_params_current.stftparams.dftlen/2; n++)
-    //                        m_params_current.stftparams.snd->m_stft[ni][n] = std::log(std::abs(m_fft->out[n]));
-    //                        m_params_current.stftparams.snd->m_stft[ni][n] = std::log(std::abs(m_fft->getMidOutput(n)));
-
-                        if(params_running.stftparams.cepliftorder>0){
-                            // Prepare the window for cepstral smoothing
-                            std::vector<FFTTYPE> win = qae::hamming(params_running.stftparams.cepliftorder*2+1);
-                            std::vector<FFTTYPE> cc;
-                            // First, fix possible Inf amplitudes to avoid ending up with NaNs.
-                            if(qIsInf(stftpa[ni*dftsize+0]))
-                                stftpa[ni*dftsize+0] = stftpa[ni*dftsize+1]; // TOOD Use extrap ??
-                            for(int n=1; n<dftlen/2+1; ++n) {
-                                if(qIsInf(stftpa[ni*dftsize+n]))
-                                    stftpa[ni*dftsize+n] = stftpa[ni*dftsize+n-1]; // TOOD Use extrap ??
-                            }
-//                            // If we need to compute less coefficients than log(N),
-//                            // don't use the FFT, just compute these coefs.
-//                            // Could do: Optimize threshold according to time
-//                            // This is actually slower than computing all the coefs
-//                            // using the FFTW3 ...
-//                            if(params_running.stftparams.cepliftorder<std::log(dftlen)-1){
-//                                // Compute the Fourier coefs manually
-//                                std::vector<WAVTYPE> &frame = (stft[ni]);
-//                                std::vector<double> coses(dftlen/2+1);
-//                                for(int cci=1; cci<1+params_running.stftparams.cepliftorder; ++cci){
-//                                    double cc = frame[0];
-//                                    coses[0] = 1.0;
-//                                    for(int n=1; n<dftlen/2; ++n){
-//                                        coses[n] = cos(2.0*M_PI*cci*n/dftlen);
-//                                        cc += 2*frame[n]*coses[n];
-//                                    }
-//                                    coses[dftlen/2] = cos(M_PI*cci);
-//                                    cc += frame[dftlen/2]*coses[dftlen/2];
-//                                    cc /= dftlen;
-//                                    cc *= 2.0;
-
-//                                    for(int n=0; n<dftlen/2+1; ++n)
-//                                        frame[n] -= (1.0-win[cci-1])*cc*coses[n];
-//                                }
-//                                if(!params_running.stftparams.cepliftpresdc){
-//                                    double ccdc = frame[0];
-//                                    for(int n=1; n<dftlen/2; ++n)
-//                                        ccdc += 2*frame[n];
-//                                    ccdc += frame[dftlen/2];
-//                                    ccdc /= dftlen;
-//                                    for(int n=0; n<dftlen/2+1; ++n)
-//                                        frame[n] -= ccdc;
-//                                }
-//                            }
-//                            else{
-                                std::vector<FFTTYPE> values(stftpa+ni*dftsize, stftpa+ni*dftsize+dftsize);
-                                hspec2rcc(values, m_fft, cc);
-                                for(int cci=1; cci<1+params_running.stftparams.cepliftorder && cci<int(cc.size()); ++cci)
-                                    cc[cci] *= win[cci-1];
-                                if(!params_running.stftparams.cepliftpresdc)
-                                    cc[0] = 0.0;
-                                rcc2hspec(cc, m_fft, values);
-                                for(int n=0; n<dftlen/2+1; n++)
-                                    stftpa[ni*dftsize+n] = values[n];
-//                            }
+                    m_mutex_changingparams.lock();
+                    m_lock_changingstft.lockForWrite();
+
+                    // The STFT is going to be overwritten
+                    // (this also stops the rendering of the image tiles)
+                    snd->m_stftparams.clear();
+                    snd->m_stftpyramid.clear();
+
+                    // Allocate everything
+                    int minsi = prepareFrames(params_running.stftparams, snd->m_stftts);
+                    stftlen = int(snd->m_stftts.size());
+                    snd->deleteSTFT();
+
+                    // Look for it in the cache
+                    if(STFTCache::isEnabled() && !snd->m_wavhash.isEmpty()){
+                        cachekey = STFTCache::key(snd->m_wavhash, params_running.stftparams, minsi, stftlen);
+                        stftpa = STFTCache::map(cachekey, stftlen, dftsize, snd->m_stftfile, stftmin, stftmax);
+                    }
+                    fromcache = (stftpa!=NULL);
+
+                    if(!fromcache){
+                        // Allocate it at once, to be sure the OS will reject it if it's too big
+                        // (Linux tends to overcommit small memory allocations,
+                        //  and ends up killing the app when it understands, too late,
+                        //  that it doesn't have the memory)
+                        try{
+                            stftpa = new WAVTYPE[size_t(stftlen)*dftsize];
                         }
-
-                        // Convert to [dB] and compute min and max magnitudes[dB]
-                        stftfrpa = stftpa+ni*dftsize;
-                        for(n=0; n<dftlen/2+1; n++, stftfrpa++) {
-                            FFTTYPE value = qae::log2db*(*stftfrpa);
-
-                            if(qIsNaN(value))
-                                value = -std::numeric_limits<FFTTYPE>::infinity();
-
-                            *stftfrpa = value;
-
-                            // Do not consider Inf values as well as DC and Nyquist (Too easy to degenerate)
-                            if(n!=0 && n!=dftlen/2 && !qIsInf(value)) {
-                                stftmin = std::min(stftmin, value);
-                                stftmax = std::max(stftmax, value);
-                            }
+                        catch(std::bad_alloc err){
+                            m_lock_changingstft.unlock();
+                            m_mutex_changingparams.unlock();
+                            throw;
                         }
                     }
-                    else{
-                        stftfrpa = stftpa+ni*dftsize;
-                        for(n=0; n<dftsize; n++, stftfrpa++)
-                            *stftfrpa = -std::numeric_limits<FFTTYPE>::infinity();
-                    }
+                    m_lock_changingstft.unlock();
+                    m_mutex_changingparams.unlock();
 
-                    emit stftProgressing(int(100*double(ni*stepsize)/(maxsampleindex-minsampleindex)));
+                    if(!fromcache){
+                        // Get the FFT plans of this size (prepared only if not used recently)
+                        int fftlen = params_running.stftparams.isCQT()?params_running.stftparams.cqtDFTLength():params_running.stftparams.dftlen;
+                        for(size_t wi=0; wi<m_ffts.size(); ++wi)
+                            FFTPlanPool::exchange(m_ffts[wi], fftlen);
+
+                        FramesJob job;
+                        job.params = &(params_running.stftparams);
+                        job.wav = &(snd->wav);
+                        job.stftpa = stftpa;
+                        job.minsi = minsi;
+                        job.stftlen = stftlen;
+                        job.frames = NULL;
+                        job.nbframes = stftlen;
+                        runFramesJob(job, stftmin, stftmax);
+                    }
+                }
 
-                    ni++;
+                // Prepare the zoomed-out levels, to draw long files quickly
+                std::vector<std::vector<WAVTYPE> > pyramid;
+                try{
+                    if(!keptprevious)
+                        stft_build_pyramid(stftpa, stftlen, dftsize, pyramid);
+                }
+                catch(std::bad_alloc err){
+                    pyramid.clear(); // The tiles will be sampled from the STFT itself
                 }
 
-                if(!gMW->ui->pbSTFTComputingCancel->isChecked()){
+                // Once updated, the previous STFT is gone, so keep the new one even if canceled
+                if(updated || !gMW->ui->pbSTFTComputingCancel->isChecked()){
+                    if(gMW->ui->pbSTFTComputingCancel->isChecked())
+                        pyramid.clear(); // Incomplete
+
                     // The STFT is done, update the min & max
                     m_mutex_changingparams.lock();
 
-                    params_running.stftparams.snd->m_stftparams = params_running.stftparams;
-
                     if(qIsInf(stftmin) && qIsInf(stftmax)){
                         stftmax = 0.0; // Default 0dB
                         stftmin = -1.0; // Default -1dB
@@ -333,12 +1202,17 @@ void STFTComputeThread::run() {
                     else if(qIsInf(stftmax))
                         stftmax = stftmin + 1.0;
 
-                    m_mutex_changingstft.lock();
-                    params_running.stftparams.snd->m_stft_min = stftmin;
-                    params_running.stftparams.snd->m_stft_max = stftmax;
-                    m_mutex_changingstft.unlock();
+                    m_lock_changingstft.lockForWrite();
+                    snd->m_stftparams = params_running.stftparams;
+                    snd->m_stftpyramid.swap(pyramid);
+                    snd->m_stft_min = stftmin;
+                    snd->m_stft_max = stftmax;
+                    m_lock_changingstft.unlock();
 
                     m_mutex_changingparams.unlock();
+
+                    if(!fromcache && !cachekey.isEmpty())
+                        STFTCache::store(cachekey, stftpa, stftlen, dftsize, stftmin, stftmax);
                 }
             }
 
@@ -346,103 +1220,17 @@ void STFTComputeThread::run() {
             if(!gMW->ui->pbSTFTComputingCancel->isChecked()){
                 emit stftComputingStateChanged(SCSIMG);
 
-                m_mutex_imageallocation.lock();
-                if(int(params_running.stftparams.snd->m_stftts.size())==0){
-                    m_mutex_imageallocation.unlock();
-                }
-                else{
-                    int stftlen = int(params_running.stftparams.snd->m_stftts.size());
-                    int halfdftlen = params_running.stftparams.dftlen/2;
-                    *(params_running.imgstft) = QImage(stftlen, dftsize, QImage::Format_ARGB32);
-                    m_mutex_imageallocation.unlock();
-                    if(params_running.imgstft->isNull())
-                        throw std::bad_alloc();
-                    bool colormap_reversed = params_running.colormap_reversed;
-
-                    QAEColorMap& cmap = QAEColorMap::getAt(params_running.colormap_index);
-                    cmap.setColor(params_running.stftparams.snd->getColor());
-
-                    QRgb* pimgb = (QRgb*)(params_running.imgstft->bits());
-
-                    FFTTYPE ymin = 0.0; // Init shouldn't be used
-                    FFTTYPE ymax = 1.0; // Init shouldn't be used
-                    if(params_running.colorrangemode==0){
-                        ymin = params_running.stftparams.snd->m_stft_min+(params_running.stftparams.snd->m_stft_max-params_running.stftparams.snd->m_stft_min)*gMW->m_qxtSpectrogramSpanSlider->lowerValue()/100.0;
-                        ymax = params_running.stftparams.snd->m_stft_min+(params_running.stftparams.snd->m_stft_max-params_running.stftparams.snd->m_stft_min)*gMW->m_qxtSpectrogramSpanSlider->upperValue()/100.0;
-                    }
-                    else if(params_running.colorrangemode==1){
-                        ymin = gMW->m_qxtSpectrogramSpanSlider->lowerValue(); // Min of color range [dB]
-                        ymax = gMW->m_qxtSpectrogramSpanSlider->upperValue(); // Max of color range [dB]
-                    }
-
-                    bool uselw = params_running.loudnessweighting;
-                    FFTTYPE divmaxmmin = 1.0/(ymax-ymin);
-        //            QRgb red = qRgb(int(255*1), int(255*0), int(255*0));
-                    QRgb c0 = colormap_reversed?cmap(1.0):cmap(0.0);
-                    QRgb c1 = colormap_reversed?cmap(0.0):cmap(1.0);
-                    FFTTYPE y;
-                    QRgb c;
-                    FFTTYPE v;
-
-                    // Prepare the loudness curve
-                    std::vector<WAVTYPE> elc;
-                    if(uselw) {
-                        elc = std::vector<WAVTYPE>(dftsize, 0.0);
-                        for(size_t u=0; u<elc.size(); ++u) {
-                            elc[u] = -qae::equalloudnesscurvesISO226(params_running.stftparams.snd->fs*double(u)/params_running.stftparams.dftlen, 0);
-                        }
-                    }
-
-                    for(int si=0; si<stftlen && !gMW->ui->pbSTFTComputingCancel->isChecked(); si++, pimgb++){
-                        stftfrpa = stftpa+si*dftsize;
-                        for(int n=0; n<dftsize; n++, pstft++, stftfrpa++) {
-
-                            if(qIsInf(*stftfrpa)){
-                                c = c0;
-                            }
-                            else {
-                                v = *stftfrpa;
-                                if(uselw) v += elc[n]; // Modification according to loudness curve
-                                y = (v-ymin)*divmaxmmin;
-
-                                if(y<=0.0)
-                                    c = c0;
-                                else if(y>=1.0)
-                                    c = c1;
-                                else {
-                                    if(colormap_reversed)
-                                        y = 1.0-y;
-
-                                    c = cmap(y);
-                                }
-                            }
-
-    //                        *(pimgb + n*stftlen) = c;
-                            *(pimgb + (halfdftlen-n)*stftlen) = c; // This one has reversed y
-
-    //                         params_running.imgstft->setPixel(si, n, c); // Bit slower, though can take adv. of hardware optim ?
-                        }
-                        emit stftProgressing((100*si)/stftlen);
-                    }
-
-                    // SampleSize is not always reliable
-        //            m_params_current.stftparams.snd->m_stft_min = std::max(FFTTYPE(-2.0*20*std::log10(std::pow(2.0,m_params_current.stftparams.snd->format().sampleSize()))), m_params_current.stftparams.snd->m_stft_min); Why doing this ??
-        //            COUTD << "Image Spent: " << starttime.elapsed() << std::endl;
-                }
-
-                m_mutex_changingparams.lock();
-                params_running.stftparams.snd->m_imgSTFTParams = m_params_current;
-                m_mutex_changingparams.unlock();
+                updateImage(params_running);
             }
         }
         catch(std::bad_alloc err){
-            m_mutex_changingstft.unlock();
-            m_mutex_changingstft.lock();
+            m_lock_changingstft.lockForWrite();
             params_running.stftparams.snd->m_stftts.clear();
 //            params_running.stftparams.snd->m_stft.clear();
-            delete params_running.stftparams.snd->m_stftpa;
-            params_running.stftparams.snd->m_stftpa = NULL;
-            m_mutex_changingstft.unlock();
+            params_running.stftparams.snd->deleteSTFT();
+            params_running.stftparams.snd->m_stftpyramid.clear();
+            params_running.stftparams.snd->m_stfttiles.clear();
+            m_lock_changingstft.unlock();
 
             emit stftComputingStateChanged(SCSMemoryFull);
             gMW->ui->pbSTFTComputingCancel->setChecked(true);
@@ -451,16 +1239,13 @@ void STFTComputeThread::run() {
         canceled = gMW->ui->pbSTFTComputingCancel->isChecked();
         if(canceled){
             m_mutex_changingparams.lock();
-            if(params_running.stftparams.snd->m_stftparams != params_running.stftparams) {
-                m_mutex_changingstft.lock();
+            if(!keptprevious && params_running.stftparams.snd->m_stftparams != params_running.stftparams) {
+                m_lock_changingstft.lockForWrite();
                 params_running.stftparams.snd->m_stftts.clear();
 //                params_running.stftparams.snd->m_stft.clear();
                 params_running.stftparams.snd->m_stftparams.clear();
-                m_mutex_changingstft.unlock();
-                m_mutex_imageallocation.lock();
-                *(params_running.imgstft) = QImage(1, 1, QImage::Format_ARGB32);
-                params_running.imgstft->fill(Qt::white);
-                m_mutex_imageallocation.unlock();
+                params_running.stftparams.snd->m_stfttiles.clear();
+                m_lock_changingstft.unlock();
             }
             m_mutex_changingparams.unlock();
             gMW->ui->pbSTFTComputingCancel->setChecked(false);
@@ -503,6 +1288,12 @@ void STFTComputeThread::cancelCurrentComputation(bool waittoend) {
 
 void STFTComputeThread::cancelComputation(FTSound* snd, bool closing) {
 //    DCOUT << "STFTComputeThread::cancelComputation" << std::endl;
+    if(closing){
+        // The tile workers might refer to this sound
+        m_tilesworkers->clear();
+        m_tilesworkers->waitForDone();
+    }
+
     // Remove it from the STFT waiting queue
     m_mutex_changingparams.lock();
     if(!m_params_todo.isEmpty()
@@ -23,6 +23,8 @@ file provided in the source code of DFasma. Another copy can be found at
 
 #include <QThread>
 #include <QMutex>
+#include <QReadWriteLock>
+#include <QThreadPool>
 
 #include "qaesigproc.h"
 class FTSound;
@@ -31,7 +33,14 @@ class STFTComputeThread : public QThread
 {
     Q_OBJECT
 
-    qae::FFTwrapper* m_fft;   // The FFT transformer
+    QThreadPool* m_workers;                 // The workers computing the frames' chunks
+    std::vector<qae::FFTwrapper*> m_ffts;   // One FFT transformer per worker
+
+    class FramesJob;
+    class FramesWorker;
+
+    QThreadPool* m_tilesworkers;            // The workers rendering the image tiles
+    class TileWorker;
 
     bool m_computing;
 
@@ -43,9 +52,14 @@ public:
 
     inline bool isComputing() const {return m_computing;}
 
+    // Ask for a tile of the image of a sound (see STFTImageTiles).
+    // Visible tiles should be asked with a higher priority than the prefetched ones.
+    void renderTile(FTSound* snd, int tlevel, int flevel, int ti, int fi, int priority=0);
+
 signals:
     void stftComputingStateChanged(int state);
     void stftProgressing(int);
+    void stftTileRendered();
 
 public slots:
     void cancelCurrentComputation(bool waittoend=false);
@@ -66,6 +80,9 @@ public:
         int dftlen;
         int cepliftorder;
         bool cepliftpresdc;
+        bool reassigned; // Reassigned spectrogram (time and frequency)
+        int cqtbinsperoctave; // Constant-Q transform if >0 (dftlen then sets only the image's resolution)
+        FFTTYPE cqtfmin;      // [Hz] Frequency of the first constant-Q bin
 
         void clear(){
             computestft = true;
@@ -77,12 +94,15 @@ public:
             dftlen = -1;
             cepliftorder = -1;
             cepliftpresdc = false;
+            reassigned = false;
+            cqtbinsperoctave = 0;
+            cqtfmin = 0.0;
         }
 
         STFTParameters(){
             clear();
         }
-        STFTParameters(FTSound* reqnd, const std::vector<FFTTYPE>& reqwin, int reqstepsize, int reqdftlen, int reqcepliftorder, bool reqcepliftpresdc);
+        STFTParameters(FTSound* reqnd, const std::vector<FFTTYPE>& reqwin, int reqstepsize, int reqdftlen, int reqcepliftorder, bool reqcepliftpresdc, bool reqreassigned=false, int reqcqtbinsperoctave=0, FFTTYPE reqcqtfmin=0.0);
 
 //        bool is_stftpart_equal(const Parameters& param) const;
         bool operator==(const STFTParameters& param) const;
@@ -91,18 +111,25 @@ public:
         }
 
         inline bool isEmpty() const {return snd==NULL;}
+
+        inline bool isCQT() const {return cqtbinsperoctave>0;}
+        int nbBins() const;         // The number of values per frame
+        int cqtNbOctaves() const;
+        int cqtDFTLength() const;   // [samples] The DFT length of the constant-Q kernels
+        // The octaves stop below Nyquist, to leave room for the decimation filter
+        static int cqtNbOctaves(int fs, FFTTYPE fmin);
     };
 
     class ImageParameters{
     public:
         STFTParameters stftparams;
-        QImage* imgstft;
         int colormap_index;
         bool colormap_reversed;
         FFTTYPE lower;
         FFTTYPE upper;
         bool loudnessweighting;
         int colorrangemode;
+        bool indexedcolors;     // Store amplitude levels in the image, the colors are in its color table
 
         void clear(){
             stftparams.clear();
@@ -112,28 +139,27 @@ public:
             upper = -1;
             loudnessweighting = false;
             colorrangemode = -1;
+            indexedcolors = false;
         }
 
         ImageParameters(){
             clear();
         }
-        ImageParameters(STFTComputeThread::STFTParameters reqSTFTparams, QImage* reqImgSTFT, int reqcolormap_index, bool reqcolormap_reversed, FFTTYPE reqlower, FFTTYPE requpper, bool reqloudnessweighting, int reqcolorrangemode){
+        ImageParameters(STFTComputeThread::STFTParameters reqSTFTparams, int reqcolormap_index, bool reqcolormap_reversed, FFTTYPE reqlower, FFTTYPE requpper, bool reqloudnessweighting, int reqcolorrangemode, bool reqindexedcolors=false){
             clear();
             stftparams = reqSTFTparams;
-            imgstft = reqImgSTFT;
             colormap_index = reqcolormap_index;
             colormap_reversed = reqcolormap_reversed;
             lower = reqlower;
             upper = requpper;
             loudnessweighting = reqloudnessweighting;
             colorrangemode = reqcolorrangemode;
+            indexedcolors = reqindexedcolors;
         }
 
         bool operator==(const ImageParameters& param){
             if(stftparams!=param.stftparams)
                 return false;
-            if(imgstft!=param.imgstft)
-                return false;
             if(colormap_index!=param.colormap_index)
                 return false;
             if(colormap_reversed!=param.colormap_reversed)
@@ -146,6 +172,8 @@ public:
                 return false;
             if(colorrangemode!=param.colorrangemode)
                 return false;
+            if(indexedcolors!=param.indexedcolors)
+                return false;
 
             return true;
         }
@@ -159,10 +187,21 @@ public:
 
     void compute(ImageParameters reqImgParams);     // Entry point
 
+private:
+    int prepareFrames(const STFTParameters& params, std::vector<FFTTYPE>& stftts); // Return the index of the first frame
+    void runFramesJob(FramesJob& job, FFTTYPE& stftmin, FFTTYPE& stftmax);
+    // If only the gain and/or the delay changed, the previous STFT can be updated
+    static bool isUpdatable(const STFTParameters& prevparams, const STFTParameters& params);
+    // Return false if canceled, then the previous STFT is left untouched
+    bool updateSTFT(const STFTParameters& params, const STFTParameters& prevparams, int& stftlen, FFTTYPE& stftmin, FFTTYPE& stftmax);
+    // Prepare the image of an already computed STFT
+    void updateImage(const ImageParameters& params);
+
+public:
+
     mutable QMutex m_mutex_computing;       // To protect the access to the FFT and external variables
     mutable QMutex m_mutex_changingparams;  // To protect the access to the parameters below
-    mutable QMutex m_mutex_changingstft;    // To protect the access to the STFT (times, values, etc.)
-    mutable QMutex m_mutex_imageallocation; // To protect the access to the image when allocating
+    mutable QReadWriteLock m_lock_changingstft; // To protect the access to the STFT (times, values, etc.), read by the tiles' workers
 
     inline const ImageParameters& getCurrentParameters() const {return m_params_current;}
 
@@ -0,0 +1,446 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "stftimagetiles.h"
+
+#include "ftsound.h"
+
+#include "qaecolormap.h"
+#include "qaesigproc.h"
+
+#include <limits>
+#include <algorithm>
+
+#define STFTTILESNBCOLORS 4096 // Number of colors sampled from the colormap
+#define STFTTILESNBLEVELS 256 // Number of amplitude levels with indexed colors
+#define STFTTILESCQTMAXROWS 65536 // Max number of rows for drawing the constant-Q bins
+
+qint64 STFTImageTiles::s_memorylimit = 256*1024*1024;
+
+bool STFTImageTiles::Key::operator<(const Key& key) const {
+    if(tlevel!=key.tlevel) return tlevel<key.tlevel;
+    if(flevel!=key.flevel) return flevel<key.flevel;
+    if(ti!=key.ti) return ti<key.ti;
+    return fi<key.fi;
+}
+
+bool STFTImageTiles::Key::operator==(const Key& key) const {
+    return tlevel==key.tlevel && flevel==key.flevel && ti==key.ti && fi==key.fi;
+}
+
+STFTImageTiles::Setup::Setup()
+    : generation(0)
+    , t0(0.0)
+    , dt(1.0)
+    , binhz(1.0)
+    , stftlen(0)
+    , dftsize(0)
+    , nbbins(0)
+    , ymin(0.0)
+    , ymax(1.0)
+    , qmin(0.0)
+    , qmax(1.0)
+{
+}
+
+int STFTImageTiles::Setup::nbColumns(int tlevel) const {
+    return (stftlen+(1<<tlevel)-1)>>tlevel;
+}
+int STFTImageTiles::Setup::nbRows(int flevel) const {
+    return (dftsize+(1<<flevel)-1)>>flevel;
+}
+int STFTImageTiles::Setup::nbTilesTime(int tlevel) const {
+    return (nbColumns(tlevel)+STFTTILESIZE-1)/STFTTILESIZE;
+}
+int STFTImageTiles::Setup::nbTilesFreq(int flevel) const {
+    return (nbRows(flevel)+STFTTILESIZE-1)/STFTTILESIZE;
+}
+int STFTImageTiles::Setup::nbLevelsTime() const {
+    int level = 0;
+    while(nbColumns(level)>STFTTILESIZE)
+        level++;
+    return level+1;
+}
+int STFTImageTiles::Setup::nbLevelsFreq() const {
+    int level = 0;
+    while(nbRows(level)>STFTTILESIZE)
+        level++;
+    return level+1;
+}
+
+QSize STFTImageTiles::Setup::tileSize(const Key& key) const {
+    return QSize(std::min(STFTTILESIZE, nbColumns(key.tlevel)-key.ti*STFTTILESIZE),
+                 std::min(STFTTILESIZE, nbRows(key.flevel)-key.fi*STFTTILESIZE));
+}
+
+QRectF STFTImageTiles::Setup::tileRect(const Key& key) const {
+    QSize size = tileSize(key);
+    double tstep = double(1<<key.tlevel);
+    double fstep = double(1<<key.flevel);
+
+    // A pixel spans half a frame (or bin) on each side of its center
+    QRectF rect;
+    rect.setLeft(t0 + (key.ti*STFTTILESIZE*tstep - 0.5)*dt);
+    rect.setWidth(size.width()*tstep*dt);
+    rect.setTop(-(dftsize-1)*binhz + (key.fi*STFTTILESIZE*fstep - 0.5)*binhz); // The y axis is reversed in the scene
+    rect.setHeight(size.height()*fstep*binhz);
+
+    return rect;
+}
+
+STFTImageTiles::STFTImageTiles()
+    : m_memory(0)
+{
+}
+
+void STFTImageTiles::reset(const STFTComputeThread::ImageParameters& params, const std::vector<FFTTYPE>& stftts, FFTTYPE stftmin, FFTTYPE stftmax, const QColor& color) {
+
+    Setup setup;
+    setup.params = params;
+    setup.stftlen = int(stftts.size());
+    int fs = params.stftparams.snd->fs;
+    if(!stftts.empty())
+        setup.t0 = stftts.front();
+    setup.dt = double(params.stftparams.stepsize)/fs;
+    setup.nbbins = params.stftparams.nbBins();
+    if(params.stftparams.isCQT()){
+        // Two rows for the narrowest bins (the lowest ones)
+        int nbbinsperoctave = params.stftparams.cqtbinsperoctave;
+        FFTTYPE fmin = params.stftparams.cqtfmin;
+        setup.binhz = 0.5*fmin*(std::pow(2.0, 1.0/nbbinsperoctave)-1.0);
+        setup.dftsize = std::min(STFTTILESCQTMAXROWS, int(0.5*fs/setup.binhz)+1);
+        setup.binhz = 0.5*fs/(setup.dftsize-1);
+        setup.rowbins.resize(setup.dftsize);
+        setup.rowbins[0] = -1;
+        for(int n=1; n<setup.dftsize; ++n){
+            int b = int(std::floor(nbbinsperoctave*std::log(n*setup.binhz/fmin)/std::log(2.0)+0.5));
+            setup.rowbins[n] = (b>=0 && b<setup.nbbins)?b:-1;
+        }
+    }
+    else{
+        setup.dftsize = params.stftparams.dftlen/2+1;
+        setup.binhz = double(fs)/params.stftparams.dftlen;
+    }
+
+    if(params.colorrangemode==0){
+        setup.ymin = stftmin+(stftmax-stftmin)*params.lower; // Min of color range [dB]
+        setup.ymax = stftmin+(stftmax-stftmin)*params.upper; // Max of color range [dB]
+    }
+    else if(params.colorrangemode==1){
+        setup.ymin = params.lower*100; // Min of color range [dB]
+        setup.ymax = params.upper*100; // Max of color range [dB]
+    }
+
+    // Prepare the loudness curve
+    if(params.loudnessweighting) {
+        setup.elc.resize(setup.dftsize);
+        for(size_t u=0; u<setup.elc.size(); ++u)
+            setup.elc[u] = -qae::equalloudnesscurvesISO226(u*setup.binhz, 0);
+    }
+
+    // Sample the colors once for all,
+    // so that the tiles can be rendered concurrently, whatever the sound's color.
+    // The colors out of the range are at both ends, so that no test is needed when rendering.
+    QAEColorMap& cmap = QAEColorMap::getAt(params.colormap_index);
+    cmap.setColor(color);
+    setup.lut.resize(STFTTILESNBCOLORS+2);
+    setup.lut[0] = params.colormap_reversed?cmap(1.0):cmap(0.0);
+    for(int ci=0; ci<STFTTILESNBCOLORS; ++ci){
+        FFTTYPE y = FFTTYPE(ci)/(STFTTILESNBCOLORS-1);
+        if(params.colormap_reversed)
+            y = 1.0-y;
+        setup.lut[1+ci] = cmap(y);
+    }
+    setup.lut[STFTTILESNBCOLORS+1] = params.colormap_reversed?cmap(0.0):cmap(1.0);
+
+    if(params.indexedcolors){
+        // The levels cover the whole amplitude range of the STFT,
+        // so that they don't depend on the color range
+        setup.qmin = stftmin;
+        setup.qmax = stftmax;
+        if(!setup.elc.empty()){
+            setup.qmin += *std::min_element(setup.elc.begin(), setup.elc.end());
+            setup.qmax += *std::max_element(setup.elc.begin(), setup.elc.end());
+        }
+        if(!(setup.qmax>setup.qmin))
+            setup.qmax = setup.qmin+1.0;
+
+        setup.palette.resize(STFTTILESNBLEVELS);
+        for(int li=0; li<STFTTILESNBLEVELS; ++li){
+            FFTTYPE v = setup.qmin + (setup.qmax-setup.qmin)*li/(STFTTILESNBLEVELS-1);
+            FFTTYPE y = (v-setup.ymin)*(STFTTILESNBCOLORS-1)/(setup.ymax-setup.ymin);
+            int ci;
+            if(!(y>0.0))
+                ci = 0;
+            else if(y>=STFTTILESNBCOLORS-1)
+                ci = STFTTILESNBCOLORS+1;
+            else
+                ci = 1+int(y+0.5);
+            setup.palette[li] = setup.lut[ci];
+        }
+    }
+
+    m_mutex.lock();
+
+    // With indexed colors, if the levels are the same, replacing the color tables is enough
+    if(params.indexedcolors && !m_setup.isEmpty()
+       && m_setup.params.indexedcolors
+       && m_setup.params.stftparams==params.stftparams
+       && m_setup.params.loudnessweighting==params.loudnessweighting
+       && m_setup.qmin==setup.qmin && m_setup.qmax==setup.qmax){
+        setup.generation = m_setup.generation; // The tiles in preparation are still valid
+        m_setup = setup;
+        for(std::map<Key,Entry>::iterator it=m_tiles.begin(); it!=m_tiles.end(); ++it)
+            it->second.img.setColorTable(setup.palette);
+        for(std::map<Key,QImage>::iterator it=m_stale.begin(); it!=m_stale.end(); ++it)
+            if(it->second.format()==QImage::Format_Indexed8)
+                it->second.setColorTable(setup.palette);
+        m_mutex.unlock();
+        return;
+    }
+
+    setup.generation = m_setup.generation+1;
+    // If the STFT is the same, keep the current tiles for drawing something while the new ones are rendered
+    if(!m_setup.isEmpty() && m_setup.params.stftparams==params.stftparams){
+        for(std::map<Key,Entry>::iterator it=m_tiles.begin(); it!=m_tiles.end(); ++it)
+            m_stale[it->first] = it->second.img;
+    }
+    else
+        m_stale.clear();
+    m_setup = setup;
+    m_tiles.clear();
+    m_lru.clear();
+    m_pending.clear();
+    m_memory = 0;
+    m_mutex.unlock();
+}
+
+void STFTImageTiles::clear() {
+    m_mutex.lock();
+    int generation = m_setup.generation;
+    m_setup = Setup();
+    m_setup.generation = generation+1;
+    m_tiles.clear();
+    m_stale.clear();
+    m_lru.clear();
+    m_pending.clear();
+    m_memory = 0;
+    m_mutex.unlock();
+}
+
+STFTImageTiles::Setup STFTImageTiles::getSetup() const {
+    QMutexLocker locker(&m_mutex);
+    return m_setup;
+}
+
+bool STFTImageTiles::isEmpty() const {
+    QMutexLocker locker(&m_mutex);
+    return m_setup.isEmpty();
+}
+
+bool STFTImageTiles::get(const Key& key, QImage& img) {
+    QMutexLocker locker(&m_mutex);
+
+    std::map<Key,Entry>::iterator it = m_tiles.find(key);
+    if(it==m_tiles.end())
+        return false;
+
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    img = it->second.img;
+
+    return true;
+}
+
+bool STFTImageTiles::getStale(const Key& key, QImage& img) const {
+    QMutexLocker locker(&m_mutex);
+
+    std::map<Key,QImage>::const_iterator it = m_stale.find(key);
+    if(it==m_stale.end())
+        return false;
+
+    img = it->second;
+
+    return true;
+}
+
+bool STFTImageTiles::request(const Key& key) {
+    QMutexLocker locker(&m_mutex);
+
+    if(m_setup.isEmpty())
+        return false;
+    if(m_tiles.find(key)!=m_tiles.end())
+        return false;
+    if(m_pending.find(key)!=m_pending.end())
+        return false;
+
+    m_pending.insert(key);
+
+    return true;
+}
+
+void STFTImageTiles::insert(int generation, const Key& key, const QImage& img) {
+    QMutexLocker locker(&m_mutex);
+
+    m_pending.erase(key);
+
+    if(generation!=m_setup.generation || img.isNull())
+        return; // Too late, the tiles have been reset
+
+    m_stale.erase(key);
+
+    std::map<Key,Entry>::iterator it = m_tiles.find(key);
+    if(it!=m_tiles.end()){
+        m_memory -= it->second.img.byteCount();
+        m_lru.erase(it->second.lru);
+        m_tiles.erase(it);
+    }
+
+    m_lru.push_front(key);
+    Entry& entry = m_tiles[key];
+    entry.img = img;
+    // The colors might have changed during the rendering
+    if(entry.img.format()==QImage::Format_Indexed8 && entry.img.colorTable()!=m_setup.palette)
+        entry.img.setColorTable(m_setup.palette);
+    entry.lru = m_lru.begin();
+    m_memory += img.byteCount();
+
+    // Drop the least recently used tiles (but keep at least the new one)
+    while(m_memory>s_memorylimit && m_lru.size()>1){
+        std::map<Key,Entry>::iterator itold = m_tiles.find(m_lru.back());
+        m_memory -= itold->second.img.byteCount();
+        m_tiles.erase(itold);
+        m_lru.pop_back();
+    }
+}
+
+void STFTImageTiles::release(const Key& key) {
+    QMutexLocker locker(&m_mutex);
+    m_pending.erase(key);
+}
+
+void STFTImageTiles::render(const Setup& setup, const Key& key, const WAVTYPE* levelpa, int levelstep, QImage& img) {
+
+    QSize size = setup.tileSize(key);
+    int dftsize = setup.dftsize;
+    int nbbins = setup.nbbins;
+    const int* prowbins = setup.rowbins.empty()?NULL:&(setup.rowbins[0]);
+    int fstep = 1<<key.flevel;
+    int rbegin = key.fi*STFTTILESIZE*fstep; // First row of the tile, from the highest frequency
+    bool uselw = !setup.elc.empty();
+    const FFTTYPE* pelc = uselw?&(setup.elc[0]):NULL;
+    const QRgb* plut = &(setup.lut[0]);
+    int nbcolors = int(setup.lut.size())-2;
+    bool indexed = setup.params.indexedcolors;
+    // Maps [ymin,ymax] to [0,nbcolors-1] (or [qmin,qmax] to [0,nblevels-1])
+    FFTTYPE scale = (nbcolors-1)/(setup.ymax-setup.ymin);
+    FFTTYPE bias = -setup.ymin*scale;
+    if(indexed){
+        scale = (STFTTILESNBLEVELS-1)/(setup.qmax-setup.qmin);
+        bias = -setup.qmin*scale;
+        img.setColorTable(setup.palette);
+    }
+    FFTTYPE values[STFTTILESIZE];
+
+    // Each scanline of the (transposed) image is one column of the spectrogram,
+    // thus the values of a frame are read and the pixels written contiguously.
+    // The passes are kept separated so that the compiler can vectorize the straight ones
+    // (the copy at full resolution and the normalisation). The max-pooling and the
+    // range checks of pass 3 keep their branches (NaN and -Inf map to the lowest color).
+    for(int px=0; px<size.width(); ++px){
+        // Time is already max-pooled in the pyramid
+        // (otherwise sampled at the first frame of the pixel)
+        const WAVTYPE* stftfrpa = levelpa+size_t((key.ti*STFTTILESIZE+px)*levelstep)*nbbins;
+        int nbegin = dftsize-1-rbegin; // This one has reversed y
+
+        // Pass 1: Values of the pixels (the max is kept among the bins of the pixel)
+        if(prowbins){
+            // Constant-Q bins, through the rows' grid
+            for(int py=0; py<size.height(); ++py){
+                int nend = std::max(nbegin-py*fstep-fstep, -1);
+                FFTTYPE v = -std::numeric_limits<FFTTYPE>::infinity();
+                for(int n=nbegin-py*fstep; n>nend; --n){
+                    if(prowbins[n]<0)
+                        continue;
+                    FFTTYPE vn = stftfrpa[prowbins[n]];
+                    if(uselw) vn += pelc[n];
+                    if(vn>v) v = vn;
+                }
+                values[py] = v;
+            }
+        }
+        else if(fstep==1){
+            if(uselw){
+                for(int py=0; py<size.height(); ++py)
+                    values[py] = stftfrpa[nbegin-py] + pelc[nbegin-py]; // Modification according to loudness curve
+            }
+            else{
+                for(int py=0; py<size.height(); ++py)
+                    values[py] = stftfrpa[nbegin-py];
+            }
+        }
+        else{
+            for(int py=0; py<size.height(); ++py){
+                int nend = std::max(nbegin-py*fstep-fstep, -1);
+                FFTTYPE v = -std::numeric_limits<FFTTYPE>::infinity();
+                for(int n=nbegin-py*fstep; n>nend; --n){
+                    FFTTYPE vn = stftfrpa[n];
+                    if(uselw) vn += pelc[n];
+                    if(vn>v) v = vn;
+                }
+                values[py] = v;
+            }
+        }
+
+        // Pass 2: Normalisation to the color indices
+        for(int py=0; py<size.height(); ++py)
+            values[py] = values[py]*scale + bias;
+
+        if(indexed){
+            // Pass 3: Quantization, the color table does the rest
+            uchar* pimgl = img.scanLine(px);
+            for(int py=0; py<size.height(); ++py){
+                FFTTYPE y = values[py];
+                int li;
+                if(!(y>0.0))
+                    li = 0;
+                else if(y>=STFTTILESNBLEVELS-1)
+                    li = STFTTILESNBLEVELS-1;
+                else
+                    li = int(y+0.5);
+                pimgl[py] = uchar(li);
+            }
+            continue;
+        }
+
+        // Pass 3: Color look up
+        QRgb* pimgl = (QRgb*)(img.scanLine(px));
+        for(int py=0; py<size.height(); ++py){
+            FFTTYPE y = values[py];
+            int ci;
+            if(!(y>0.0))                // Below the range (also catches -Inf and NaN)
+                ci = 0;
+            else if(y>=nbcolors-1)      // Above the range
+                ci = nbcolors+1;
+            else
+                ci = 1+int(y+0.5);
+            pimgl[py] = plut[ci];
+        }
+    }
+}
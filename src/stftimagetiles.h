@@ -0,0 +1,160 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STFTIMAGETILES_H
+#define STFTIMAGETILES_H
+
+#include <map>
+#include <set>
+#include <list>
+#include <vector>
+
+#include <QImage>
+#include <QVector>
+#include <QRectF>
+#include <QMutex>
+
+#include "stftcomputethread.h"
+
+#ifdef SIGPROC_FLOAT
+#define WAVTYPE float
+#else
+#define WAVTYPE double
+#endif
+
+#define STFTTILESIZE 256 // [pixels] Width and height of a tile
+
+// The spectrogram image of a sound, split in tiles.
+// The tiles are rendered from the STFT only when they are needed for drawing,
+// and are kept in a LRU cache whose memory is bounded.
+// A tile is identified by its zoom levels (in time and frequency)
+// and its position (in time and frequency) in the grid of tiles of these levels.
+// At level L, one column of pixels corresponds to 2^L frames
+// and one row of pixels to 2^L frequency bins.
+// The tiles' images are transposed (one scanline per column of the spectrogram),
+// so that they are rendered along the frames of the STFT, see render(.).
+// When only the colors change, the previous tiles are kept to be drawn
+// until they are rendered again.
+// With a constant-Q transform, the log-frequency bins are mapped on the rows
+// of a linear grid, so that the image fits the frequency axis of the view.
+// With indexed colors, the tiles hold 256 levels of amplitude between qmin and qmax
+// and the colors are in their color table, which is simply replaced when only the colors change.
+class STFTImageTiles
+{
+public:
+    class Key {
+    public:
+        int tlevel; // Zoom level in time
+        int flevel; // Zoom level in frequency
+        int ti;     // Tile index in time
+        int fi;     // Tile index in frequency
+
+        Key(int _tlevel=0, int _flevel=0, int _ti=0, int _fi=0)
+            : tlevel(_tlevel), flevel(_flevel), ti(_ti), fi(_fi)
+        {}
+
+        bool operator<(const Key& key) const;
+        bool operator==(const Key& key) const;
+    };
+
+    // Everything needed for rendering a tile, fixed at each reset
+    class Setup {
+    public:
+        int generation;         // Changes at each reset
+        STFTComputeThread::ImageParameters params;
+        double t0;              // [s] Time of the first frame
+        double dt;              // [s] Time between two frames
+        double binhz;           // [Hz] Frequency step between two bins
+        int stftlen;            // [frames]
+        int dftsize;            // [rows] The DFT's bins, or a linear grid for the constant-Q bins
+        int nbbins;             // [bins] Values per frame of the STFT
+        std::vector<int> rowbins;   // The constant-Q bin of each row (-1 if none), empty for the DFT
+        FFTTYPE ymin;           // [dB] Value of the first color
+        FFTTYPE ymax;           // [dB] Value of the last color
+        std::vector<FFTTYPE> elc;   // [dB] Loudness weighting (empty if not used)
+        std::vector<QRgb> lut;      // The color below ymin, the colors from ymin to ymax, the color above ymax
+        FFTTYPE qmin;           // [dB] Value of the first level (with indexed colors)
+        FFTTYPE qmax;           // [dB] Value of the last level (with indexed colors)
+        QVector<QRgb> palette;  // The color of each level (with indexed colors)
+
+        Setup();
+
+        inline bool isEmpty() const {return stftlen==0;}
+
+        int nbColumns(int tlevel) const;
+        int nbRows(int flevel) const;
+        int nbTilesTime(int tlevel) const;
+        int nbTilesFreq(int flevel) const;
+        int nbLevelsTime() const;
+        int nbLevelsFreq() const;
+        QSize tileSize(const Key& key) const;  // [columns x rows] (the image is transposed)
+        QRectF tileRect(const Key& key) const; // In scene coordinates ([s], [-Hz])
+    };
+
+private:
+    class Entry {
+    public:
+        QImage img;
+        std::list<Key>::iterator lru;
+    };
+
+    mutable QMutex m_mutex;
+    Setup m_setup;
+    std::map<Key,Entry> m_tiles;
+    std::map<Key,QImage> m_stale; // The tiles before the last change of colors
+    std::list<Key> m_lru;       // Most recently used first
+    std::set<Key> m_pending;    // Requested tiles which are not rendered yet
+    qint64 m_memory;            // [bytes] Used by the tiles
+
+    static qint64 s_memorylimit;
+
+public:
+    STFTImageTiles();
+
+    // Drop all the tiles and prepare for new image parameters
+    // (the STFT of the sound has to correspond to params.stftparams)
+    // With indexed colors, the tiles are kept if only their colors change.
+    void reset(const STFTComputeThread::ImageParameters& params, const std::vector<FFTTYPE>& stftts, FFTTYPE stftmin, FFTTYPE stftmax, const QColor& color);
+    // Drop all the tiles, nothing can be drawn until the next reset
+    void clear();
+
+    Setup getSetup() const;
+    bool isEmpty() const;
+
+    // Get a tile (and mark it as recently used). Return false if it is not available.
+    bool get(const Key& key, QImage& img);
+    // Get the tile as it was before the last change of colors, if any.
+    bool getStale(const Key& key, QImage& img) const;
+    // Mark a tile as requested. Return true if it has to be rendered.
+    bool request(const Key& key);
+    // Store a rendered tile, unless the tiles have been reset in the meantime
+    void insert(int generation, const Key& key, const QImage& img);
+    // Forget a request (e.g. if it has been canceled)
+    void release(const Key& key);
+
+    // Render a tile from the STFT values of its time level
+    // (levelstep is the number of frames of levelpa per column of the tile)
+    static void render(const Setup& setup, const Key& key, const WAVTYPE* levelpa, int levelstep, QImage& img);
+
+    static void setMemoryLimit(qint64 limit) {s_memorylimit=limit;}
+    static qint64 getMemoryLimit() {return s_memorylimit;}
+};
+
+#endif // STFTIMAGETILES_H
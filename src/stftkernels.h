@@ -0,0 +1,166 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef STFTKERNELS_H
+#define STFTKERNELS_H
+
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
+#include <QtGlobal>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "qaehelpers.h"
+
+// Kernels of the STFT frames' loop (see STFTComputeThread).
+// The generic versions are the reference, the SIMD versions (for double
+// precision) do exactly the same operations in the same order,
+// so that they give the same values, bit for bit (see test/test_stftkernels.pro).
+
+// in[n] = clip(gain*wav[n])*win[n], return true if any value is non-zero
+template<typename WT, typename FT>
+static inline bool stft_frame_input(const WT* wav, int len, qreal gain, const FT* win, FT* in){
+    bool hasnonzerovalues = false;
+    for(int n=0; n<len; ++n){
+        WT value = gain*wav[n];
+        value = std::min(std::max(value, WT(-1.0)), WT(1.0)); // Keeps NaN
+        value *= win[n];
+        hasnonzerovalues |= (std::abs(value)>0.0);
+        in[n] = value;
+    }
+    return hasnonzerovalues;
+}
+
+// out[n] = log2db*values[n] (NaN becoming -Inf),
+// and the min and max of the finite output values.
+template<typename FT, typename WT>
+static inline void stft_frame_db(const FT* values, int len, WT* out, FT& vmin, FT& vmax){
+    for(int n=0; n<len; ++n){
+        FT value = qae::log2db*values[n];
+        if(qIsNaN(value))
+            value = -std::numeric_limits<FT>::infinity();
+        out[n] = value;
+        if(!qIsInf(value)){
+            vmin = std::min(vmin, value);
+            vmax = std::max(vmax, value);
+        }
+    }
+}
+
+#if defined(__AVX2__)
+static inline bool stft_frame_input(const double* wav, int len, qreal gain, const double* win, double* in){
+    const __m256d vgain = _mm256_set1_pd(gain);
+    const __m256d vone = _mm256_set1_pd(1.0);
+    const __m256d vminusone = _mm256_set1_pd(-1.0);
+    const __m256d vzero = _mm256_setzero_pd();
+    const __m256d vabsmask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+    __m256d vnonzero = vzero;
+    int n = 0;
+    for(; n+4<=len; n+=4){
+        __m256d v = _mm256_mul_pd(vgain, _mm256_loadu_pd(wav+n));
+        v = _mm256_min_pd(vone, _mm256_max_pd(vminusone, v)); // Keeps NaN, as above
+        v = _mm256_mul_pd(v, _mm256_loadu_pd(win+n));
+        vnonzero = _mm256_or_pd(vnonzero, _mm256_cmp_pd(_mm256_and_pd(v, vabsmask), vzero, _CMP_GT_OQ));
+        _mm256_storeu_pd(in+n, v);
+    }
+    bool hasnonzerovalues = _mm256_movemask_pd(vnonzero)!=0;
+    if(n<len)
+        hasnonzerovalues |= stft_frame_input<double,double>(wav+n, len-n, gain, win+n, in+n);
+    return hasnonzerovalues;
+}
+
+static inline void stft_frame_db(const double* values, int len, double* out, double& vmin, double& vmax){
+    const __m256d vlog2db = _mm256_set1_pd(qae::log2db);
+    const __m256d vinf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    const __m256d vminusinf = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+    const __m256d vabsmask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+    __m256d vvmin = vinf;
+    __m256d vvmax = vminusinf;
+    int n = 0;
+    for(; n+4<=len; n+=4){
+        __m256d v = _mm256_mul_pd(vlog2db, _mm256_loadu_pd(values+n));
+        v = _mm256_blendv_pd(v, vminusinf, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+        _mm256_storeu_pd(out+n, v);
+        __m256d finite = _mm256_cmp_pd(_mm256_and_pd(v, vabsmask), vinf, _CMP_LT_OQ);
+        vvmin = _mm256_min_pd(vvmin, _mm256_blendv_pd(vinf, v, finite));
+        vvmax = _mm256_max_pd(vvmax, _mm256_blendv_pd(vminusinf, v, finite));
+    }
+    double mins[4], maxs[4];
+    _mm256_storeu_pd(mins, vvmin);
+    _mm256_storeu_pd(maxs, vvmax);
+    for(int k=0; k<4; ++k){
+        vmin = std::min(vmin, mins[k]);
+        vmax = std::max(vmax, maxs[k]);
+    }
+    if(n<len)
+        stft_frame_db<double,double>(values+n, len-n, out+n, vmin, vmax);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline bool stft_frame_input(const double* wav, int len, qreal gain, const double* win, double* in){
+    const float64x2_t vgain = vdupq_n_f64(gain);
+    const float64x2_t vone = vdupq_n_f64(1.0);
+    const float64x2_t vminusone = vdupq_n_f64(-1.0);
+    uint64x2_t vnonzero = vdupq_n_u64(0);
+    int n = 0;
+    for(; n+2<=len; n+=2){
+        float64x2_t v = vmulq_f64(vgain, vld1q_f64(wav+n));
+        // Keeps NaN, as above
+        v = vbslq_f64(vcgtq_f64(vminusone, v), vminusone, v);
+        v = vbslq_f64(vcltq_f64(vone, v), vone, v);
+        v = vmulq_f64(v, vld1q_f64(win+n));
+        vnonzero = vorrq_u64(vnonzero, vcgtq_f64(vabsq_f64(v), vdupq_n_f64(0.0)));
+        vst1q_f64(in+n, v);
+    }
+    bool hasnonzerovalues = (vgetq_lane_u64(vnonzero, 0) | vgetq_lane_u64(vnonzero, 1))!=0;
+    if(n<len)
+        hasnonzerovalues |= stft_frame_input<double,double>(wav+n, len-n, gain, win+n, in+n);
+    return hasnonzerovalues;
+}
+
+static inline void stft_frame_db(const double* values, int len, double* out, double& vmin, double& vmax){
+    const float64x2_t vlog2db = vdupq_n_f64(qae::log2db);
+    const float64x2_t vinf = vdupq_n_f64(std::numeric_limits<double>::infinity());
+    const float64x2_t vminusinf = vdupq_n_f64(-std::numeric_limits<double>::infinity());
+    float64x2_t vvmin = vinf;
+    float64x2_t vvmax = vminusinf;
+    int n = 0;
+    for(; n+2<=len; n+=2){
+        float64x2_t v = vmulq_f64(vlog2db, vld1q_f64(values+n));
+        v = vbslq_f64(vceqq_f64(v, v), v, vminusinf);
+        vst1q_f64(out+n, v);
+        uint64x2_t finite = vcltq_f64(vabsq_f64(v), vinf);
+        vvmin = vminq_f64(vvmin, vbslq_f64(finite, v, vinf));
+        vvmax = vmaxq_f64(vvmax, vbslq_f64(finite, v, vminusinf));
+    }
+    vmin = std::min(vmin, std::min(vgetq_lane_f64(vvmin, 0), vgetq_lane_f64(vvmin, 1)));
+    vmax = std::max(vmax, std::max(vgetq_lane_f64(vvmax, 0), vgetq_lane_f64(vvmax, 1)));
+    if(n<len)
+        stft_frame_db<double,double>(values+n, len-n, out+n, vmin, vmax);
+}
+#endif
+
+#endif // STFTKERNELS_H
@@ -123,6 +123,7 @@ void WDialogSettings::settingsSave() {
 
     // Save the particular global settings
     gMW->m_settings.setValue("cbPlaybackAudioOutputDevices", ui->cbPlaybackAudioOutputDevices->currentText());
+    gMW->m_gvSpectrogram->m_dlgSettings->settingsSave();
 
     // If some files are loaded, save the geometry of the views
     if(gFL->count()>0){
@@ -26,6 +26,8 @@ file provided in the source code of DFasma. Another copy can be found at
 #include <QMessageBox>
 #include <QItemDelegate>
 #include <QKeyEvent>
+#include <QThreadPool>
+#include <QAtomicInt>
 
 #include "filetype.h"
 #include "ftsound.h"
@@ -217,6 +219,7 @@ void WFilesList::addExistingFile(const QString& filepath, FileType::FType type)
         int filesize = fileinfo.size()/std::pow(2.0, 20.0); // File size in [MB]
 //        DCOUT << filepath << " size: " << filesize << "MB" << std::endl;
 
+        #ifndef file_audio_LIBSNDFILE // libsndfile's loader reads big files in background
         if(filesize>50){ // If bigger than X MB
             m_loadingmsgbox = new QMessageBox(gMW);
             m_loadingmsgbox->setWindowTitle("DFasma");
@@ -229,6 +232,7 @@ void WFilesList::addExistingFile(const QString& filepath, FileType::FType type)
                 QCoreApplication::processEvents(); // To show the progress
             }
         }
+        #endif
 
         // This should be always "guessable"
         FileType::FileContainer container = FileType::guessContainer(FileType::removeDataSelectors(filepath));
@@ -305,9 +309,13 @@ void WFilesList::addExistingFile(const QString& filepath, FileType::FType type)
                 WDialogSelectChannel dlg(filepath, nchan, this);
                 if(dlg.exec()) {
                     if(dlg.ui->rdbImportEachChannel->isChecked()){
-                        for(int ci=1; ci<=nchan; ci++){
-                            addItem(new FTSound(filepath, this, ci));
-                        }
+                        // Read the file only once for all the channels
+                        std::vector<int> channelids;
+                        for(int ci=1; ci<=nchan; ci++)
+                            channelids.push_back(ci);
+                        std::vector<FTSound*> snds = FTSound::createChannels(filepath, this, channelids);
+                        for(size_t si=0; si<snds.size(); si++)
+                            addItem(snds[si]);
                     }
                     else if(dlg.ui->rdbImportOnlyOneChannel->isChecked()){
                         addItem(new FTSound(filepath, this, dlg.ui->sbChannelID->value()));
@@ -424,14 +432,10 @@ FTLabels* WFilesList::getCurrentFTLabels(bool forceselect) {
     return NULL;
 }
 void WFilesList::setLabelsEditable(bool editable){
-    for(size_t fi=0; fi<ftlabels.size(); fi++){
-        for(size_t li=0; li<ftlabels[fi]->waveform_labels.size(); li++){
-            if(editable)
-                ftlabels[fi]->waveform_labels[li]->setTextInteractionFlags(Qt::TextEditorInteraction);
-            else
-                ftlabels[fi]->waveform_labels[li]->setTextInteractionFlags(Qt::NoTextInteraction);
-        }
-    }
+    // The texts are edited on demand (see FTLabels::editText), only an ongoing edition has to end
+    if(!editable)
+        for(size_t fi=0; fi<ftlabels.size(); fi++)
+            ftlabels[fi]->finishEditingText();
 }
 
 void WFilesList::showFileContextMenu(const QPoint& pos) {
@@ -742,6 +746,39 @@ void WFilesList::selectedFilesSave() {
     }
 }
 
+// The F0 estimation of one of the selected files
+class F0EstimationTask {
+public:
+    FileType* file;
+    FTSound* snd;
+    FTFZero* fzero; // The curve to fill, NULL until it is created for a sound
+    FTFZero::Estimation est;
+    bool running;   // Prepared and started, the samples are copied in est
+    bool finished;
+
+    F0EstimationTask()
+        : file(NULL)
+        , snd(NULL)
+        , fzero(NULL)
+        , running(false)
+        , finished(false)
+    {}
+
+    // Merge the chunks computed so far in the curve
+    void apply() {
+        if(!est.gather())
+            return;
+        if(fzero==NULL){
+            if(gFL->hasFile(file) && gFL->hasFile(est.snd)){
+                fzero = new FTFZero(gFL, est);
+                gFL->addItem(fzero);
+            }
+        }
+        else if(gFL->hasFile(fzero) && gFL->hasFile(est.snd))
+            fzero->apply(est);
+    }
+};
+
 void WFilesList::selectedFilesEstimateF0() {
     QList<QListWidgetItem*> l = selectedItems();
 
@@ -761,41 +798,122 @@ void WFilesList::selectedFilesEstimateF0() {
 
     bool force = QGuiApplication::keyboardModifiers().testFlag(Qt::ShiftModifier);
 
-    // These progress dialogs HAVE to be built on the stack otherwise ghost dialogs appear.
-    QProgressDialog prgdlg("Estimating F0...", "Abort", 0, l.size(), this);
-    prgdlg.setMinimumDuration(500);
-    m_prgdlg = &prgdlg;
-
-    for(int i=0; i<l.size() && !m_prgdlg->wasCanceled(); i++) {
+    // List the estimations
+    QStringList errors;
+    std::vector<F0EstimationTask> tasks;
+    tasks.reserve(l.size());
+    for(int i=0; i<l.size(); i++) {
         FileType* currentfile = (FileType*)l.at(i);
 
-        try {
-            // If from a sound, generate a new F0 file
-            if(currentfile->is(FileType::FTSOUND))
-                gFL->addItem(new FTFZero(gFL, (FTSound*)currentfile, f0min, f0max, tstart, tend, force));
+        FTSound* snd = NULL;
+        FTFZero* fzero = NULL;
+        if(currentfile->is(FileType::FTSOUND))      // If from a sound, generate a new F0 file
+            snd = (FTSound*)currentfile;
+        else if(currentfile->is(FileType::FTFZERO)){// If from an F0 file, update it
+            fzero = (FTFZero*)currentfile;
+            snd = fzero->m_src_snd;
+        }
+        else
+            continue;
 
-            // If from an F0 file, update it
-            if(currentfile->is(FileType::FTFZERO))
-                ((FTFZero*)currentfile)->estimate(NULL, f0min, f0max, tstart, tend, force);
+        if(!hasFile(snd)){
+            errors.append(currentfile->visibleName+": The source file used for updating the F0 is not listed in the application anymore.");
+            continue;
+        }
+        if(snd->isLoading()){
+            errors.append(currentfile->visibleName+": The source file used for updating the F0 is still loading.");
+            continue;
+        }
 
-            gMW->m_gvSpectrogram->m_scene->update();
-            gMW->m_gvSpectrumAmplitude->m_scene->update();
+        tasks.push_back(F0EstimationTask());
+        tasks.back().file = currentfile;
+        tasks.back().snd = snd;
+        tasks.back().fzero = fzero;
+    }
 
-            m_prgdlg->setValue(i);
+    if(!tasks.empty() && getFs()<6000.0)
+        QMessageBox::warning(gMW, "Problem during estimation of F0", "Sampling rate is smaller than 6kHz, which may create substantial estimation errors.");
+
+    // Run the chunks of the estimations in parallel.
+    // Each estimation copies the samples of its sound when it starts,
+    // thus only a few estimations are started at once to bound the memory.
+    QAtomicInt canceled(0);
+    QThreadPool workers;
+    workers.setMaxThreadCount(std::max(1, QThread::idealThreadCount()));
+    int maxrunning = workers.maxThreadCount();
+
+    // These progress dialogs HAVE to be built on the stack otherwise ghost dialogs appear.
+    QProgressDialog prgdlg("Estimating F0...", "Abort", 0, 100*int(tasks.size()), this);
+    prgdlg.setWindowModality(Qt::WindowModal); // The files must not change in the meantime
+    prgdlg.setMinimumDuration(500);
+    m_prgdlg = &prgdlg;
+
+    size_t tnext = 0;
+    int nbrunning = 0;
+    bool idle = false;
+    do {
+        // Start the next estimations
+        while(nbrunning<maxrunning && tnext<tasks.size() && !canceled.load()){
+            F0EstimationTask& task = tasks[tnext++];
+            try {
+                task.est.prepare(task.snd, f0min, f0max, tstart, tend, force);
+                task.est.start(&workers, &canceled);
+                task.running = true;
+                nbrunning++;
+            }
+            catch(std::bad_alloc err){
+                task.est.releaseData();
+                errors.append(task.file->visibleName+": Not enough memory");
+                task.finished = true;
+            }
         }
-        catch(QString err){
-            gMW->globalWaitingBarDone();
-            stopFileProgressDialog();
-            QMessageBox::StandardButton ret=QMessageBox::warning(gMW, "Error during F0 estimation", "Estimation of the F0 of "+currentfile->visibleName+" failed for the following reason:\n"+err, QMessageBox::Ok | QMessageBox::Abort, QMessageBox::Ok);
-            if(ret==QMessageBox::Abort)
-                if(m_prgdlg)
-                    m_prgdlg->cancel();
+
+        idle = workers.waitForDone(100);
+
+        // Show the curves as they come
+        int progress = 0;
+        nbrunning = 0;
+        for(size_t ti=0; ti<tasks.size(); ++ti){
+            F0EstimationTask& task = tasks[ti];
+            if(task.running){
+                bool done = idle || task.est.isDone(); // All computed (or skipped once canceled)
+                task.apply();
+                if(done){
+                    task.est.releaseData();
+                    task.running = false;
+                    task.finished = true;
+                }
+                else{
+                    progress += (100*task.est.nbDone())/std::max(1, task.est.nbChunks());
+                    nbrunning++;
+                }
+            }
+            if(task.finished)
+                progress += 100;
         }
+        gMW->m_gvSpectrogram->m_scene->update();
+        m_prgdlg->setValue(progress);
+        QCoreApplication::processEvents(); // To show the progress
+        if(m_prgdlg->wasCanceled())
+            canceled.store(1); // The running chunks are finished, the others are skipped
     }
+    while(!idle || (tnext<tasks.size() && !canceled.load()));
 
     stopFileProgressDialog();
     m_prgdlg = NULL;
 
+    for(size_t ti=0; ti<tasks.size(); ++ti) {
+        QString err = tasks[ti].est.error();
+        if(!err.isEmpty())
+            errors.append(tasks[ti].file->visibleName+": "+err);
+    }
+
+    gMW->m_gvSpectrogram->m_scene->update();
+    gMW->m_gvSpectrumAmplitude->m_scene->update();
+
+    if(!errors.isEmpty())
+        QMessageBox::warning(gMW, "Error during F0 estimation", "Estimation of the F0 failed for the following files:\n"+errors.join("\n"));
+
     gMW->updateWindowTitle();
 }
 
@@ -891,9 +1009,9 @@ WAVTYPE WFilesList::getMaxSQNR() const {
     WAVTYPE maxsqnr = 0.0;
     for(unsigned int si=0; si<ftsnds.size(); si++){
         if(ftsnds[si]->format().sampleSize()==-1)
-            maxsqnr = std::max(maxsqnr, 20*std::log10(std::pow(2.0, int(8*sizeof(WAVTYPE)))));
+            maxsqnr = std::max(maxsqnr, WAVTYPE(20*std::log10(std::pow(2.0, int(8*sizeof(WAVTYPE))))));
         else
-            maxsqnr = std::max(maxsqnr, 20*std::log10(std::pow(2.0, ftsnds[si]->format().sampleSize())));
+            maxsqnr = std::max(maxsqnr, WAVTYPE(20*std::log10(std::pow(2.0, ftsnds[si]->format().sampleSize()))));
     }
     return maxsqnr;
 }
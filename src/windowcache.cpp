@@ -0,0 +1,120 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "windowcache.h"
+
+#include <QString>
+
+QMutex WindowCache::s_mutex;
+std::map<WindowCache::Key,WindowCache::Entry> WindowCache::s_windows;
+std::list<WindowCache::Key> WindowCache::s_lru;
+size_t WindowCache::s_sizelimit = 32;
+
+bool WindowCache::Key::operator<(const Key& key) const {
+    if(wintype!=key.wintype) return wintype<key.wintype;
+    if(winlen!=key.winlen) return winlen<key.winlen;
+    if(normtype!=key.normtype) return normtype<key.normtype;
+    if(sigma!=key.sigma) return sigma<key.sigma;
+    if(decay!=key.decay) return decay<key.decay;
+    return power<key.power;
+}
+
+std::vector<FFTTYPE> WindowCache::build(const Key& key) {
+    std::vector<FFTTYPE> win;
+
+    if(key.wintype==WTRectangular)
+        win = qae::rectangular(key.winlen);
+    else if(key.wintype==WTHamming)
+        win = qae::hamming(key.winlen);
+    else if(key.wintype==WTHann)
+        win = qae::hann(key.winlen);
+    else if(key.wintype==WTBlackman)
+        win = qae::blackman(key.winlen);
+    else if(key.wintype==WTBlackmanNutall)
+        win = qae::blackmannutall(key.winlen);
+    else if(key.wintype==WTBlackmanHarris)
+        win = qae::blackmanharris(key.winlen);
+    else if(key.wintype==WTNutall)
+        win = qae::nutall(key.winlen);
+    else if(key.wintype==WTFlattop)
+        win = qae::flattop(key.winlen);
+    else if(key.wintype==WTNormal)
+        win = qae::normwindow(key.winlen, key.sigma);
+    else if(key.wintype==WTExponential)
+        win = qae::expwindow(key.winlen, key.decay);
+    else if(key.wintype==WTGeneralizedNormal)
+        win = qae::gennormwindow(key.winlen, key.sigma, key.power);
+    else
+        throw QString("No window selected");
+
+    if(key.normtype==WNSum || key.normtype==WNEnergy){
+        double winsum = 0.0;
+        if(key.normtype==WNSum) {
+            // Normalize the window's sum to 1
+            for(size_t n=0; n<win.size(); n++)
+                winsum += win[n];
+        }
+        else {
+            // Normalize the window's energy to 1
+            for(size_t n=0; n<win.size(); n++)
+                winsum += win[n]*win[n];
+        }
+        for(size_t n=0; n<win.size(); n++)
+            win[n] /= winsum;
+    }
+
+    return win;
+}
+
+WindowCache::Window WindowCache::get(int wintype, int winlen, int normtype, double sigma, double decay, double power) {
+    Key key;
+    key.wintype = wintype;
+    key.winlen = winlen;
+    key.normtype = normtype;
+    // Ignore the parameters which are not used by this type,
+    // so that they don't multiply the entries
+    key.sigma = (wintype==WTNormal || wintype==WTGeneralizedNormal)?sigma:0.0;
+    key.decay = (wintype==WTExponential)?decay:0.0;
+    key.power = (wintype==WTGeneralizedNormal)?power:0.0;
+
+    QMutexLocker locker(&s_mutex);
+
+    std::map<Key,Entry>::iterator it = s_windows.find(key);
+    if(it!=s_windows.end()){
+        s_lru.splice(s_lru.begin(), s_lru, it->second.lru);
+        return it->second.win;
+    }
+
+    // Build it before inserting it, since build() can throw
+    Window win(new std::vector<FFTTYPE>(build(key)));
+    s_lru.push_front(key);
+    Entry& entry = s_windows[key];
+    entry.win = win;
+    entry.lru = s_lru.begin();
+
+    // Drop the least recently used ones
+    // (those still in use are kept alive by their users)
+    while(s_windows.size()>s_sizelimit){
+        s_windows.erase(s_lru.back());
+        s_lru.pop_back();
+    }
+
+    return win;
+}
@@ -0,0 +1,76 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WINDOWCACHE_H
+#define WINDOWCACHE_H
+
+#include <map>
+#include <list>
+#include <vector>
+
+#include <QMutex>
+#include <QSharedPointer>
+
+#include "qaesigproc.h"
+
+// The analysis windows already built, shared by the spectrum views, the STFT
+// and the cepstral liftering (thread-safe).
+// The windows are immutable, so that they can be used while other threads ask for others.
+// The least recently used ones are dropped when there are too many.
+class WindowCache
+{
+public:
+    typedef QSharedPointer<const std::vector<FFTTYPE> > Window;
+
+    enum WindowType {WTRectangular, WTHamming, WTHann, WTBlackman, WTBlackmanNutall, WTBlackmanHarris, WTNutall, WTFlattop, WTNormal, WTExponential, WTGeneralizedNormal};
+    enum Normalisation {WNNone=-1, WNSum, WNEnergy};
+
+    // The window types are in the order of the settings' combo boxes.
+    // The shape parameters are used only by the types which need them.
+    static Window get(int wintype, int winlen, int normtype=WNNone, double sigma=0.0, double decay=0.0, double power=0.0);
+
+private:
+    class Key {
+    public:
+        int wintype;
+        int winlen;
+        int normtype;
+        double sigma;
+        double decay;
+        double power;
+
+        bool operator<(const Key& key) const;
+    };
+
+    class Entry {
+    public:
+        Window win;
+        std::list<Key>::iterator lru;
+    };
+
+    static QMutex s_mutex;
+    static std::map<Key,Entry> s_windows;
+    static std::list<Key> s_lru;    // Most recently used first
+    static size_t s_sizelimit;      // [windows]
+
+    static std::vector<FFTTYPE> build(const Key& key);
+};
+
+#endif // WINDOWCACHE_H
@@ -0,0 +1,101 @@
+/*
+Copyright (C) 2015  Gilles Degottex <gilles.degottex@gmail.com>
+
+This file is part of DFasma.
+
+DFasma is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DFasma is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+A copy of the GNU General Public License is available in the LICENSE.txt
+file provided in the source code of DFasma. Another copy can be found at
+<http://www.gnu.org/licenses/>.
+*/
+
+
+// Checks that the SIMD kernels of the STFT (AVX2 or NEON) give the same
+// values as the generic ones, bit for bit, on random frames
+// with NaN, Inf, clipped and zero values.
+// Without SIMD kernels, the generic ones are compared to themselves.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "stftkernels.h"
+
+static double randomValue(double amp){
+    double value = amp*(2.0*std::rand()/double(RAND_MAX)-1.0);
+    switch(std::rand()%32){
+    case 0: return std::numeric_limits<double>::quiet_NaN();
+    case 1: return std::numeric_limits<double>::infinity();
+    case 2: return -std::numeric_limits<double>::infinity();
+    case 3: return 0.0;
+    case 4: return -0.0;
+    case 5: return std::numeric_limits<double>::denorm_min();
+    }
+    return value;
+}
+
+static bool same(const std::vector<double>& a, const std::vector<double>& b){
+    return a.size()==b.size() && (a.empty() || std::memcmp(&(a[0]), &(b[0]), a.size()*sizeof(double))==0);
+}
+
+int main(){
+    std::srand(0);
+
+    int nbfailed = 0;
+    for(int test=0; test<10000; ++test){
+        int len = 1+std::rand()%67; // Covers the vectors' remainders
+        qreal gain = (test%4==0)?8.0:1.0/(1+std::rand()%4); // Often clips with a big gain
+
+        std::vector<double> wav(len), win(len), values(len);
+        for(int n=0; n<len; ++n){
+            wav[n] = randomValue(2.0);
+            win[n] = (test%8==0)?0.0:std::abs(randomValue(1.0));
+            values[n] = randomValue(20.0);
+        }
+        if(test%16==0)
+            wav.assign(len, 0.0); // Silent frame
+
+        std::vector<double> inref(len), insimd(len);
+        bool nonzeroref = stft_frame_input<double,double>(&(wav[0]), len, gain, &(win[0]), &(inref[0]));
+        bool nonzerosimd = stft_frame_input(&(wav[0]), len, gain, &(win[0]), &(insimd[0]));
+        if(nonzeroref!=nonzerosimd || !same(inref, insimd)){
+            std::printf("stft_frame_input differs (test %d, len %d)\n", test, len);
+            nbfailed++;
+        }
+
+        std::vector<double> outref(len), outsimd(len);
+        double minref = std::numeric_limits<double>::infinity();
+        double maxref = -std::numeric_limits<double>::infinity();
+        double minsimd = minref;
+        double maxsimd = maxref;
+        stft_frame_db<double,double>(&(values[0]), len, &(outref[0]), minref, maxref);
+        stft_frame_db(&(values[0]), len, &(outsimd[0]), minsimd, maxsimd);
+        if(!same(outref, outsimd)
+           || std::memcmp(&minref, &minsimd, sizeof(double))!=0
+           || std::memcmp(&maxref, &maxsimd, sizeof(double))!=0){
+            std::printf("stft_frame_db differs (test %d, len %d)\n", test, len);
+            nbfailed++;
+        }
+    }
+
+    #if defined(__AVX2__)
+    std::printf("Kernels: AVX2\n");
+    #elif defined(__ARM_NEON) && defined(__aarch64__)
+    std::printf("Kernels: NEON\n");
+    #else
+    std::printf("Kernels: generic only\n");
+    #endif
+    std::printf("%d failure(s)\n", nbfailed);
+
+    return nbfailed>0?EXIT_FAILURE:EXIT_SUCCESS;
+}
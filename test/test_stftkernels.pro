@@ -0,0 +1,18 @@
+# Checks that the SIMD kernels of the STFT give the same values as the generic ones.
+#   qmake CONFIG+=sigproc_avx2 test_stftkernels.pro && make && ./test_stftkernels
+# (NEON is used anyway on ARM64)
+
+TEMPLATE = app
+TARGET = test_stftkernels
+CONFIG += console
+CONFIG -= app_bundle
+QT -= gui
+
+CONFIG(sigproc_avx2) {
+    msvc: QMAKE_CXXFLAGS += /arch:AVX2
+    else: QMAKE_CXXFLAGS += -mavx2
+}
+
+INCLUDEPATH += ../src ../external/libqaudioextra/include
+
+SOURCES += test_stftkernels.cpp